@@ -237,7 +237,13 @@ class CoreExport Channel : public Extensible
 	 * @param status The status of the users to write to, e.g. '@' or '%'. Use a value of 0 to write to everyone
 	 * @param except_list List of users not to send to
 	 */
-	void Write(ClientProtocol::Event& protoev, char status = 0, const CUList& except_list = CUList());
+	void Write(ClientProtocol::Event& protoev, char status, const CUList& except_list);
+
+	/** Write to all users on a channel.
+	 * @param protoev Event to send, may contain any number of messages.
+	 * @param status The status of the users to write to, e.g. '@' or '%'. Use a value of 0 to write to everyone
+	 */
+	void Write(ClientProtocol::Event& protoev, char status = 0);
 
 	/** Write to all users on a channel except some users.
 	 * @param protoevprov Protocol event provider for the message.
@@ -245,7 +251,14 @@ class CoreExport Channel : public Extensible
 	 * @param status The status of the users to write to, e.g. '@' or '%'. Use a value of 0 to write to everyone
 	 * @param except_list List of users not to send to
 	 */
-	void Write(ClientProtocol::EventProvider& protoevprov, ClientProtocol::Message& msg, char status = 0, const CUList& except_list = CUList());
+	void Write(ClientProtocol::EventProvider& protoevprov, ClientProtocol::Message& msg, char status, const CUList& except_list);
+
+	/** Write to all users on a channel.
+	 * @param protoevprov Protocol event provider for the message.
+	 * @param msg Message to send.
+	 * @param status The status of the users to write to, e.g. '@' or '%'. Use a value of 0 to write to everyone
+	 */
+	void Write(ClientProtocol::EventProvider& protoevprov, ClientProtocol::Message& msg, char status = 0);
 
 	/** Return the channel's modes with parameters.
 	 * @param showkey If this is set to true, the actual key is shown,
@@ -276,11 +276,32 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 		bool IsOwned() const { return owned; }
 	};
 
-	typedef std::vector<Param> ParamList;
+	/** List of parameters. Most messages have only a few parameters so they are stored inside
+	 * the Message object without allocating memory for them.
+	 */
+	typedef insp::small_vector<Param, 8> ParamList;
 
  private:
 	typedef std::vector<std::pair<SerializedInfo, SerializedMessage> > SerializedList;
 
+	/** Index of the serialized message in serlist that users with a given capability fingerprint get
+	 * from a serializer.
+	 */
+	struct CapGroup
+	{
+		const Serializer* serializer;
+		intptr_t fingerprint;
+		size_t index;
+
+		CapGroup(const Serializer* Ser, intptr_t Fingerprint, size_t Index)
+			: serializer(Ser)
+			, fingerprint(Fingerprint)
+			, index(Index)
+		{
+		}
+	};
+	typedef std::vector<CapGroup> CapGroupList;
+
 	ParamList params;
 	TagMap tags;
 	std::string command;
@@ -288,6 +309,21 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 	mutable SerializedList serlist;
 	bool sideeffect;
 
+	/** True if the tag whitelist of every user only depends on their capability fingerprint.
+	 * Only valid when msginit_done is true.
+	 */
+	bool capgroupable;
+
+	/** Serialized messages already chosen for capability fingerprints, only used when capgroupable is true.
+	 */
+	mutable CapGroupList capgroups;
+
+	/** Find or create the serialized form of the message described by serializeinfo.
+	 * @param serializeinfo Serializer and tag whitelist to use.
+	 * @return Index of the serialized message in serlist.
+	 */
+	size_t GetSerializedIndex(const SerializedInfo& serializeinfo) const;
+
  protected:
 	/** Set command string.
 	 * @param cmd Command string to set.
@@ -310,9 +346,8 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 		, command(cmd ? cmd : std::string())
 		, msginit_done(false)
 		, sideeffect(false)
+		, capgroupable(false)
 	{
-		params.reserve(8);
-		serlist.reserve(8);
 	}
 
 	/** Constructor.
@@ -327,9 +362,8 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 		, command(cmd ? cmd : std::string())
 		, msginit_done(false)
 		, sideeffect(false)
+		, capgroupable(false)
 	{
-		params.reserve(8);
-		serlist.reserve(8);
 	}
 
 	/** Get the parameters of this message.
@@ -432,6 +466,7 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 	void InvalidateCache()
 	{
 		serlist.clear();
+		capgroups.clear();
 	}
 
 	void CopyAll()
@@ -460,11 +495,30 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
  */
 class ClientProtocol::Event
 {
+	/** Messages the hooks of the event chose for users with a given capability fingerprint.
+	 */
+	typedef std::vector<std::pair<intptr_t, MessageList> > CapCache;
+
 	EventProvider* event;
 	Message* initialmsg;
 	const MessageList* initialmsglist;
 	bool eventinit_done;
 
+	/** True if every hook attached to the event only depends on the capabilities of the user, see
+	 * EventHook::caponly. Only valid when eventinit_done is true.
+	 */
+	bool capcacheable;
+
+	/** Results of the hooks by capability fingerprint, only used when capcacheable is true.
+	 */
+	CapCache capcache;
+
+	/** Determines whether every hook attached to the event only depends on the capabilities of the user. */
+	bool IsCapCacheable() const;
+
+	/** Forgets the results of the hooks, called when the initial message(s) change. */
+	void ResetCapCache();
+
  public:
 	/** Constructor.
 	 * @param protoeventprov Protocol event provider the event is an instance of.
@@ -474,6 +528,7 @@ class ClientProtocol::Event
 		, initialmsg(NULL)
 		, initialmsglist(NULL)
 		, eventinit_done(false)
+		, capcacheable(false)
 	{
 	}
 
@@ -486,6 +541,7 @@ class ClientProtocol::Event
 		, initialmsg(&msg)
 		, initialmsglist(NULL)
 		, eventinit_done(false)
+		, capcacheable(false)
 	{
 	}
 
@@ -496,6 +552,7 @@ class ClientProtocol::Event
 	{
 		initialmsg = msg;
 		initialmsglist = NULL;
+		ResetCapCache();
 	}
 
 	/** Set a list of messages as the initial messages in the event.
@@ -505,6 +562,7 @@ class ClientProtocol::Event
 	{
 		initialmsg = NULL;
 		initialmsglist = &msglist;
+		ResetCapCache();
 	}
 
 	/** Get a list of messages to send to a user.
@@ -513,6 +571,13 @@ class ClientProtocol::Event
 	 * @param messagelist List to fill in with messages to send to the user for the event
 	 */
 	void GetMessagesForUser(LocalUser* user, MessageList& messagelist);
+
+	/** Get the message that every user gets for this event if that does not depend on the user.
+	 * This is the case when the event consists of a single message and no hooks are attached to it.
+	 * Callers sending the event to many users can use this to skip GetMessagesForUser().
+	 * @return Message sent to every user, or NULL if GetMessagesForUser() must be called for each user.
+	 */
+	Message* GetUnhookedMessage() const;
 };
 
 /** Base class for message tag providers.
@@ -523,11 +588,20 @@ class ClientProtocol::Event
 class ClientProtocol::MessageTagProvider : public Events::ModuleEventListener
 {
  public:
+	/** True if ShouldSendTag() only depends on the capabilities of the user and has no side effects.
+	 * When all tags of a message are from such providers the tags chosen for a user are reused for all
+	 * other users with the same capability fingerprint, see LocalUser::capfingerprint.
+	 */
+	const bool caponly;
+
 	/** Constructor.
 	 * @param mod Module owning the provider.
+	 * @param CapOnly True if ShouldSendTag() only depends on the capabilities of the user, see caponly.
+	 * Optional, defaults to false.
 	 */
-	MessageTagProvider(Module* mod)
+	MessageTagProvider(Module* mod, bool CapOnly = false)
 		: Events::ModuleEventListener(mod, "event/messagetag")
+		, caponly(CapOnly)
 	{
 	}
 
@@ -575,14 +649,23 @@ class ClientProtocol::EventHook : public Events::ModuleEventListener
 		return "event/protoevent_" + name;
 	}
 
+	/** True if OnPreEventSend() only depends on the capabilities of the user and has no side effects.
+	 * When all hooks of an event are like this the messages chosen for a user are reused for all other
+	 * users with the same capability fingerprint, see LocalUser::capfingerprint.
+	 */
+	const bool caponly;
+
 	/** Constructor.
 	 * @param mod Owner of the hook.
 	 * @param name Name of the event to hook.
 	 * @param priority Priority of the hook. Determines the order in which hooks for the same event get called.
 	 * Optional.
+	 * @param CapOnly True if OnPreEventSend() only depends on the capabilities of the user, see caponly.
+	 * Optional, defaults to false.
 	 */
-	EventHook(Module* mod, const std::string& name, unsigned int priority = Events::ModuleEventListener::DefaultPriority)
+	EventHook(Module* mod, const std::string& name, unsigned int priority = Events::ModuleEventListener::DefaultPriority, bool CapOnly = false)
 		: Events::ModuleEventListener(mod, GetEventName(name), priority)
+		, caponly(CapOnly)
 	{
 	}
 
@@ -625,6 +708,27 @@ class ClientProtocol::EventProvider : public Events::ModuleEventProvider
 	}
 };
 
+inline bool ClientProtocol::Event::IsCapCacheable() const
+{
+	const ::Events::ModuleEventProvider::SubscriberList& hooks = event->GetSubscribers();
+	if (hooks.empty())
+		return false;
+
+	for (::Events::ModuleEventProvider::SubscriberList::const_iterator i = hooks.begin(); i != hooks.end(); ++i)
+	{
+		if (!static_cast<EventHook*>(*i)->caponly)
+			return false;
+	}
+	return true;
+}
+
+inline void ClientProtocol::Event::ResetCapCache()
+{
+	capcache.clear();
+	if (eventinit_done)
+		capcacheable = IsCapCacheable();
+}
+
 /** Commonly used client protocol events.
  * Available via InspIRCd::GetRFCEvents().
  */
@@ -724,3 +828,10 @@ inline ClientProtocol::MessageTagData::MessageTagData(MessageTagProvider* prov,
 	, provdata(data)
 {
 }
+
+inline ClientProtocol::Message* ClientProtocol::Event::GetUnhookedMessage() const
+{
+	if ((!initialmsg) || (event->HasSubscribers()))
+		return NULL;
+	return initialmsg;
+}
@@ -31,70 +31,49 @@ namespace WhoWas
 	{
 		/** Real host
 		 */
-		const std::string host;
+		std::string host;
 
 		/** Displayed host
 		 */
-		const std::string dhost;
+		std::string dhost;
 
 		/** Ident
 		 */
-		const std::string ident;
+		std::string ident;
 
 		/** Server name
 		 */
-		const std::string server;
+		std::string server;
 
 		/** Real name
 		 */
-		const std::string real;
+		std::string real;
 
 		/** Signon time
 		 */
-		const time_t signon;
-
-		/** Initialize this Entry with a user
-		 */
-		Entry(User* user);
-	};
-
-	/** Everything known about one nick
-	 */
-	struct Nick : public insp::intrusive_list_node<Nick>
-	{
-		/** A group of users related by nickname
-		 */
-		typedef std::deque<Entry*> List;
-
-		/** Container where each element has information about one occurrence of this nick
-		 */
-		List entries;
-
-		/** Time this nick was added to the database
-		 */
-		const time_t addtime;
-
-		/** Nickname whose information is stored in this class
-		 */
-		const std::string nick;
-
-		/** Constructor to initialize fields
-		 */
-		Nick(const std::string& nickname);
-
-		/** Destructor, deallocates all elements in the entries container
-		 */
-		~Nick();
+		time_t signon;
 	};
 
 	class Manager
 	{
 	 public:
+		/** A group of users related by nickname, oldest first
+		 */
+		typedef std::vector<Entry> List;
+
 		struct Stats
 		{
-			/** Number of currently existing WhoWas::Entry objects
+			/** Number of entries currently in the database
 			 */
 			size_t entrycount;
+
+			/** Number of bytes of the record store which are in use
+			 */
+			size_t bytesused;
+
+			/** Size of the record store in bytes
+			 */
+			size_t bytesmax;
 		};
 
 		/** Add a user to the whowas database. Called when a user quits.
@@ -111,20 +90,21 @@ namespace WhoWas
 		 */
 		void Maintain();
 
-		/** Updates the current configuration which may result in the database being pruned if the
-		 * new values are lower than the current ones.
-		 * @param NewGroupSize Maximum number of nicks allowed in the database. In case there are this many nicks
-		 * in the database and one more is added, the oldest one is removed (FIFO).
-		 * @param NewMaxGroups Maximum number of entries per nick
-		 * @param NewMaxKeep Seconds how long each nick should be kept
+		/** Updates the current configuration. If anything changed the database is rebuilt with the
+		 * new values, which drops the oldest entries if the new limits are lower than the current ones.
+		 * @param NewGroupSize Maximum number of entries per nick
+		 * @param NewMaxSize Size of the record store in bytes. Once it is full the oldest entry is
+		 * removed (FIFO) whenever a new one is added.
+		 * @param NewMaxKeep Seconds how long each entry should be kept
 		 */
-		void UpdateConfig(unsigned int NewGroupSize, unsigned int NewMaxGroups, unsigned int NewMaxKeep);
+		void UpdateConfig(unsigned int NewGroupSize, size_t NewMaxSize, unsigned int NewMaxKeep);
 
 		/** Retrieves all data known about a given nick
 		 * @param nick Nickname to find, case insensitive (IRC casemapping)
-		 * @return A pointer to a WhoWas::Nick if the nick was found, NULL otherwise
+		 * @param entries List to fill with the entries for the nick, oldest first
+		 * @return True if the nick was found, false otherwise
 		 */
-		const Nick* FindNick(const std::string& nick) const;
+		bool FindNick(const std::string& nick, List& entries) const;
 
 		/** Returns true if WHOWAS is enabled according to the current configuration
 		 * @return True if WHOWAS is enabled according to the configuration, false if WHOWAS is disabled
@@ -135,53 +115,158 @@ namespace WhoWas
 		 */
 		Manager();
 
-		/** Destructor
+	 private:
+		/** Header of a record in the store. The nick, ident, real host, displayed host and real name
+		 * of the user follow the header in this order, without terminators.
 		 */
-		~Manager();
+		struct Record
+		{
+			/** Size of the record including the strings, rounded up to a multiple of the header alignment
+			 */
+			uint32_t size;
 
-	 private:
-		/** Order in which the users were added into the map, used to remove oldest nick
+			/** Offset of the next older record with the same nick
+			 */
+			uint32_t older;
+
+			/** Signon time of the user
+			 */
+			time_t signon;
+
+			/** Time the record was added
+			 */
+			time_t addtime;
+
+			/** Name of the server the user was on, interned in servernames
+			 */
+			const std::string* server;
+
+			/** Lengths of the strings following the header. If the displayed host is the same as the
+			 * real host it is not stored and dhostlen is 0.
+			 */
+			uint16_t nicklen;
+			uint16_t identlen;
+			uint16_t hostlen;
+			uint16_t dhostlen;
+			uint16_t reallen;
+
+			/** Whether the record was removed because its nick has too many entries. Its space is
+			 * reclaimed when it becomes the oldest record.
+			 */
+			bool dead;
+
+			const char* GetNick() const { return reinterpret_cast<const char*>(this + 1); }
+			const char* GetIdent() const { return GetNick() + nicklen; }
+			const char* GetHost() const { return GetIdent() + identlen; }
+			const char* GetDisplayedHost() const { return (dhostlen ? GetHost() + hostlen : GetHost()); }
+			const char* GetRealName() const { return GetHost() + hostlen + dhostlen; }
+		};
+
+		/** Location of the records of a nick
+		 */
+		struct NickInfo
+		{
+			/** Offset of the newest record of the nick
+			 */
+			uint32_t newest;
+
+			/** Number of live records of the nick
+			 */
+			uint32_t count;
+		};
+
+		/** Index of nicks in the store
+		 */
+		typedef TR1NS::unordered_map<std::string, NickInfo, irc::insensitive, irc::StrHashComp> NickIndex;
+
+		/** Interned server names mapped to the number of records referring to them
 		 */
-		typedef insp::intrusive_list_tail<Nick> FIFO;
+		typedef std::map<std::string, size_t> ServerNames;
 
-		/** Sets of users in the whowas system
+		/** Record store. Records are appended at the head and removed from the tail. When a record
+		 * does not fit between the head and the end of the buffer the head wraps around to the start.
 		 */
-		typedef TR1NS::unordered_map<std::string, WhoWas::Nick*, irc::insensitive, irc::StrHashComp> whowas_users;
+		std::vector<char> ring;
 
-		/** Primary container, links nicknames tracked by WHOWAS to a list of records
+		/** Offset of the oldest record
 		 */
-		whowas_users whowas;
+		size_t tail;
 
-		/** List of nicknames in the order they were inserted into the map
+		/** Offset where the next record will be written
 		 */
-		FIFO whowas_fifo;
+		size_t head;
+
+		/** End of the records before the head wrapped around, valid if wrapped is true
+		 */
+		size_t end;
+
+		/** Whether the records are in [tail, end) and [0, head) rather than in [tail, head)
+		 */
+		bool wrapped;
+
+		/** Number of records in the store, including dead ones
+		 */
+		size_t records;
+
+		/** Number of live records in the store
+		 */
+		size_t entries;
+
+		/** Maps nicknames tracked by WHOWAS to their records
+		 */
+		NickIndex nicks;
+
+		/** Server names used by the records
+		 */
+		ServerNames servernames;
 
 		/** Max number of WhoWas entries per user.
 		 */
 		unsigned int GroupSize;
 
-		/** Max number of cumulative user-entries in WhoWas.
-		 * When max reached and added to, push out oldest entry FIFO style.
+		/** Size of the record store in bytes.
 		 */
-		unsigned int MaxGroups;
+		size_t MaxSize;
 
 		/** Max seconds a user is kept in WhoWas before being pruned.
 		 */
 		unsigned int MaxKeep;
 
-		/** Shrink all data structures to honor the current settings
+		Record* GetRecord(size_t offset) { return reinterpret_cast<Record*>(&ring[offset]); }
+		const Record* GetRecord(size_t offset) const { return reinterpret_cast<const Record*>(&ring[offset]); }
+
+		/** Add an entry to the store, removing the oldest records to make room for it if needed
+		 * @param nick Nickname of the entry
+		 * @param ident Ident of the entry
+		 * @param host Real host of the entry
+		 * @param dhost Displayed host of the entry
+		 * @param server Server name of the entry
+		 * @param real Real name of the entry
+		 * @param signon Signon time of the entry
+		 * @param addtime Time the entry was added
+		 */
+		void Store(const std::string& nick, const std::string& ident, const std::string& host, const std::string& dhost,
+			const std::string& server, const std::string& real, time_t signon, time_t addtime);
+
+		/** Copy a record into an entry
+		 * @param rec Record to copy
+		 * @param entry Entry to copy the record into
+		 */
+		static void ReadRecord(const Record* rec, Entry& entry);
+
+		/** Reserve space for a record at the head, removing the oldest records if needed
+		 * @param size Size of the record, must not be larger than the store
+		 * @return Offset of the reserved space
 		 */
-		void Prune();
+		size_t Allocate(size_t size);
 
-		/** Remove a nick (and all entries belonging to it) from the database
-		 * @param it Iterator to the nick to purge
+		/** Remove the oldest record from the store
 		 */
-		void PurgeNick(whowas_users::iterator it);
+		void RemoveOldest();
 
-		/** Remove a nick (and all entries belonging to it) from the database
-		 * @param nick Nick to purge
+		/** Remove all records from the store
 		 */
-		void PurgeNick(WhoWas::Nick* nick);
+		void Clear();
 	};
 }
 
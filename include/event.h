@@ -57,6 +57,12 @@ class Events::ModuleEventProvider : public ServiceProvider, private dynamic_refe
 	 */
 	const SubscriberList& GetSubscribers() const { return prov->subscribers; }
 
+	/** Check whether any object is subscribed to this event.
+	 * Callers firing the event in a loop can use this to skip preparing for it when nobody listens.
+	 * @return True if there is at least one subscriber, false otherwise
+	 */
+	bool HasSubscribers() const { return !GetSubscribers().empty(); }
+
 	friend class ModuleEventListener;
 
  private:
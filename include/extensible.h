@@ -126,6 +126,7 @@ class CoreExport ExtensionManager
  public:
 	typedef std::map<std::string, reference<ExtensionItem> > ExtMap;
 
+	ExtensionManager();
 	bool Register(ExtensionItem* item);
 	void BeginUnregister(Module* module, std::vector<reference<ExtensionItem> >& list);
 	ExtensionItem* GetItem(const std::string& name);
@@ -135,8 +136,15 @@ class CoreExport ExtensionManager
 	 */
 	const ExtMap& GetExts() const { return types; }
 
+	/** Get a counter which changes every time an extension is registered or unregistered.
+	 * Callers caching the result of GetItem() must look the item up again when this changes.
+	 * @return Current generation of the extension map
+	 */
+	unsigned long GetGeneration() const { return generation; }
+
  private:
 	ExtMap types;
+	unsigned long generation;
 };
 
 /** Base class for items that are NOT synchronized between servers */
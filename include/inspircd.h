@@ -49,6 +49,7 @@
 #include "flat_map.h"
 #include "compat.h"
 #include "aligned_storage.h"
+#include "small_vector.h"
 #include "typedefs.h"
 #include "convto.h"
 #include "stdalgo.h"
@@ -131,6 +132,15 @@ class serverstats
 	 * due to timeouts and other latency issues.
 	 */
 	unsigned long DnsBad;
+	/** Number of DNS requests which were answered from the cache
+	 */
+	unsigned long DnsCacheHit;
+	/** Number of DNS requests which could not be answered from the cache
+	 */
+	unsigned long DnsCacheMiss;
+	/** Number of DNS requests which waited for an identical query already in flight
+	 */
+	unsigned long DnsCoalesced;
 	/** Number of inbound connections seen
 	 */
 	unsigned long Connects;
@@ -162,7 +172,8 @@ class serverstats
 	 */
 	serverstats()
 		: Accept(0), Refused(0), Unknown(0), Collisions(0), Dns(0),
-		DnsGood(0), DnsBad(0), Connects(0), Sent(0), Recv(0)
+		DnsGood(0), DnsBad(0), DnsCacheHit(0), DnsCacheMiss(0), DnsCoalesced(0),
+		Connects(0), Sent(0), Recv(0)
 	{
 	}
 };
@@ -600,6 +611,18 @@ inline void Channel::Write(ClientProtocol::EventProvider& protoevprov, ClientPro
 	Write(event, status, except_list);
 }
 
+inline void Channel::Write(ClientProtocol::Event& protoev, char status)
+{
+	const CUList except_list;
+	Write(protoev, status, except_list);
+}
+
+inline void Channel::Write(ClientProtocol::EventProvider& protoevprov, ClientProtocol::Message& msg, char status)
+{
+	ClientProtocol::Event event(protoevprov, msg);
+	Write(event, status);
+}
+
 inline void LocalUser::Send(ClientProtocol::EventProvider& protoevprov, ClientProtocol::Message& msg)
 {
 	ClientProtocol::Event event(protoevprov, msg);
@@ -167,6 +167,16 @@ class CoreExport StreamSocket : public EventHandler
 			data.pop_front();
 		}
 
+		/** Remove the first buffer in the queue and hand its contents over without copying them
+		 * @param out String to swap the contents of the first buffer into
+		 */
+		void pop_front_swap(Element& out)
+		{
+			out.swap(data.front());
+			nbytes -= out.length();
+			data.pop_front();
+		}
+
 		/** Remove bytes from the beginning of the first buffer
 		 * @param n Number of bytes to remove
 		 */
@@ -194,6 +204,26 @@ class CoreExport StreamSocket : public EventHandler
 			nbytes += newdata.length();
 		}
 
+		/** Insert a new buffer at the beginning of the queue without copying it
+		 * @param newdata Data to add, this is left empty
+		 */
+		void push_front_swap(Element& newdata)
+		{
+			data.push_front(Element());
+			data.front().swap(newdata);
+			nbytes += data.front().length();
+		}
+
+		/** Insert a new buffer at the end of the queue without copying it
+		 * @param newdata Data to add, this is left empty
+		 */
+		void push_back_swap(Element& newdata)
+		{
+			data.push_back(Element());
+			data.back().swap(newdata);
+			nbytes += data.back().length();
+		}
+
 		/** Clear the queue
 		 */
 		void clear()
@@ -202,10 +232,13 @@ class CoreExport StreamSocket : public EventHandler
 			nbytes = 0;
 		}
 
+		/** Move all buffers from another queue to the end of this one without copying them
+		 * @param other Queue to take the buffers from, this is left empty
+		 */
 		void moveall(SendQueue& other)
 		{
-			nbytes += other.bytes();
-			data.insert(data.end(), other.data.begin(), other.data.end());
+			for (Container::iterator i = other.data.begin(); i != other.data.end(); ++i)
+				push_back_swap(*i);
 			other.clear();
 		}
 
@@ -246,12 +279,6 @@ class CoreExport StreamSocket : public EventHandler
 	 */
 	void DoRead();
 
-	/** Send as much data contained in a SendQueue object as possible.
-	 * All data which successfully sent will be removed from the SendQueue.
-	 * @param sq SendQueue to flush
-	 */
-	void FlushSendQ(SendQueue& sq);
-
 	/** Read incoming data into a receive queue.
 	 * @param rq Receive queue to put incoming data into
 	 * @return < 0 on error or close, 0 if no new data is ready (but the socket is still connected), > 0 if data was read from the socket and put into the recvq
@@ -285,6 +312,14 @@ class CoreExport StreamSocket : public EventHandler
 	 */
 	void DoWrite();
 
+	/** Send as much data contained in a SendQueue object as possible.
+	 * All data which successfully sent will be removed from the SendQueue.
+	 * This writes straight to the socket so IOHooks should only call it for
+	 * data which they do not need to process, e.g. when the kernel encrypts it.
+	 * @param sq SendQueue to flush
+	 */
+	void FlushSendQ(SendQueue& sq);
+
 	/** Called by the socket engine on a read event
 	 */
 	void OnEventHandlerRead() CXX11_OVERRIDE;
@@ -308,6 +343,8 @@ class CoreExport StreamSocket : public EventHandler
 	virtual void OnDataReady() = 0;
 	/** Called when the socket gets an error from socket engine or IO hook */
 	virtual void OnError(BufferedSocketError e) = 0;
+	/** Called after a write event once as much of the sendq as possible has been written out */
+	virtual void OnDataWritten();
 
 	/** Called when the endpoint addresses are changed.
 	 * @param local The new local endpoint.
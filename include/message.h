@@ -29,6 +29,50 @@ enum MessageType
 	MSG_NOTICE
 };
 
+/** The results of scanning the text of a message which are shared by all of the modules
+ * that need to look at its contents.
+ */
+struct MessageAnalysis
+{
+	/** Whether the message is a CTCP. */
+	bool ctcp;
+
+	/** If the message is a CTCP then the name of the CTCP. */
+	std::string ctcpname;
+
+	/** The position of the body of the message in the text. For a CTCP this is the CTCP body
+	 * and otherwise it is the entire text.
+	 */
+	std::string::size_type bodystart;
+
+	/** The length of the body of the message. */
+	std::string::size_type bodylength;
+
+	/** The number of times each octet occurs in the body of the message. */
+	unsigned int octets[UCHAR_MAX + 1];
+
+	/** The positions of the formatting codes (all control codes except the CTCP delimiter) in the text. */
+	std::vector<std::string::size_type> formatting;
+
+	/** Whether the text is valid UTF-8. */
+	bool utf8;
+
+	/** Counts how many octets in the body of the message are in a set.
+	 * @param chars The set of octets to count.
+	 */
+	template<size_t Size>
+	size_t Count(const std::bitset<Size>& chars) const
+	{
+		size_t count = 0;
+		for (size_t chr = 0; chr < Size && chr <= UCHAR_MAX; ++chr)
+		{
+			if (chars.test(chr))
+				count += octets[chr];
+		}
+		return count;
+	}
+};
+
 class CoreExport MessageDetails
 {
  public:
@@ -73,6 +117,11 @@ class CoreExport MessageDetails
 	/** Determines whether the specified message is a CTCP. */
 	virtual bool IsCTCP() const = 0;
 
+	/** Retrieves the analysis of the text of this message. The text is only scanned the
+	 * first time this is called and again if a module has changed it since.
+	 */
+	virtual const MessageAnalysis& GetAnalysis() const = 0;
+
  protected:
 	MessageDetails(MessageType mt, const std::string& msg, const ClientProtocol::TagMap& tags)
 		: echo(true)
@@ -1064,6 +1064,14 @@ class CoreExport ModuleManager : public fakederef<ModuleManager>
 	 */
 	void Attach(Implementation* i, Module* mod, size_t sz);
 
+	/** Check whether any module is attached to an event.
+	 * Modules are attached to all events when loaded and detached from the ones they do not implement
+	 * when those are first called, so this may return true for a short while after a module is loaded.
+	 * @param i Event type to check
+	 * @return True if at least one module is attached to the event, false otherwise
+	 */
+	bool HasEventHandlers(Implementation i) const { return !EventHandlers[i].empty(); }
+
 	/** Detach all events from a module (used on unload)
 	 * @param mod Module to detach from
 	 */
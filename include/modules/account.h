@@ -28,7 +28,17 @@ typedef StringExtItem AccountExtItem;
 
 inline AccountExtItem* GetAccountExtItem()
 {
-	return static_cast<AccountExtItem*>(ServerInstance->Extensions.GetItem("accountname"));
+	// This is called for every message when account-tag is loaded so avoid looking
+	// the item up by name unless an extension was registered or unregistered since.
+	static AccountExtItem* item = NULL;
+	static unsigned long generation = 0;
+	const unsigned long currgeneration = ServerInstance->Extensions.GetGeneration();
+	if ((currgeneration != generation) || (!generation))
+	{
+		item = static_cast<AccountExtItem*>(ServerInstance->Extensions.GetItem("accountname"));
+		generation = currgeneration;
+	}
+	return item;
 }
 
 class AccountEventListener : public Events::ModuleEventListener
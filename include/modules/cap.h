@@ -34,6 +34,27 @@ namespace Cap
 		ExtItem(Module* mod);
 		std::string serialize(SerializeFormat format, const Extensible* container, void* item) const CXX11_OVERRIDE;
 		void unserialize(SerializeFormat format, Extensible* container, const std::string& value) CXX11_OVERRIDE;
+
+		/** Set the caps of a user and update the capability fingerprint of the user.
+		 * @param user User whose caps to set.
+		 * @param caps New caps of the user.
+		 */
+		void SetCaps(User* user, Ext caps)
+		{
+			set(user, caps);
+			LocalUser* const localuser = IS_LOCAL(user);
+			if (localuser)
+				localuser->capfingerprint = caps;
+		}
+
+		/** Remove all caps of a user and reset the capability fingerprint of the user.
+		 * @param user User whose caps to remove.
+		 */
+		void UnsetCaps(LocalUser* user)
+		{
+			unset(user);
+			user->capfingerprint = 0;
+		}
 	};
 
 	class Capability;
@@ -209,7 +230,7 @@ namespace Cap
 			if (!IsRegistered())
 				return;
 			Ext curr = extitem->get(user);
-			extitem->set(user, (val ? AddToMask(curr) : DelFromMask(curr)));
+			extitem->SetCaps(user, (val ? AddToMask(curr) : DelFromMask(curr)));
 		}
 
 		/** Activate or deactivate the capability.
@@ -93,7 +93,7 @@ class IRCv3::CapTag : public ClientProtocol::MessageTagProvider
 	 * @param Tagname Name of the message tag, to use in the protocol.
 	 */
 	CapTag(Module* mod, const std::string& capname, const std::string& Tagname)
-		: ClientProtocol::MessageTagProvider(mod)
+		: ClientProtocol::MessageTagProvider(mod, true)
 		, cap(mod, capname)
 		, tagname(Tagname)
 	{
@@ -26,13 +26,29 @@ namespace IRCv3
 		class Manager;
 		class API;
 
+		/** Replace the milliseconds in a string returned by FormatTime().
+		 * @param timestr Time in server-time format to modify.
+		 * @param millisecs Milliseconds to set, must be between 0 and 999.
+		 */
+		inline void SetMilliseconds(std::string& timestr, long millisecs)
+		{
+			// The milliseconds are the three digits before the trailing 'Z'
+			std::string::size_type pos = timestr.length() - 2;
+			for (unsigned int i = 0; i < 3; i++, pos--, millisecs /= 10)
+				timestr[pos] = '0' + (millisecs % 10);
+		}
+
 		/** Format a unix timestamp into the format used by server-time.
 		 * @param t Time to format.
+		 * @param millisecs Milliseconds part of the time. Optional, defaults to 0.
 		 * @return Time in server-time format, as a string.
 		 */
-		inline std::string FormatTime(time_t t)
+		inline std::string FormatTime(time_t t, long millisecs = 0)
 		{
-			return InspIRCd::TimeString(t, "%Y-%m-%dT%H:%M:%S.000Z", true);
+			std::string timestr = InspIRCd::TimeString(t, "%Y-%m-%dT%H:%M:%S.000Z", true);
+			if (millisecs)
+				SetMilliseconds(timestr, millisecs);
+			return timestr;
 		}
 	}
 }
@@ -43,14 +43,94 @@ public:
 	}
 };
 
+/** A set of patterns which are compiled together so that text can be matched against
+ * all of them at once.
+ */
+class RegexSet : public classbase
+{
+ public:
+	/** The indices of the patterns which matched some text in ascending order. */
+	typedef std::vector<size_t> MatchList;
+
+	virtual ~RegexSet() { }
+
+	/** Adds a pattern to the set. This must not be called after Compile().
+	 * @param rx The pattern to add.
+	 * @return The index of the pattern within the set.
+	 * @throw RegexException If the pattern is not valid.
+	 */
+	virtual size_t Add(const std::string& rx) = 0;
+
+	/** Compiles the patterns which have been added so the set can be matched.
+	 * @throw RegexException If the patterns could not be compiled.
+	 */
+	virtual void Compile() = 0;
+
+	/** Finds the patterns which match some text.
+	 * @param text The text to match against.
+	 * @param matches The list to store the indices of the matching patterns in.
+	 * @return True if any patterns matched; otherwise, false.
+	 */
+	virtual bool Matches(const std::string& text, MatchList& matches) = 0;
+};
+
 class RegexFactory : public DataProvider
 {
  public:
 	RegexFactory(Module* Creator, const std::string& Name) : DataProvider(Creator, Name) { }
 
 	virtual Regex* Create(const std::string& expr) = 0;
+
+	/** Creates an empty set of patterns. Engines which can match many patterns in one
+	 * pass should override this; the default matches each pattern in turn.
+	 */
+	virtual RegexSet* CreateSet();
+};
+
+/** A set of patterns which are matched one at a time for engines that have no better way. */
+class SimpleRegexSet : public RegexSet
+{
+	/** The factory which creates the patterns. */
+	RegexFactory* const factory;
+
+	/** The patterns in this set. */
+	std::vector<Regex*> regexes;
+
+ public:
+	SimpleRegexSet(RegexFactory* Factory) : factory(Factory) { }
+
+	~SimpleRegexSet()
+	{
+		stdalgo::delete_all(regexes);
+	}
+
+	size_t Add(const std::string& rx) CXX11_OVERRIDE
+	{
+		regexes.push_back(factory->Create(rx));
+		return regexes.size() - 1;
+	}
+
+	void Compile() CXX11_OVERRIDE
+	{
+	}
+
+	bool Matches(const std::string& text, MatchList& matches) CXX11_OVERRIDE
+	{
+		matches.clear();
+		for (size_t i = 0; i < regexes.size(); ++i)
+		{
+			if (regexes[i]->Matches(text))
+				matches.push_back(i);
+		}
+		return !matches.empty();
+	}
 };
 
+inline RegexSet* RegexFactory::CreateSet()
+{
+	return new SimpleRegexSet(this);
+}
+
 class RegexException : public ModuleException
 {
  public:
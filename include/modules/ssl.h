@@ -164,7 +164,7 @@ class SSLIOHook : public IOHook
 		// This adds a single copy of the queue, but avoids
 		// much more overhead in terms of system calls invoked
 		// by an IOHook.
-		std::string tmp;
+		StreamSocket::SendQueue::Element tmp;
 		tmp.reserve(std::min(targetsize, sendq.bytes())+1);
 		do
 		{
@@ -172,7 +172,7 @@ class SSLIOHook : public IOHook
 			sendq.pop_front();
 		}
 		while (!sendq.empty() && tmp.length() < targetsize);
-		sendq.push_front(tmp);
+		sendq.push_front_swap(tmp);
 	}
 
  public:
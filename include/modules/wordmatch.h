@@ -0,0 +1,278 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+namespace WordMatch
+{
+	class Matcher;
+	struct Occurrence;
+
+	/** A list of occurrences of words in some text. */
+	typedef std::vector<Occurrence> OccurrenceList;
+}
+
+/** An occurrence of a word in some text. */
+struct WordMatch::Occurrence
+{
+	/** The position of the first byte of the word in the text. */
+	size_t start;
+
+	/** The length of the word in bytes. */
+	size_t length;
+
+	/** The identifier which the word was added with. */
+	size_t id;
+
+	Occurrence(size_t Start, size_t Length, size_t Id)
+		: start(Start)
+		, length(Length)
+		, id(Id)
+	{
+	}
+
+	/** Orders occurrences by their position and then longest first. */
+	bool operator<(const Occurrence& other) const
+	{
+		if (start != other.start)
+			return start < other.start;
+		return length > other.length;
+	}
+};
+
+/** Finds any number of words in some text in a single pass using the Aho-Corasick algorithm
+ * so the cost of searching does not depend on how many words there are. Words are compared
+ * using a case map which is the national case map by default.
+ */
+class WordMatch::Matcher
+{
+	struct Node
+	{
+		/** The children of this node sorted by the folded byte which leads to them. */
+		std::vector<std::pair<unsigned char, size_t> > children;
+
+		/** The node for the longest proper suffix of the string this node represents. */
+		size_t fail;
+
+		/** The nearest node on the fail chain which has words or 0 if there is none. */
+		size_t dict;
+
+		/** The identifiers and lengths of the words which end at this node. */
+		std::vector<std::pair<size_t, size_t> > words;
+
+		Node() : fail(0), dict(0) { }
+	};
+
+	/** Collects every occurrence which is found. */
+	struct Collector
+	{
+		OccurrenceList& list;
+		Collector(OccurrenceList& List) : list(List) { }
+
+		bool operator()(const Occurrence& occurrence)
+		{
+			list.push_back(occurrence);
+			return true;
+		}
+	};
+
+	/** The case map which was requested or NULL for the national case map. */
+	const unsigned char* const map;
+
+	/** The case map which words and text are folded with. */
+	const unsigned char* casemap;
+
+	/** The nodes of the trie. The first node is the root. */
+	std::vector<Node> nodes;
+
+	/** The children of the root node indexed by folded byte as most searches start there. */
+	size_t roots[256];
+
+	/** Whether the fail links are up to date. */
+	bool compiled;
+
+	/** Retrieves the child of a node for a folded byte or 0 if there is none. */
+	size_t GetChild(size_t node, unsigned char chr) const
+	{
+		if (!node)
+			return roots[chr];
+
+		const std::vector<std::pair<unsigned char, size_t> >& children = nodes[node].children;
+		std::vector<std::pair<unsigned char, size_t> >::const_iterator it = std::lower_bound(children.begin(), children.end(), std::make_pair(chr, static_cast<size_t>(0)));
+		return (it != children.end() && it->first == chr) ? it->second : 0;
+	}
+
+ public:
+	/** Creates a new matcher with no words.
+	 * @param map The case map to compare words with or NULL for the national case map.
+	 */
+	Matcher(const unsigned char* Map = NULL)
+		: map(Map)
+	{
+		Clear();
+	}
+
+	/** Removes all words from this matcher. The national case map is looked up again so
+	 * words added afterwards use the current one.
+	 */
+	void Clear()
+	{
+		casemap = map ? map : national_case_insensitive_map;
+		nodes.assign(1, Node());
+		std::fill(roots, roots + 256, 0);
+		compiled = true;
+	}
+
+	/** Determines whether any words have been added to this matcher. */
+	bool Empty() const
+	{
+		return nodes.size() == 1;
+	}
+
+	/** Adds a word to this matcher. Compile() must be called before searching again.
+	 * @param word The word to add. Empty words are ignored.
+	 * @param id The identifier to report occurrences of the word with.
+	 */
+	void Add(const std::string& word, size_t id)
+	{
+		if (word.empty())
+			return;
+
+		size_t node = 0;
+		for (std::string::const_iterator i = word.begin(); i != word.end(); ++i)
+		{
+			const unsigned char chr = casemap[static_cast<unsigned char>(*i)];
+			size_t child = GetChild(node, chr);
+			if (!child)
+			{
+				child = nodes.size();
+				if (node)
+				{
+					std::vector<std::pair<unsigned char, size_t> >& children = nodes[node].children;
+					children.insert(std::lower_bound(children.begin(), children.end(), std::make_pair(chr, child)), std::make_pair(chr, child));
+				}
+				else
+					roots[chr] = child;
+				nodes.push_back(Node());
+			}
+			node = child;
+		}
+		nodes[node].words.push_back(std::make_pair(id, word.length()));
+		compiled = false;
+	}
+
+	/** Links the words which have been added so this matcher can be searched. */
+	void Compile()
+	{
+		if (compiled)
+			return;
+
+		// Visiting the nodes in breadth-first order means that every suffix of a node
+		// has already been linked when the node is reached.
+		std::deque<size_t> queue;
+		for (size_t chr = 0; chr < 256; ++chr)
+		{
+			if (roots[chr])
+			{
+				nodes[roots[chr]].fail = nodes[roots[chr]].dict = 0;
+				queue.push_back(roots[chr]);
+			}
+		}
+
+		while (!queue.empty())
+		{
+			const size_t parent = queue.front();
+			queue.pop_front();
+
+			const std::vector<std::pair<unsigned char, size_t> >& children = nodes[parent].children;
+			for (std::vector<std::pair<unsigned char, size_t> >::const_iterator i = children.begin(); i != children.end(); ++i)
+			{
+				size_t fail = nodes[parent].fail;
+				while (fail && !GetChild(fail, i->first))
+					fail = nodes[fail].fail;
+				fail = GetChild(fail, i->first);
+
+				Node& child = nodes[i->second];
+				child.fail = fail;
+				child.dict = nodes[fail].words.empty() ? nodes[fail].dict : fail;
+				queue.push_back(i->second);
+			}
+		}
+		compiled = true;
+	}
+
+	/** Searches some text for every occurrence of the words in this matcher.
+	 * @param text The text to search.
+	 * @param handler A function object which is called with each Occurrence in order of
+	 * where it ends and returns false to stop searching.
+	 */
+	template <typename Handler>
+	void Search(const std::string& text, Handler& handler) const
+	{
+		size_t node = 0;
+		for (size_t pos = 0; pos < text.length(); ++pos)
+		{
+			const unsigned char chr = casemap[static_cast<unsigned char>(text[pos])];
+
+			size_t next;
+			while (!(next = GetChild(node, chr)) && node)
+				node = nodes[node].fail;
+			node = next;
+
+			for (size_t out = nodes[node].words.empty() ? nodes[node].dict : node; out; out = nodes[out].dict)
+			{
+				const std::vector<std::pair<size_t, size_t> >& words = nodes[out].words;
+				for (std::vector<std::pair<size_t, size_t> >::const_iterator i = words.begin(); i != words.end(); ++i)
+				{
+					if (!handler(Occurrence(pos + 1 - i->second, i->second, i->first)))
+						return;
+				}
+			}
+		}
+	}
+
+	/** Finds every occurrence of the words in this matcher in some text.
+	 * @param text The text to search.
+	 * @param occurrences The list to store the occurrences in, ordered by position.
+	 * @param overlapping If false then only the leftmost longest occurrences which do not
+	 * overlap each other are returned, as is wanted when replacing the words.
+	 * @return True if any words were found; otherwise, false.
+	 */
+	bool FindAll(const std::string& text, OccurrenceList& occurrences, bool overlapping = true) const
+	{
+		occurrences.clear();
+		Collector collector(occurrences);
+		Search(text, collector);
+		std::sort(occurrences.begin(), occurrences.end());
+
+		if (!overlapping)
+		{
+			size_t end = 0;
+			OccurrenceList::iterator out = occurrences.begin();
+			for (OccurrenceList::const_iterator i = occurrences.begin(); i != occurrences.end(); ++i)
+			{
+				if (i->start < end)
+					continue;
+
+				end = i->start + i->length;
+				*out++ = *i;
+			}
+			occurrences.erase(out, occurrences.end());
+		}
+		return !occurrences.empty();
+	}
+};
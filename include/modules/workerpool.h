@@ -0,0 +1,182 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <deque>
+
+namespace WorkerPool
+{
+	class Job;
+	class Pool;
+	class Worker;
+}
+
+/** A piece of work which is done on a worker thread. */
+class WorkerPool::Job
+{
+ public:
+	virtual ~Job() { }
+
+	/** Does the work. This is called on a worker thread so it must not touch
+	 * anything which the main thread might be using at the same time.
+	 */
+	virtual void Run() = 0;
+
+	/** Called on the main thread after Run() has returned. The job is deleted
+	 * when this returns.
+	 */
+	virtual void Finish() = 0;
+};
+
+/** A thread which runs jobs one at a time and hands them back to the main thread. */
+class WorkerPool::Worker : public SocketThread
+{
+	/** Jobs which are waiting to be run, guarded by the queue lock. */
+	std::deque<Job*> queue;
+
+	/** Jobs which have been run but not finished, guarded by the queue lock. */
+	std::deque<Job*> done;
+
+ public:
+	/** Queues a job to be run by this worker.
+	 * @param job The job to run. The worker takes ownership of it.
+	 */
+	void Submit(Job* job)
+	{
+		LockQueue();
+		queue.push_back(job);
+		UnlockQueueWakeup();
+	}
+
+	void Run() CXX11_OVERRIDE
+	{
+		LockQueue();
+		while (!GetExitFlag())
+		{
+			if (queue.empty())
+			{
+				WaitForQueue();
+				continue;
+			}
+
+			Job* job = queue.front();
+			queue.pop_front();
+
+			UnlockQueue();
+			job->Run();
+			LockQueue();
+
+			done.push_back(job);
+			NotifyParent();
+		}
+		UnlockQueue();
+	}
+
+	void OnNotify() CXX11_OVERRIDE
+	{
+		std::deque<Job*> finished;
+		LockQueue();
+		finished.swap(done);
+		UnlockQueue();
+
+		for (std::deque<Job*>::iterator i = finished.begin(); i != finished.end(); ++i)
+		{
+			Job* job = *i;
+			job->Finish();
+			delete job;
+		}
+	}
+
+	/** Stops the thread and runs any jobs which it had not got to yet on the
+	 * calling thread so that every submitted job is finished.
+	 */
+	void Shutdown()
+	{
+		join();
+
+		for (std::deque<Job*>::iterator i = queue.begin(); i != queue.end(); ++i)
+		{
+			(*i)->Run();
+			done.push_back(*i);
+		}
+		queue.clear();
+		OnNotify();
+	}
+};
+
+/** A fixed size set of worker threads which jobs are spread across. */
+class WorkerPool::Pool
+{
+	/** The threads in this pool. */
+	std::vector<Worker*> workers;
+
+	/** The index of the worker which will be given the next job. */
+	size_t next;
+
+	/** Stops every thread in this pool and finishes their jobs. */
+	void Stop()
+	{
+		for (std::vector<Worker*>::iterator i = workers.begin(); i != workers.end(); ++i)
+		{
+			Worker* worker = *i;
+			worker->Shutdown();
+			delete worker;
+		}
+		workers.clear();
+	}
+
+ public:
+	/** Starts a new worker pool.
+	 * @param threads The number of worker threads to start.
+	 */
+	Pool(unsigned int threads)
+		: next(0)
+	{
+		for (unsigned int i = 0; i < threads; ++i)
+		{
+			Worker* worker = new Worker;
+			try
+			{
+				ServerInstance->Threads.Start(worker);
+			}
+			catch (CoreException&)
+			{
+				delete worker;
+				Stop();
+				throw;
+			}
+			workers.push_back(worker);
+		}
+	}
+
+	~Pool()
+	{
+		Stop();
+	}
+
+	/** Queues a job to be run by one of the threads in this pool.
+	 * @param job The job to run. The pool takes ownership of it.
+	 */
+	void Submit(Job* job)
+	{
+		workers[next++ % workers.size()]->Submit(job);
+	}
+
+	/** Retrieves the number of threads in this pool. */
+	size_t GetSize() const { return workers.size(); }
+};
@@ -24,6 +24,7 @@
 namespace Numeric
 {
 	class Numeric;
+	class Generator;
 }
 
 class Numeric::Numeric
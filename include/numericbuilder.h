@@ -35,8 +35,107 @@ namespace Numeric
 
 	template <unsigned int NumStaticParams, bool SendEmpty = false>
 	class ParamBuilder;
+
+	class QueuedReply;
+	class QueuedReplySink;
 }
 
+/** Produces a reply which may be too large to send at once, such as a long list. The reply is sent
+ * in parts as the sendq of the user drains, see LocalUser::AddGenerator(). Every call to Generate()
+ * should send a small part of the reply, such as a single numeric.
+ */
+class Numeric::Generator
+{
+ public:
+	/** The module which created the generator. Its generators are discarded when it is unloaded. */
+	Module* const creator;
+
+	Generator(Module* mod)
+		: creator(mod)
+	{
+	}
+
+	virtual ~Generator() { }
+
+	/** Send the next part of the reply.
+	 * @param user The user the reply is being sent to.
+	 * @return True if there is more to send, false if the reply is complete.
+	 */
+	virtual bool Generate(LocalUser* user) = 0;
+
+	/** Get the approximate size of the part of the reply which is held in memory waiting to be sent.
+	 * This is counted against the hard sendq limit of the user as if it was already in the sendq.
+	 * The default implementation returns 0 which is right for generators which build each part
+	 * when it is sent.
+	 * @return Size of the pending part of the reply in bytes.
+	 */
+	virtual size_t GetPendingSize() const { return 0; }
+};
+
+/** A reply made of numerics which are all built when the reply is created and kept in memory until
+ * they are sent, in the order they were added. Only writing them to the sendq is deferred so their
+ * size is reported by GetPendingSize().
+ */
+class Numeric::QueuedReply : public Generator
+{
+	std::deque<Numeric> numerics;
+
+	/** Approximate size of the numerics in numerics. */
+	size_t pendingsize;
+
+	static size_t GetSize(const Numeric& numeric)
+	{
+		// Leave some room for the source, the numeric itself and the target.
+		size_t size = 16;
+		const CommandBase::Params& params = numeric.GetParams();
+		for (CommandBase::Params::const_iterator i = params.begin(); i != params.end(); ++i)
+			size += i->length() + 2;
+		return size;
+	}
+
+ public:
+	QueuedReply(Module* mod)
+		: Generator(mod)
+		, pendingsize(0)
+	{
+	}
+
+	void Add(const Numeric& numeric)
+	{
+		numerics.push_back(numeric);
+		pendingsize += GetSize(numeric);
+	}
+
+	bool Generate(LocalUser* user) CXX11_OVERRIDE
+	{
+		if (numerics.empty())
+			return false;
+
+		pendingsize -= GetSize(numerics.front());
+		user->WriteNumeric(numerics.front());
+		numerics.pop_front();
+		return !numerics.empty();
+	}
+
+	size_t GetPendingSize() const CXX11_OVERRIDE { return pendingsize; }
+};
+
+class Numeric::QueuedReplySink
+{
+	QueuedReply& reply;
+
+ public:
+	QueuedReplySink(QueuedReply& r)
+		: reply(r)
+	{
+	}
+
+	void operator()(Numeric& numeric) const
+	{
+		reply.Add(numeric);
+	}
+};
+
 class Numeric::WriteNumericSink
 {
 	LocalUser* const user;
@@ -0,0 +1,304 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+namespace RateLimit
+{
+	class Bucket;
+	template <typename Key, typename Hash = TR1NS::hash<Key> > class Table;
+
+	/** Retrieves the current time in milliseconds as used by the rate limiter. */
+	inline uint64_t Now()
+	{
+		return static_cast<uint64_t>(ServerInstance->Time()) * 1000 + ServerInstance->Time_ns() / 1000000;
+	}
+}
+
+/** A token bucket which holds up to a given number of tokens and refills completely over
+ * a given period. Rather than a token count the bucket stores the time at which it will be
+ * full again so refilling is computed lazily from the current time and never needs a timer.
+ * The limit and period are passed to each call so they can be changed at any time without
+ * having to reset the bucket.
+ */
+class RateLimit::Bucket
+{
+	/** The time in milliseconds at which this bucket will be full again. */
+	uint64_t full;
+
+	/** Retrieves the number of milliseconds it takes for a single token to refill. */
+	static uint64_t Cost(unsigned int limit, unsigned int period)
+	{
+		return static_cast<uint64_t>(period) * 1000 / limit;
+	}
+
+ public:
+	Bucket()
+		: full(0)
+	{
+	}
+
+	/** Determines whether a token can be taken from this bucket.
+	 * @param limit The maximum number of tokens this bucket can hold.
+	 * @param period The number of seconds it takes for an empty bucket to refill.
+	 * @param now The current time as returned by RateLimit::Now().
+	 * @return True if a token is available; otherwise, false.
+	 */
+	bool CanTake(unsigned int limit, unsigned int period, uint64_t now) const
+	{
+		if (!limit)
+			return false;
+
+		// The bucket is empty once it is a whole period away from being full.
+		return std::max(full, now) + Cost(limit, period) <= now + static_cast<uint64_t>(period) * 1000;
+	}
+
+	/** Takes a token from this bucket if one is available.
+	 * @param limit The maximum number of tokens this bucket can hold.
+	 * @param period The number of seconds it takes for an empty bucket to refill.
+	 * @param now The current time as returned by RateLimit::Now().
+	 * @return True if a token was taken; otherwise, false.
+	 */
+	bool Take(unsigned int limit, unsigned int period, uint64_t now)
+	{
+		if (!CanTake(limit, period, now))
+			return false;
+
+		full = std::max(full, now) + Cost(limit, period);
+		return true;
+	}
+
+	/** Empties this bucket so no tokens are available until it has refilled.
+	 * @param period The number of seconds it takes for an empty bucket to refill.
+	 * @param now The current time as returned by RateLimit::Now().
+	 */
+	void Drain(unsigned int period, uint64_t now)
+	{
+		full = now + static_cast<uint64_t>(period) * 1000;
+	}
+
+	/** Refills this bucket immediately. */
+	void Reset()
+	{
+		full = 0;
+	}
+
+	/** Determines whether this bucket is full. A full bucket is indistinguishable from a new one.
+	 * @param now The current time as returned by RateLimit::Now().
+	 */
+	bool IsFull(uint64_t now) const
+	{
+		return full <= now;
+	}
+
+	/** Retrieves the time in milliseconds at which this bucket will be full again. */
+	uint64_t GetFullTime() const
+	{
+		return full;
+	}
+};
+
+/** A table of token buckets keyed by the target they limit. The buckets are kept in a flat
+ * open addressed array and a key can only live in a small window of slots after its hash,
+ * so every operation is constant time. Slots whose bucket has refilled carry no state and
+ * are reused by other keys without ever needing to be expired. The table only allocates
+ * when every slot in a window is in use, in which case it doubles in size until it reaches
+ * MaxSize. Buckets which still do not fit are kept in an overflow map rather than evicted
+ * as a bucket which is dropped early would lift a limit, e.g. a kick-rejoin block.
+ */
+template <typename Key, typename Hash>
+class RateLimit::Table
+{
+	struct Slot
+	{
+		Key key;
+		Bucket bucket;
+
+		Slot()
+			: key()
+		{
+		}
+	};
+
+	typedef std::vector<Slot> SlotList;
+	typedef TR1NS::unordered_map<Key, Bucket, Hash> OverflowMap;
+
+	/** The number of slots after its hash a key can live in. */
+	static const size_t Window = 8;
+
+	/** The maximum number of slots the table will grow to. */
+	static const size_t MaxSize = 4096;
+
+	/** The slots in this table. The size is always a power of two. */
+	SlotList slots;
+
+	/** Buckets which are refilling but did not fit into their window. */
+	OverflowMap overflow;
+
+	/** The size of the overflow map at which the buckets in it which have refilled are removed. */
+	size_t overflowpurge;
+
+	/** Adds a bucket which did not fit into its window to the overflow map. */
+	void AddOverflow(const Key& key, const Bucket& bucket, uint64_t now)
+	{
+		if (overflow.size() >= overflowpurge)
+		{
+			for (typename OverflowMap::iterator i = overflow.begin(); i != overflow.end(); )
+			{
+				if (i->second.IsFull(now))
+					overflow.erase(i++);
+				else
+					++i;
+			}
+			overflowpurge = std::max<size_t>(Window, overflow.size() * 2);
+		}
+		overflow[key] = bucket;
+	}
+
+	/** Retrieves the first slot in the window for the specified key. */
+	static size_t GetIndex(const SlotList& list, const Key& key)
+	{
+		// Pointers and small integers hash to themselves so mix the high bits in.
+		size_t hash = Hash()(key);
+		hash ^= hash >> 15;
+		hash *= 0x2c1b3c6dU;
+		hash ^= hash >> 12;
+		return hash & (list.size() - 1);
+	}
+
+	/** Finds an unused slot for a key in the specified slot list.
+	 * @return The unused slot or NULL if the window is full.
+	 */
+	static Slot* FindFree(SlotList& list, const Key& key, uint64_t now)
+	{
+		const size_t mask = list.size() - 1;
+		for (size_t i = GetIndex(list, key), n = 0; n < Window; i = (i + 1) & mask, ++n)
+		{
+			if (list[i].bucket.IsFull(now))
+				return &list[i];
+		}
+		return NULL;
+	}
+
+	/** Moves all buckets which are still refilling into a table twice the size. */
+	void Grow(uint64_t now)
+	{
+		SlotList newslots(slots.size() * 2);
+		for (typename SlotList::const_iterator i = slots.begin(); i != slots.end(); ++i)
+		{
+			if (i->bucket.IsFull(now))
+				continue;
+
+			Slot* slot = FindFree(newslots, i->key, now);
+			if (slot)
+				*slot = *i;
+			else
+				AddOverflow(i->key, i->bucket, now);
+		}
+		slots.swap(newslots);
+	}
+
+	/** Finds the bucket for the specified key.
+	 * @return The bucket or NULL if the key does not have a bucket.
+	 */
+	const Bucket* Find(const Key& key) const
+	{
+		const size_t mask = slots.size() - 1;
+		for (size_t i = GetIndex(slots, key), n = 0; n < Window; i = (i + 1) & mask, ++n)
+		{
+			if (slots[i].key == key)
+				return &slots[i].bucket;
+		}
+
+		if (!overflow.empty())
+		{
+			typename OverflowMap::const_iterator it = overflow.find(key);
+			if (it != overflow.end())
+				return &it->second;
+		}
+		return NULL;
+	}
+
+	/** Finds or creates the bucket for the specified key. */
+	Bucket& Get(const Key& key, uint64_t now)
+	{
+		Bucket* bucket = const_cast<Bucket*>(Find(key));
+		if (bucket)
+			return *bucket;
+
+		Slot* slot;
+		while (!(slot = FindFree(slots, key, now)))
+		{
+			if (slots.size() >= MaxSize)
+			{
+				// Every slot in the window is in use and the table can't grow any more.
+				AddOverflow(key, Bucket(), now);
+				return overflow[key];
+			}
+			Grow(now);
+		}
+
+		slot->key = key;
+		slot->bucket.Reset();
+		return slot->bucket;
+	}
+
+ public:
+	/** Initialises a new table of token buckets.
+	 * @param size The initial number of slots. Must be a power of two.
+	 */
+	Table(size_t size = 16)
+		: slots(size)
+		, overflowpurge(Window)
+	{
+	}
+
+	/** Determines whether a token can be taken from the bucket for the specified key.
+	 * @see RateLimit::Bucket::CanTake
+	 */
+	bool CanTake(const Key& key, unsigned int limit, unsigned int period, uint64_t now) const
+	{
+		const Bucket* bucket = Find(key);
+		if (!bucket)
+			return Bucket().CanTake(limit, period, now);
+		return bucket->CanTake(limit, period, now);
+	}
+
+	/** Takes a token from the bucket for the specified key if one is available.
+	 * @see RateLimit::Bucket::Take
+	 */
+	bool Take(const Key& key, unsigned int limit, unsigned int period, uint64_t now)
+	{
+		return Get(key, now).Take(limit, period, now);
+	}
+
+	/** Empties the bucket for the specified key.
+	 * @see RateLimit::Bucket::Drain
+	 */
+	void Drain(const Key& key, unsigned int period, uint64_t now)
+	{
+		Get(key, now).Drain(period, now);
+	}
+
+	/** Refills the bucket for the specified key immediately. */
+	void Reset(const Key& key)
+	{
+		Bucket* bucket = const_cast<Bucket*>(Find(key));
+		if (bucket)
+			bucket->Reset();
+	}
+};
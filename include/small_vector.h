@@ -0,0 +1,168 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+
+#include "compat.h"
+
+namespace insp
+{
+	template <typename T, size_t N> class small_vector;
+}
+
+/** A vector which stores up to N elements inside the object itself and only allocates
+ * memory from the heap once it grows larger than that. Only the subset of the std::vector
+ * interface needed by the code using it is provided.
+ */
+template <typename T, size_t N>
+class insp::small_vector
+{
+ public:
+	typedef T value_type;
+	typedef T* iterator;
+	typedef const T* const_iterator;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+
+ private:
+	/** Storage for the first N elements. */
+	typename TR1NS::aligned_storage<sizeof(T) * N, TR1NS::alignment_of<T>::value>::type inlinedata;
+
+	/** Pointer to the first element, either inlinedata or a heap allocated array. */
+	T* first;
+
+	/** Number of elements constructed. */
+	size_type count;
+
+	/** Number of elements the current storage can hold. */
+	size_type cap;
+
+	T* InlineData() { return static_cast<T*>(static_cast<void*>(&inlinedata)); }
+	bool IsInline() const { return (first == static_cast<const T*>(static_cast<const void*>(&inlinedata))); }
+
+	void Destroy()
+	{
+		for (size_type i = 0; i < count; ++i)
+			first[i].~T();
+		count = 0;
+	}
+
+	void Grow(size_type newcap)
+	{
+		T* const newdata = static_cast<T*>(::operator new(sizeof(T) * newcap));
+		for (size_type i = 0; i < count; ++i)
+		{
+			new(newdata + i) T(first[i]);
+			first[i].~T();
+		}
+
+		if (!IsInline())
+			::operator delete(first);
+		first = newdata;
+		cap = newcap;
+	}
+
+	void CopyFrom(const small_vector& other)
+	{
+		reserve(other.count);
+		for (size_type i = 0; i < other.count; ++i)
+			new(first + i) T(other.first[i]);
+		count = other.count;
+	}
+
+ public:
+	small_vector()
+		: first(InlineData())
+		, count(0)
+		, cap(N)
+	{
+	}
+
+	small_vector(const small_vector& other)
+		: first(InlineData())
+		, count(0)
+		, cap(N)
+	{
+		CopyFrom(other);
+	}
+
+	~small_vector()
+	{
+		Destroy();
+		if (!IsInline())
+			::operator delete(first);
+	}
+
+	small_vector& operator=(const small_vector& other)
+	{
+		if (&other != this)
+		{
+			Destroy();
+			CopyFrom(other);
+		}
+		return *this;
+	}
+
+	size_type size() const { return count; }
+	bool empty() const { return (count == 0); }
+	size_type capacity() const { return cap; }
+
+	void reserve(size_type n)
+	{
+		if (n > cap)
+			Grow(n);
+	}
+
+	void clear() { Destroy(); }
+
+	void push_back(const T& val)
+	{
+		if (count == cap)
+		{
+			// val may be an element of this vector, copy it before the storage moves
+			const T copy(val);
+			Grow(cap * 2);
+			new(first + count) T(copy);
+		}
+		else
+			new(first + count) T(val);
+		count++;
+	}
+
+	void pop_back()
+	{
+		first[--count].~T();
+	}
+
+	iterator begin() { return first; }
+	iterator end() { return first + count; }
+	const_iterator begin() const { return first; }
+	const_iterator end() const { return first + count; }
+
+	reference operator[](size_type index) { return first[index]; }
+	const_reference operator[](size_type index) const { return first[index]; }
+
+	reference front() { return first[0]; }
+	reference back() { return first[count-1]; }
+	const_reference front() const { return first[0]; }
+	const_reference back() const { return first[count-1]; }
+};
@@ -31,6 +31,7 @@ class TestSuite
 	bool DoCommaSepStreamTests();
 	bool DoSpaceSepStreamTests();
 	bool DoGenerateUIDTests();
+	bool DoSerializerBenchmark();
 };
 
 #endif
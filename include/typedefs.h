@@ -27,6 +27,7 @@ class Channel;
 class Command;
 class ConfigStatus;
 class ConfigTag;
+class CUList;
 class Extensible;
 class FakeUser;
 class InspIRCd;
@@ -107,9 +108,6 @@ typedef std::pair<ConfigIter,ConfigIter> ConfigTagList;
 /** Files read by the configuration */
 typedef std::map<std::string, file_cache> ConfigFileCache;
 
-/** Generic user list, used for exceptions */
-typedef std::set<User*> CUList;
-
 /** Contains an ident and host split into two strings
  */
 typedef std::pair<std::string, std::string> IdentHostPair;
@@ -216,6 +216,8 @@ struct CoreExport ConnectClass : public refcountbase
 	}
 };
 
+typedef unsigned int already_sent_t;
+
 /** Holds all information about a user
  * This class stores all information about a user connected to the irc server. Everything about a
  * connection is stored here primarily, from the user's socket ID (file descriptor) through to the
@@ -261,6 +263,12 @@ class CoreExport User : public Extensible
 	 */
 	std::bitset<ModeParser::MODEID_MAX> modes;
 
+	/** Id of the CUList which has marked this user as a member of it or 0 if no list has.
+	 */
+	already_sent_t except_id;
+
+	friend class CUList;
+
  public:
 	/** To execute a function for each local neighbor of a user, inherit from this class and
 	 * pass an instance of it to User::ForEachNeighbor().
@@ -679,6 +687,60 @@ class CoreExport User : public Extensible
 	CullResult cull() CXX11_OVERRIDE;
 };
 
+/** A set of users who are excepted from receiving a message sent to a channel.
+ * Instead of allocating a node per entry the membership of a user is recorded in the user
+ * itself using an id obtained from UserManager::NextAlreadySentId(), making both insertion
+ * and lookup O(1). A user can only be marked by one list at a time so if a user who is
+ * marked by another live list is inserted they are kept in a small sorted vector instead.
+ * This only happens when lists which share users are alive at the same time, for example
+ * when a module builds a list while the core is building another one.
+ */
+class CoreExport CUList
+{
+	/** Id of this list, 0 until the first user is inserted. */
+	already_sent_t id;
+
+	/** Users who were marked with the id of this list, their marks are cleared when the list is destroyed. */
+	std::vector<User*> marked;
+
+	/** Users who were already marked by another list when they were inserted. */
+	insp::flat_set<User*> shared;
+
+	// uncopyable
+	CUList(const CUList&);
+	void operator=(const CUList&);
+
+ public:
+	CUList() : id(0) { }
+	~CUList();
+
+	/** Add a user to the list. Adding a user who is already in the list has no effect.
+	 * @param user User to add.
+	 */
+	void insert(User* user);
+
+	/** Check whether a user is in the list.
+	 * @param user User to check.
+	 * @return True if the user is in the list, false otherwise.
+	 */
+	bool count(User* user) const
+	{
+		if ((id) && (user->except_id == id))
+			return true;
+		return ((!shared.empty()) && (shared.count(user)));
+	}
+
+	/** Check whether the list is empty.
+	 * @return True if no users are in the list, false otherwise.
+	 */
+	bool empty() const { return ((marked.empty()) && (shared.empty())); }
+
+	/** Retrieve the number of users in the list.
+	 * @return Number of users in the list.
+	 */
+	size_t size() const { return marked.size() + shared.size(); }
+};
+
 class CoreExport UserIOHandler : public StreamSocket
 {
  private:
@@ -692,6 +754,7 @@ class CoreExport UserIOHandler : public StreamSocket
 	{
 	}
 	void OnDataReady() CXX11_OVERRIDE;
+	void OnDataWritten() CXX11_OVERRIDE;
 	bool OnSetEndPoint(const irc::sockets::sockaddrs& local, const irc::sockets::sockaddrs& remote) CXX11_OVERRIDE;
 	void OnError(BufferedSocketError error) CXX11_OVERRIDE;
 
@@ -703,15 +766,8 @@ class CoreExport UserIOHandler : public StreamSocket
 	void AddWriteBuf(const std::string &data);
 };
 
-typedef unsigned int already_sent_t;
-
 class CoreExport LocalUser : public User, public insp::intrusive_list_node<LocalUser>
 {
-	/** Add a serialized message to the send queue of the user.
-	 * @param serialized Bytes to add.
-	 */
-	void Write(const ClientProtocol::SerializedMessage& serialized);
-
 	/** Send a protocol event to the user, consisting of one or more messages.
 	 * @param protoev Event to send, may contain any number of messages.
 	 * @param msglist Message list used temporarily internally to pass to hooks and store messages
@@ -723,6 +779,10 @@ class CoreExport LocalUser : public User, public insp::intrusive_list_node<Local
 	 */
 	static ClientProtocol::MessageList sendmsglist;
 
+	/** Replies which are being sent to the user in parts, oldest first.
+	 */
+	std::deque<Numeric::Generator*> generators;
+
  public:
 	LocalUser(int fd, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server);
 	CullResult cull() CXX11_OVERRIDE;
@@ -733,6 +793,13 @@ class CoreExport LocalUser : public User, public insp::intrusive_list_node<Local
 	 */
 	ClientProtocol::Serializer* serializer;
 
+	/** Fingerprint of the client capabilities the user has turned on. Users with equal fingerprints have
+	 * the same capabilities turned on so work that only depends on capabilities, such as choosing the
+	 * message tags to send, can be shared between them. Maintained by the cap module, 0 if no
+	 * capabilities are turned on.
+	 */
+	intptr_t capfingerprint;
+
 	/** Stats counter for bytes inbound
 	 */
 	unsigned int bytes_in;
@@ -875,6 +942,37 @@ class CoreExport LocalUser : public User, public insp::intrusive_list_node<Local
 	 * @param msg Message to send.
 	 */
 	void Send(ClientProtocol::EventProvider& protoevprov, ClientProtocol::Message& msg);
+
+	/** Add a serialized message to the send queue of the user. This bypasses the OnUserWrite hook and
+	 * protocol event hooks so it should only be used for messages serialized by the serializer of the
+	 * user when nothing hooks them, e.g. to send messages which were serialized earlier again.
+	 * @param serialized Bytes to add.
+	 */
+	void Write(const ClientProtocol::SerializedMessage& serialized);
+
+	/** Send a reply which may be too large to send at once. As much of it as fits below the soft
+	 * sendq limit is sent right away, the rest is sent as the sendq drains after any replies which
+	 * are already pending. Commands from the user are not processed while a reply is pending so
+	 * replies to later commands are not sent in the middle of it. The part of the reply which is
+	 * held in memory counts against the hard sendq limit, see Numeric::Generator::GetPendingSize().
+	 * @param gen Generator producing the reply. It is freed by the user when the reply is complete.
+	 */
+	void AddGenerator(Numeric::Generator* gen);
+
+	/** Check whether there are replies waiting to be sent to this user.
+	 * @return True if there is at least one pending reply, false otherwise.
+	 */
+	bool HasGenerators() const { return !generators.empty(); }
+
+	/** Send pending replies until the sendq reaches its soft limit or there are no more replies.
+	 * If the pending replies would take the sendq over its hard limit the user is quit instead.
+	 */
+	void RunGenerators();
+
+	/** Discard pending replies.
+	 * @param mod Module whose replies to discard or NULL to discard all of them.
+	 */
+	void RemoveGenerators(Module* mod);
 };
 
 class RemoteUser : public User
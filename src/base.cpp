@@ -150,9 +150,18 @@ void ExtensionItem::RegisterService()
 		throw ModuleException("Extension already exists: " + name);
 }
 
+ExtensionManager::ExtensionManager()
+	: generation(0)
+{
+}
+
 bool ExtensionManager::Register(ExtensionItem* item)
 {
-	return types.insert(std::make_pair(item->name, item)).second;
+	if (!types.insert(std::make_pair(item->name, item)).second)
+		return false;
+
+	generation++;
+	return true;
 }
 
 void ExtensionManager::BeginUnregister(Module* module, std::vector<reference<ExtensionItem> >& list)
@@ -168,6 +177,7 @@ void ExtensionManager::BeginUnregister(Module* module, std::vector<reference<Ext
 			types.erase(me);
 		}
 	}
+	generation++;
 }
 
 ExtensionItem* ExtensionManager::GetItem(const std::string& name)
@@ -64,23 +64,55 @@ const ClientProtocol::SerializedMessage& ClientProtocol::Serializer::SerializeFo
 	{
 		msg.msginit_done = true;
 		FOREACH_MOD_CUSTOM(evprov, MessageTagProvider, OnClientProtocolPopulateTags, (msg));
+
+		// If every tag provider decides based on capabilities alone then users with the same
+		// capability fingerprint get the same tags and can share the serialized message
+		msg.capgroupable = true;
+		const TagMap& tags = msg.GetTags();
+		for (TagMap::const_iterator i = tags.begin(); i != tags.end(); ++i)
+		{
+			if (!i->second.tagprov->caponly)
+			{
+				msg.capgroupable = false;
+				break;
+			}
+		}
+	}
+
+	if (!msg.capgroupable)
+		return msg.GetSerialized(Message::SerializedInfo(this, MakeTagWhitelist(user, msg.GetTags())));
+
+	for (Message::CapGroupList::const_iterator i = msg.capgroups.begin(); i != msg.capgroups.end(); ++i)
+	{
+		const Message::CapGroup& group = *i;
+		if ((group.fingerprint == user->capfingerprint) && (group.serializer == this))
+			return msg.serlist[group.index].second;
 	}
-	return msg.GetSerialized(Message::SerializedInfo(this, MakeTagWhitelist(user, msg.GetTags())));
+
+	// First user with this fingerprint, remember what they got for the rest of the group
+	const size_t index = msg.GetSerializedIndex(Message::SerializedInfo(this, MakeTagWhitelist(user, msg.GetTags())));
+	msg.capgroups.push_back(Message::CapGroup(this, user->capfingerprint, index));
+	return msg.serlist[index].second;
 }
 
 const ClientProtocol::SerializedMessage& ClientProtocol::Message::GetSerialized(const SerializedInfo& serializeinfo) const
+{
+	return serlist[GetSerializedIndex(serializeinfo)].second;
+}
+
+size_t ClientProtocol::Message::GetSerializedIndex(const SerializedInfo& serializeinfo) const
 {
 	// First check if the serialized line they're asking for is in the cache
 	for (SerializedList::const_iterator i = serlist.begin(); i != serlist.end(); ++i)
 	{
 		const SerializedInfo& curr = i->first;
 		if (curr == serializeinfo)
-			return i->second;
+			return i - serlist.begin();
 	}
 
 	// Not cached, generate it and put it in the cache for later use
 	serlist.push_back(std::make_pair(serializeinfo, serializeinfo.serializer->Serialize(*this, serializeinfo.tagwl)));
-	return serlist.back().second;
+	return serlist.size() - 1;
 }
 
 void ClientProtocol::Event::GetMessagesForUser(LocalUser* user, MessageList& messagelist)
@@ -89,6 +121,20 @@ void ClientProtocol::Event::GetMessagesForUser(LocalUser* user, MessageList& mes
 	{
 		eventinit_done = true;
 		FOREACH_MOD_CUSTOM(*event, EventHook, OnEventInit, (*this));
+
+		capcacheable = IsCapCacheable();
+	}
+
+	if (capcacheable)
+	{
+		for (CapCache::const_iterator i = capcache.begin(); i != capcache.end(); ++i)
+		{
+			if (i->first == user->capfingerprint)
+			{
+				messagelist = i->second;
+				return;
+			}
+		}
 	}
 
 	// Most of the time there's only a single message but in rare cases there are more
@@ -98,8 +144,14 @@ void ClientProtocol::Event::GetMessagesForUser(LocalUser* user, MessageList& mes
 		messagelist = *initialmsglist;
 
 	// Let modules modify the message list
-	ModResult res;
-	FIRST_MOD_RESULT_CUSTOM(*event, EventHook, OnPreEventSend, res, (user, *this, messagelist));
-	if (res == MOD_RES_DENY)
-		messagelist.clear();
+	if (event->HasSubscribers())
+	{
+		ModResult res;
+		FIRST_MOD_RESULT_CUSTOM(*event, EventHook, OnPreEventSend, res, (user, *this, messagelist));
+		if (res == MOD_RES_DENY)
+			messagelist.clear();
+	}
+
+	if (capcacheable)
+		capcache.push_back(std::make_pair(user->capfingerprint, messagelist));
 }
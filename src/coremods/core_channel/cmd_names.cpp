@@ -19,6 +19,7 @@
 
 
 #include "inspircd.h"
+#include "numericbuilder.h"
 #include "core_channel.h"
 
 CommandNames::CommandNames(Module* parent)
@@ -57,7 +58,15 @@ CmdResult CommandNames::HandleLocal(LocalUser* user, const Params& parameters)
 		bool show_invisible = ((c->HasUser(user)) || (user->HasPrivPermission("channels/auspex")));
 		if ((show_invisible) || (!c->IsModeSet(secretmode)))
 		{
-			SendNames(user, c, show_invisible);
+			// The list of a large channel may not fit in the sendq so send it as the sendq drains.
+			Numeric::QueuedReply* const reply = new Numeric::QueuedReply(creator);
+			BuildNames(user, c, show_invisible, Numeric::QueuedReplySink(*reply));
+
+			Numeric::Numeric end(RPL_ENDOFNAMES);
+			end.push(c->name);
+			end.push("End of /NAMES list.");
+			reply->Add(end);
+			user->AddGenerator(reply);
 			return CMD_SUCCESS;
 		}
 	}
@@ -68,7 +77,14 @@ CmdResult CommandNames::HandleLocal(LocalUser* user, const Params& parameters)
 
 void CommandNames::SendNames(LocalUser* user, Channel* chan, bool show_invisible)
 {
-	Numeric::Builder<' '> reply(user, RPL_NAMREPLY, false, chan->name.size() + 3);
+	BuildNames(user, chan, show_invisible, Numeric::WriteNumericSink(user));
+	user->WriteNumeric(RPL_ENDOFNAMES, chan->name, "End of /NAMES list.");
+}
+
+template <typename Sink>
+void CommandNames::BuildNames(LocalUser* user, Channel* chan, bool show_invisible, const Sink& sink)
+{
+	Numeric::GenericBuilder<' ', false, Sink> reply(sink, RPL_NAMREPLY, false, chan->name.size() + user->nick.size() + 3);
 	Numeric::Numeric& numeric = reply.GetNumeric();
 	if (chan->IsModeSet(secretmode))
 		numeric.push(std::string(1, '@'));
@@ -110,5 +126,4 @@ void CommandNames::SendNames(LocalUser* user, Channel* chan, bool show_invisible
 	}
 
 	reply.Flush();
-	user->WriteNumeric(RPL_ENDOFNAMES, chan->name, "End of /NAMES list.");
 }
@@ -120,6 +120,15 @@ class CommandNames : public SplitCommand
 	ChanModeReference privatemode;
 	UserModeReference invisiblemode;
 
+	/** Build the NAMES list for a given channel, not including the end of list numeric.
+	 * @param user User the NAMES list is for
+	 * @param chan Channel whose nicklist to build
+	 * @param show_invisible True to show invisible (+i) members to the user, false to omit them from the list
+	 * @param sink Sink to pass the RPL_NAMREPLY numerics to
+	 */
+	template <typename Sink>
+	void BuildNames(LocalUser* user, Channel* chan, bool show_invisible, const Sink& sink);
+
  public:
 	/** Constructor for names.
 	 */
@@ -132,7 +141,8 @@ class CommandNames : public SplitCommand
 	 */
 	CmdResult HandleLocal(LocalUser* user, const Params& parameters) CXX11_OVERRIDE;
 
-	/** Spool the NAMES list for a given channel to the given user
+	/** Send the NAMES list for a given channel to the given user at once. Used when joining
+	 * so the list arrives before anything else which is sent to the user about the channel.
 	 * @param user User to spool the NAMES list to
 	 * @param chan Channel whose nicklist to send
 	 * @param show_invisible True to show invisible (+i) members to the user, false to omit them from the list
@@ -21,6 +21,7 @@
 #include "modules/dns.h"
 #include <iostream>
 #include <fstream>
+#include <queue>
 
 #ifdef _WIN32
 #include <Iphlpapi.h>
@@ -340,24 +341,324 @@ class Packet : public Query
 	}
 };
 
-class MyManager : public Manager, public Timer, public EventHandler
+class MyManager;
+
+/** The UDP socket which queries to the nameservers of one address family are sent from
+ */
+class UDPSocket : public EventHandler
+{
+	MyManager* const manager;
+
+ public:
+	const int family;
+
+	UDPSocket(MyManager* mgr, int fam) : manager(mgr), family(fam) { }
+
+	void OnEventHandlerRead() CXX11_OVERRIDE;
+
+	void OnEventHandlerError(int errcode) CXX11_OVERRIDE
+	{
+		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "UDP socket got an error event");
+	}
+};
+
+/** Repeats a query over TCP when a nameserver said that its answer was truncated
+ */
+class TCPQuery : public BufferedSocket
 {
-	typedef TR1NS::unordered_map<Question, Query, Question::hash> cache_map;
+	MyManager* const manager;
+
+	/* The query prefixed with its length */
+	std::string query;
+
+ public:
+	/* The nameserver being asked */
+	const irc::sockets::sockaddrs server;
+
+	/* The id of the query */
+	const RequestId id;
+
+	TCPQuery(MyManager* mgr, const irc::sockets::sockaddrs& srv, RequestId qid, const std::string& packet)
+		: manager(mgr)
+		, server(srv)
+		, id(qid)
+	{
+		query.push_back(static_cast<char>(packet.length() >> 8));
+		query.push_back(static_cast<char>(packet.length() & 0xFF));
+		query.append(packet);
+	}
+
+	void Start(const std::string& sourceaddr)
+	{
+		irc::sockets::sockaddrs bind;
+		bind.sa.sa_family = 0;
+		if (!sourceaddr.empty() && !irc::sockets::aptosa(sourceaddr, 0, bind))
+			bind.sa.sa_family = 0;
+
+		BufferedSocketError err = BeginConnect(server, bind, 5);
+		if (err != I_ERR_NONE)
+		{
+			state = I_ERROR;
+			SetError(SocketEngine::LastError());
+			OnError(err);
+		}
+	}
+
+	void OnConnected() CXX11_OVERRIDE
+	{
+		WriteData(query);
+	}
+
+	void OnDataReady() CXX11_OVERRIDE;
+
+	void OnError(BufferedSocketError err) CXX11_OVERRIDE
+	{
+		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "TCP query to " + server.str() + " failed: " + getError());
+		Done();
+	}
+
+	/** Close this query and destroy it
+	 */
+	void Done();
+};
+
+class MyManager : public Manager, public Timer
+{
+	/** A cached result and the time at which it stops being valid.
+	 */
+	struct CacheEntry
+	{
+		Query query;
+		time_t expires;
+
+		CacheEntry(const Query& q, time_t exp) : query(q), expires(exp) { }
+	};
+
+	/** Cache entries ordered from most to least recently used
+	 */
+	typedef std::list<CacheEntry> cache_list;
+	typedef TR1NS::unordered_map<Question, cache_list::iterator, Question::hash> cache_map;
+	cache_list lru;
 	cache_map cache;
 
-	irc::sockets::sockaddrs myserver;
+	/** Orders the expiry heap so that the entry which expires first is at the top
+	 */
+	struct ExpiryCompare
+	{
+		bool operator()(const std::pair<time_t, Question>& lhs, const std::pair<time_t, Question>& rhs) const
+		{
+			return lhs.first > rhs.first;
+		}
+	};
+
+	/** The expiry times of the cache entries. Entries which are replaced or evicted are not
+	 * removed from here; they are skipped when they reach the top instead.
+	 */
+	typedef std::priority_queue<std::pair<time_t, Question>, std::vector<std::pair<time_t, Question> >, ExpiryCompare> expiry_heap;
+	expiry_heap expiries;
+
+	/** Requests which use the cache and are waiting for an answer, grouped by question. The
+	 * first request in each list owns the request id the query was sent with and the rest
+	 * get the same answer when it arrives.
+	 */
+	typedef TR1NS::unordered_map<Question, std::vector<DNS::Request*>, Question::hash> inflight_map;
+	inflight_map inflight;
+
+	/** A nameserver which queries can be sent to
+	 */
+	struct Upstream
+	{
+		irc::sockets::sockaddrs addr;
+
+		/* Smoothed round trip time in milliseconds, 0 if not measured yet */
+		unsigned int srtt;
+
+		Upstream(const irc::sockets::sockaddrs& a) : addr(a), srtt(0) { }
+	};
+
+	/** A query which is waiting for an answer
+	 */
+	struct PendingQuery
+	{
+		/* The packed query */
+		std::string packet;
+
+		/* The nameservers the query was sent to and when, in the order they were asked */
+		std::vector<std::pair<size_t, uint64_t> > sent;
+
+		/* Whether every nameserver has been asked */
+		bool exhausted;
+
+		PendingQuery() : exhausted(false) { }
+
+		const std::pair<size_t, uint64_t>* FindSent(size_t upstream) const
+		{
+			for (std::vector<std::pair<size_t, uint64_t> >::const_iterator i = sent.begin(); i != sent.end(); ++i)
+				if (i->first == upstream)
+					return &*i;
+			return NULL;
+		}
+	};
+	typedef TR1NS::unordered_map<RequestId, PendingQuery> pending_map;
+	pending_map pending;
+
+	std::vector<Upstream> upstreams;
+	std::vector<UDPSocket*> sockets;
+	std::set<TCPQuery*> tcpqueries;
+	std::string sourceip;
 	bool unloading;
 
 	/** Maximum number of entries in cache
 	 */
 	static const unsigned int MAX_CACHE_SIZE = 1000;
 
-	static bool IsExpired(const Query& record, time_t now = ServerInstance->Time())
+	/** How many milliseconds to wait for a nameserver before also asking the next one
+	 */
+	static const unsigned int RETRY_TIME = 1000;
+
+	/** The highest a nameserver's round trip time can be raised by unanswered queries
+	 */
+	static const unsigned int MAX_SRTT = 30000;
+
+	static uint64_t GetTimeMS()
 	{
-		const ResourceRecord& req = record.answers[0];
-		return (req.created + static_cast<time_t>(req.ttl) < now);
+		return static_cast<uint64_t>(ServerInstance->Time()) * 1000 + ServerInstance->Time_ns() / 1000000;
 	}
 
+	UDPSocket* GetSocket(int family) const
+	{
+		for (std::vector<UDPSocket*>::const_iterator i = sockets.begin(); i != sockets.end(); ++i)
+			if ((*i)->family == family)
+				return *i;
+		return NULL;
+	}
+
+	/** Send a query to the fastest nameserver which has not been asked yet
+	 * @return true if the query was sent, false if there are no nameservers left to ask.
+	 */
+	bool SendQuery(PendingQuery& query)
+	{
+		const uint64_t now = GetTimeMS();
+		while (true)
+		{
+			size_t best = upstreams.size();
+			for (size_t i = 0; i < upstreams.size(); ++i)
+			{
+				if (query.FindSent(i))
+					continue;
+				if (best == upstreams.size() || upstreams[i].srtt < upstreams[best].srtt)
+					best = i;
+			}
+
+			if (best == upstreams.size())
+			{
+				query.exhausted = true;
+				return false;
+			}
+
+			// Nameservers which are passed over slowly lose any penalty for timing out
+			// so that they are tried again once they may have recovered.
+			for (size_t i = 0; i < upstreams.size(); ++i)
+				if (i != best)
+					upstreams[i].srtt -= upstreams[i].srtt / 64;
+
+			query.sent.push_back(std::make_pair(best, now));
+
+			const Upstream& upstream = upstreams[best];
+			UDPSocket* sock = GetSocket(upstream.addr.family());
+			if (sock && SocketEngine::SendTo(sock, query.packet.data(), query.packet.length(), 0, upstream.addr) == static_cast<int>(query.packet.length()))
+				return true;
+
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Unable to send query to " + upstream.addr.str());
+		}
+	}
+
+	/** Start sending a new query
+	 * @return true if the query was sent to at least one nameserver.
+	 */
+	bool StartQuery(RequestId id, const unsigned char* buffer, unsigned short len)
+	{
+		PendingQuery& query = pending[id];
+		query = PendingQuery();
+		query.packet.assign(reinterpret_cast<const char*>(buffer), len);
+
+		if (!SendQuery(query))
+		{
+			pending.erase(id);
+			return false;
+		}
+
+		// If the best nameserver has recently stopped answering then race it against the next one.
+		if (upstreams[query.sent.back().first].srtt >= RETRY_TIME)
+			SendQuery(query);
+		return true;
+	}
+
+	void OpenSocket(int family, std::string sourceaddr, unsigned int sourceport)
+	{
+		UDPSocket* sock = new UDPSocket(this, family);
+		int s = socket(family, SOCK_DGRAM, 0);
+		sock->SetFd(s);
+
+		/* Have we got a socket? */
+		if (sock->GetFd() == -1)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_SPARSE, "Error creating DNS socket - hostnames will NOT resolve");
+			delete sock;
+			return;
+		}
+
+		SocketEngine::SetReuse(s);
+		SocketEngine::NonBlocking(s);
+
+		irc::sockets::sockaddrs bindto;
+		if (sourceaddr.empty())
+		{
+			// set a sourceaddr for irc::sockets::aptosa() based on the servers af type
+			if (family == AF_INET)
+				sourceaddr = "0.0.0.0";
+			else if (family == AF_INET6)
+				sourceaddr = "::";
+		}
+		irc::sockets::aptosa(sourceaddr, sourceport, bindto);
+
+		if (SocketEngine::Bind(sock->GetFd(), bindto) < 0)
+		{
+			/* Failed to bind */
+			ServerInstance->Logs->Log(MODNAME, LOG_SPARSE, "Error binding dns socket - hostnames will NOT resolve");
+			SocketEngine::Close(sock->GetFd());
+			delete sock;
+			return;
+		}
+
+		if (!SocketEngine::AddFd(sock, FD_WANT_POLL_READ | FD_WANT_NO_WRITE))
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_SPARSE, "Internal error starting DNS - hostnames will NOT resolve.");
+			SocketEngine::Close(sock->GetFd());
+			delete sock;
+			return;
+		}
+
+		if (bindto.family() != family)
+			ServerInstance->Logs->Log(MODNAME, LOG_SPARSE, "Nameserver address family differs from source address family - hostnames might not resolve");
+		sockets.push_back(sock);
+	}
+
+	void CloseSockets()
+	{
+		for (std::vector<UDPSocket*>::const_iterator i = sockets.begin(); i != sockets.end(); ++i)
+		{
+			SocketEngine::Shutdown(*i, 2);
+			SocketEngine::Close(*i);
+			delete *i;
+		}
+		sockets.clear();
+	}
+
+	/** How long a lookup which found no records is cached for
+	 */
+	static const unsigned int NEGATIVE_TTL = 60;
+
 	/** Check the DNS cache to see if request can be handled by a cached result
 	 * @return true if a cached result was found.
 	 */
@@ -367,29 +668,75 @@ class MyManager : public Manager, public Timer, public EventHandler
 
 		cache_map::iterator it = this->cache.find(question);
 		if (it == this->cache.end())
+		{
+			ServerInstance->stats.DnsCacheMiss++;
 			return false;
+		}
 
-		Query& record = it->second;
-		if (IsExpired(record))
+		if (it->second->expires < ServerInstance->Time())
 		{
+			lru.erase(it->second);
 			this->cache.erase(it);
+			ServerInstance->stats.DnsCacheMiss++;
 			return false;
 		}
 
 		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "cache: Using cached result for " + question.name);
+		ServerInstance->stats.DnsCacheHit++;
+		lru.splice(lru.begin(), lru, it->second);
+
+		Query& record = it->second->query;
 		record.cached = true;
-		req->OnLookupComplete(&record);
+		if (record.error == ERROR_NONE)
+			req->OnLookupComplete(&record);
+		else
+			req->OnError(&record);
 		return true;
 	}
 
-	/** Add a record to the dns cache
-	 * @param r The record
+	/** Add a result to the dns cache, evicting the least recently used entry if it is full
+	 * @param r The result
+	 * @param ttl How many seconds the result is valid for
 	 */
-	void AddCache(Query& r)
+	void AddCache(const Query& r, unsigned int ttl)
 	{
-		if (cache.size() >= MAX_CACHE_SIZE)
-			cache.clear();
+		const time_t expires = ServerInstance->Time() + ttl;
+
+		cache_map::iterator it = this->cache.find(r.question);
+		if (it != this->cache.end())
+		{
+			*it->second = CacheEntry(r, expires);
+			lru.splice(lru.begin(), lru, it->second);
+		}
+		else
+		{
+			if (cache.size() >= MAX_CACHE_SIZE)
+			{
+				this->cache.erase(lru.back().query.question);
+				lru.pop_back();
+			}
+
+			lru.push_front(CacheEntry(r, expires));
+			this->cache[r.question] = lru.begin();
+		}
 
+		// Stale heap entries are only dropped when they expire so rebuild the heap if they
+		// start to outnumber the live ones.
+		if (expiries.size() > 2 * MAX_CACHE_SIZE)
+		{
+			expiry_heap heap;
+			for (cache_list::const_iterator i = lru.begin(); i != lru.end(); ++i)
+				heap.push(std::make_pair(i->expires, i->query.question));
+			std::swap(expiries, heap);
+		}
+		expiries.push(std::make_pair(expires, r.question));
+	}
+
+	/** Add a successful result to the dns cache
+	 * @param r The result
+	 */
+	void AddCache(const Query& r)
+	{
 		// Determine the lowest TTL value and use that as the TTL of the cache entry
 		unsigned int cachettl = UINT_MAX;
 		for (std::vector<ResourceRecord>::const_iterator i = r.answers.begin(); i != r.answers.end(); ++i)
@@ -400,17 +747,29 @@ class MyManager : public Manager, public Timer, public EventHandler
 		}
 
 		cachettl = std::min(cachettl, (unsigned int)5*60);
-		ResourceRecord& rr = r.answers.front();
+		Query record(r);
+		ResourceRecord& rr = record.answers.front();
 		// Set TTL to what we've determined to be the lowest
 		rr.ttl = cachettl;
 		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "cache: added cache for " + rr.name + " -> " + rr.rdata + " ttl: " + ConvToStr(rr.ttl));
-		this->cache[r.question] = r;
+		AddCache(record, cachettl);
+	}
+
+	/** Deliver the result of a query to a request and destroy it
+	 */
+	static void Deliver(DNS::Request* request, Query& result)
+	{
+		if (result.error == ERROR_NONE)
+			request->OnLookupComplete(&result);
+		else
+			request->OnError(&result);
+		delete request;
 	}
 
  public:
 	DNS::Request* requests[MAX_REQUEST_ID+1];
 
-	MyManager(Module* c) : Manager(c), Timer(5*60, true)
+	MyManager(Module* c) : Manager(c), Timer(1, true)
 		, unloading(false)
 	{
 		for (unsigned int i = 0; i <= MAX_REQUEST_ID; ++i)
@@ -423,17 +782,52 @@ class MyManager : public Manager, public Timer, public EventHandler
 		// Ensure Process() will fail for new requests
 		unloading = true;
 
+		FailRequests(NULL, ERROR_UNKNOWN);
+
+		while (!tcpqueries.empty())
+		{
+			TCPQuery* query = *tcpqueries.begin();
+			tcpqueries.erase(tcpqueries.begin());
+			query->cull();
+			delete query;
+		}
+		CloseSockets();
+	}
+
+	void RemoveTCPQuery(TCPQuery* query)
+	{
+		tcpqueries.erase(query);
+	}
+
+	/** Fail all pending requests which were created by a module
+	 * @param mod The module to fail the requests of or NULL for all modules
+	 * @param error The error to fail the requests with
+	 */
+	void FailRequests(Module* mod, Error error)
+	{
+		std::vector<DNS::Request*> failed;
 		for (unsigned int i = 0; i <= MAX_REQUEST_ID; ++i)
 		{
+			// Requests which use the cache are found in the in-flight lists below.
 			DNS::Request* request = requests[i];
-			if (!request)
-				continue;
+			if (request && !request->use_cache && (!mod || request->creator == mod))
+				failed.push_back(request);
+		}
 
-			Query rr(request->question);
-			rr.error = ERROR_UNKNOWN;
-			request->OnError(&rr);
+		for (inflight_map::const_iterator i = inflight.begin(); i != inflight.end(); ++i)
+		{
+			for (std::vector<DNS::Request*>::const_iterator j = i->second.begin(); j != i->second.end(); ++j)
+			{
+				if (!mod || (*j)->creator == mod)
+					failed.push_back(*j);
+			}
+		}
 
-			delete request;
+		for (std::vector<DNS::Request*>::const_iterator i = failed.begin(); i != failed.end(); ++i)
+		{
+			Query rr((*i)->question);
+			rr.error = error;
+			Deliver(*i, rr);
 		}
 	}
 
@@ -442,7 +836,7 @@ class MyManager : public Manager, public Timer, public EventHandler
 		if ((unloading) || (req->creator->dying))
 			throw Exception("Module is being unloaded");
 
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Processing request to lookup " + req->question.name + " of type " + ConvToStr(req->question.type) + " to " + this->myserver.addr());
+		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Processing request to lookup " + req->question.name + " of type " + ConvToStr(req->question.type));
 
 		/* Create an id */
 		unsigned int tries = 0;
@@ -497,7 +891,29 @@ class MyManager : public Manager, public Timer, public EventHandler
 		// Update name in the original request so question checking works for PTR queries
 		req->question.name = p.question.name;
 
-		if (SocketEngine::SendTo(this, buffer, len, 0, this->myserver) != len)
+		if (req->use_cache)
+		{
+			// If the same question has already been asked then wait for that answer
+			// instead of asking again.
+			std::vector<DNS::Request*>& waiters = inflight[req->question];
+			if (!waiters.empty())
+			{
+				ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Waiting for in-flight query for " + req->question.name);
+				ServerInstance->stats.DnsCoalesced++;
+				this->requests[req->id] = NULL;
+				waiters.push_back(req);
+				ServerInstance->Timers.AddTimer(req);
+				return;
+			}
+
+			if (!this->StartQuery(req->id, buffer, len))
+			{
+				inflight.erase(req->question);
+				throw Exception("DNS: Unable to send query");
+			}
+			waiters.push_back(req);
+		}
+		else if (!this->StartQuery(req->id, buffer, len))
 			throw Exception("DNS: Unable to send query");
 
 		// Add timer for timeout
@@ -506,8 +922,34 @@ class MyManager : public Manager, public Timer, public EventHandler
 
 	void RemoveRequest(DNS::Request* req) CXX11_OVERRIDE
 	{
-		if (requests[req->id] == req)
+		const bool owner = (requests[req->id] == req);
+		if (owner)
+		{
 			requests[req->id] = NULL;
+			pending.erase(req->id);
+		}
+
+		if (!req->use_cache)
+			return;
+
+		inflight_map::iterator it = inflight.find(req->question);
+		if (it == inflight.end())
+			return;
+
+		std::vector<DNS::Request*>& waiters = it->second;
+		std::vector<DNS::Request*>::iterator waiter = std::find(waiters.begin(), waiters.end(), req);
+		if (waiter == waiters.end())
+			return;
+
+		waiters.erase(waiter);
+		if (waiters.empty())
+			inflight.erase(it);
+		else if (owner)
+		{
+			// Hand the request id over to the next waiter so the answer still reaches it.
+			waiters.front()->id = req->id;
+			requests[req->id] = waiters.front();
+		}
 	}
 
 	std::string GetErrorStr(Error e) CXX11_OVERRIDE
@@ -538,31 +980,64 @@ class MyManager : public Manager, public Timer, public EventHandler
 		}
 	}
 
-	void OnEventHandlerError(int errcode) CXX11_OVERRIDE
-	{
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "UDP socket got an error event");
-	}
-
-	void OnEventHandlerRead() CXX11_OVERRIDE
+	/** Handle an answer received from a nameserver
+	 * @param buffer The raw answer
+	 * @param length The length of the answer
+	 * @param from The nameserver which sent the answer
+	 * @param tcp True if the answer was received over TCP
+	 */
+	void HandleAnswer(const unsigned char* buffer, int length, const irc::sockets::sockaddrs& from, bool tcp)
 	{
-		unsigned char buffer[524];
-		irc::sockets::sockaddrs from;
-		socklen_t x = sizeof(from);
+		if (length < Packet::HEADER_LENGTH)
+			return;
 
-		int length = SocketEngine::RecvFrom(this, buffer, sizeof(buffer), 0, &from.sa, &x);
+		const RequestId id = (buffer[0] << 8) | buffer[1];
+		const unsigned short flags = (buffer[2] << 8) | buffer[3];
 
-		if (length < Packet::HEADER_LENGTH)
+		pending_map::iterator pq = pending.find(id);
+		if (pq == pending.end())
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Received an answer for something we didn't request");
 			return;
+		}
 
-		if (myserver != from)
+		const std::pair<size_t, uint64_t>* sent = NULL;
+		for (std::vector<std::pair<size_t, uint64_t> >::const_iterator i = pq->second.sent.begin(); i != pq->second.sent.end(); ++i)
 		{
-			std::string server1 = from.str();
-			std::string server2 = myserver.str();
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Got a result from the wrong server! Bad NAT or DNS forging attempt? '%s' != '%s'",
-				server1.c_str(), server2.c_str());
+			if (upstreams[i->first].addr == from)
+			{
+				sent = &*i;
+				break;
+			}
+		}
+
+		if (!sent)
+		{
+			std::string server = from.str();
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Got a result from the wrong server! Bad NAT or DNS forging attempt? '%s'", server.c_str());
 			return;
 		}
 
+		if (!tcp)
+		{
+			Upstream& upstream = upstreams[sent->first];
+			const unsigned int rtt = std::min<uint64_t>(GetTimeMS() - sent->second, MAX_SRTT);
+			upstream.srtt = upstream.srtt ? (upstream.srtt * 7 + rtt) / 8 : rtt;
+
+			if (flags & QUERYFLAGS_TC)
+			{
+				for (std::set<TCPQuery*>::const_iterator i = tcpqueries.begin(); i != tcpqueries.end(); ++i)
+					if ((*i)->id == id && (*i)->server == from)
+						return;
+
+				ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Answer from " + from.str() + " was truncated, retrying over TCP");
+				TCPQuery* query = new TCPQuery(this, from, id, pq->second.packet);
+				tcpqueries.insert(query);
+				query->Start(sourceip);
+				return;
+			}
+		}
+
 		Packet recv_packet;
 		bool valid = false;
 
@@ -595,14 +1070,12 @@ class MyManager : public Manager, public Timer, public EventHandler
 		{
 			ServerInstance->stats.DnsBad++;
 			recv_packet.error = ERROR_MALFORMED;
-			request->OnError(&recv_packet);
 		}
 		else if (recv_packet.flags & QUERYFLAGS_OPCODE)
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Received a nonstandard query");
 			ServerInstance->stats.DnsBad++;
 			recv_packet.error = ERROR_NONSTANDARD_QUERY;
-			request->OnError(&recv_packet);
 		}
 		else if (!(recv_packet.flags & QUERYFLAGS_QR) || (recv_packet.flags & QUERYFLAGS_RCODE))
 		{
@@ -636,106 +1109,161 @@ class MyManager : public Manager, public Timer, public EventHandler
 
 			ServerInstance->stats.DnsBad++;
 			recv_packet.error = error;
-			request->OnError(&recv_packet);
+			if (error == ERROR_DOMAIN_NOT_FOUND)
+				this->AddCache(recv_packet, NEGATIVE_TTL);
 		}
 		else if (recv_packet.answers.empty())
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "No resource records returned");
 			ServerInstance->stats.DnsBad++;
 			recv_packet.error = ERROR_NO_RECORDS;
-			request->OnError(&recv_packet);
+			this->AddCache(recv_packet, NEGATIVE_TTL);
 		}
 		else
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Lookup complete for " + request->question.name);
 			ServerInstance->stats.DnsGood++;
-			request->OnLookupComplete(&recv_packet);
 			this->AddCache(recv_packet);
 		}
 
 		ServerInstance->stats.Dns++;
 
-		/* Request's destructor removes it from the request map */
-		delete request;
+		if (!request->use_cache)
+		{
+			/* Request's destructor removes it from the request map */
+			Deliver(request, recv_packet);
+			return;
+		}
+
+		// Answer every request which was waiting for this question. They are taken one at a
+		// time as a callback may cause other waiting requests to be destroyed.
+		this->requests[recv_packet.id] = NULL;
+		pending.erase(recv_packet.id);
+		for (inflight_map::iterator it; (it = inflight.find(recv_packet.question)) != inflight.end(); )
+		{
+			DNS::Request* waiter = it->second.front();
+			it->second.erase(it->second.begin());
+			if (it->second.empty())
+				inflight.erase(it);
+			Deliver(waiter, recv_packet);
+		}
 	}
 
 	bool Tick(time_t now) CXX11_OVERRIDE
 	{
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "cache: purging DNS cache");
+		while (!expiries.empty() && expiries.top().first < now)
+		{
+			// The entry may have been replaced or evicted since this expiry was added.
+			cache_map::iterator it = this->cache.find(expiries.top().second);
+			if (it != this->cache.end() && it->second->expires < now)
+			{
+				lru.erase(it->second);
+				this->cache.erase(it);
+			}
+			expiries.pop();
+		}
 
-		for (cache_map::iterator it = this->cache.begin(); it != this->cache.end(); )
+		// Move queries which have gone unanswered for too long on to the next nameserver.
+		const uint64_t nowms = GetTimeMS();
+		for (pending_map::iterator i = pending.begin(); i != pending.end(); ++i)
 		{
-			const Query& query = it->second;
-			if (IsExpired(query, now))
-				this->cache.erase(it++);
-			else
-				++it;
+			PendingQuery& query = i->second;
+			if (query.exhausted)
+				continue;
+
+			if (!query.sent.empty())
+			{
+				const std::pair<size_t, uint64_t>& last = query.sent.back();
+				if (nowms - last.second < RETRY_TIME)
+					continue;
+
+				Upstream& upstream = upstreams[last.first];
+				upstream.srtt = std::min(std::max(upstream.srtt * 2, static_cast<unsigned int>(RETRY_TIME)), static_cast<unsigned int>(MAX_SRTT));
+				ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "No answer from " + upstream.addr.str() + " for query " + ConvToStr(i->first) + ", trying the next nameserver");
+			}
+			SendQuery(query);
+		}
+
+		// Give up on TCP queries for requests which have been answered or timed out.
+		for (std::set<TCPQuery*>::const_iterator i = tcpqueries.begin(); i != tcpqueries.end(); )
+		{
+			TCPQuery* query = *i++;
+			if (!pending.count(query->id))
+				query->Done();
 		}
 		return true;
 	}
 
-	void Rehash(const std::string& dnsserver, std::string sourceaddr, unsigned int sourceport)
+	void Rehash(const std::vector<std::string>& servers, const std::string& sourceaddr, unsigned int sourceport)
 	{
-		if (this->GetFd() > -1)
+		if (!sockets.empty())
 		{
-			SocketEngine::Shutdown(this, 2);
-			SocketEngine::Close(this);
+			CloseSockets();
 
 			/* Remove expired entries from the cache */
 			this->Tick(ServerInstance->Time());
 		}
 
-		irc::sockets::aptosa(dnsserver, DNS::PORT, myserver);
-
-		/* Initialize mastersocket */
-		int s = socket(myserver.family(), SOCK_DGRAM, 0);
-		this->SetFd(s);
-
-		/* Have we got a socket? */
-		if (this->GetFd() != -1)
+		sourceip = sourceaddr;
+		upstreams.clear();
+		for (std::vector<std::string>::const_iterator i = servers.begin(); i != servers.end(); ++i)
 		{
-			SocketEngine::SetReuse(s);
-			SocketEngine::NonBlocking(s);
-
-			irc::sockets::sockaddrs bindto;
-			if (sourceaddr.empty())
-			{
-				// set a sourceaddr for irc::sockets::aptosa() based on the servers af type
-				if (myserver.family() == AF_INET)
-					sourceaddr = "0.0.0.0";
-				else if (myserver.family() == AF_INET6)
-					sourceaddr = "::";
-			}
-			irc::sockets::aptosa(sourceaddr, sourceport, bindto);
-
-			if (SocketEngine::Bind(this->GetFd(), bindto) < 0)
-			{
-				/* Failed to bind */
-				ServerInstance->Logs->Log(MODNAME, LOG_SPARSE, "Error binding dns socket - hostnames will NOT resolve");
-				SocketEngine::Close(this->GetFd());
-				this->SetFd(-1);
-			}
-			else if (!SocketEngine::AddFd(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE))
-			{
-				ServerInstance->Logs->Log(MODNAME, LOG_SPARSE, "Internal error starting DNS - hostnames will NOT resolve.");
-				SocketEngine::Close(this->GetFd());
-				this->SetFd(-1);
-			}
+			irc::sockets::sockaddrs addr;
+			if (irc::sockets::aptosa(*i, DNS::PORT, addr))
+				upstreams.push_back(Upstream(addr));
+			else
+				ServerInstance->Logs->Log(MODNAME, LOG_SPARSE, "Ignoring invalid nameserver address '%s'", i->c_str());
+		}
 
-			if (bindto.family() != myserver.family())
-				ServerInstance->Logs->Log(MODNAME, LOG_SPARSE, "Nameserver address family differs from source address family - hostnames might not resolve");
+		// Queries which were in flight are sent again to the new nameservers on the next tick.
+		for (pending_map::iterator i = pending.begin(); i != pending.end(); ++i)
+		{
+			i->second.sent.clear();
+			i->second.exhausted = false;
 		}
-		else
+
+		for (std::vector<Upstream>::const_iterator i = upstreams.begin(); i != upstreams.end(); ++i)
 		{
-			ServerInstance->Logs->Log(MODNAME, LOG_SPARSE, "Error creating DNS socket - hostnames will NOT resolve");
+			if (!GetSocket(i->addr.family()))
+				OpenSocket(i->addr.family(), sourceaddr, sourceport);
 		}
 	}
 };
 
+void UDPSocket::OnEventHandlerRead()
+{
+	unsigned char buffer[524];
+	irc::sockets::sockaddrs from;
+	socklen_t x = sizeof(from);
+
+	int length = SocketEngine::RecvFrom(this, buffer, sizeof(buffer), 0, &from.sa, &x);
+	manager->HandleAnswer(buffer, length, from, false);
+}
+
+void TCPQuery::OnDataReady()
+{
+	if (recvq.length() < 2)
+		return;
+
+	const size_t length = (static_cast<unsigned char>(recvq[0]) << 8) | static_cast<unsigned char>(recvq[1]);
+	if (recvq.length() < length + 2)
+		return;
+
+	manager->HandleAnswer(reinterpret_cast<const unsigned char*>(recvq.data() + 2), length, server, true);
+	Done();
+}
+
+void TCPQuery::Done()
+{
+	manager->RemoveTCPQuery(this);
+	Close();
+	ServerInstance->GlobalCulls.AddItem(this);
+}
+
 class ModuleDNS : public Module
 {
 	MyManager manager;
-	std::string DNSServer;
+	std::vector<std::string> DNSServers;
 	std::string SourceIP;
 	unsigned int SourcePort;
 
@@ -760,14 +1288,19 @@ class ModuleDNS : public Module
 			if (pFixedInfo)
 			{
 				if (GetNetworkParams(pFixedInfo, &dwBufferSize) == NO_ERROR)
-					DNSServer = pFixedInfo->DnsServerList.IpAddress.String;
+				{
+					for (PIP_ADDR_STRING addr = &pFixedInfo->DnsServerList; addr; addr = addr->Next)
+						if (*addr->IpAddress.String)
+							DNSServers.push_back(addr->IpAddress.String);
+				}
 
 				HeapFree(GetProcessHeap(), 0, pFixedInfo);
 			}
 
-			if (!DNSServer.empty())
+			if (!DNSServers.empty())
 			{
-				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "<dns:server> set to '%s' as first active resolver in the system settings.", DNSServer.c_str());
+				std::string servers = stdalgo::string::join(DNSServers);
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "<dns:server> set to '%s' from the active resolvers in the system settings.", servers.c_str());
 				return;
 			}
 		}
@@ -779,22 +1312,27 @@ class ModuleDNS : public Module
 
 		std::ifstream resolv("/etc/resolv.conf");
 
-		while (resolv >> DNSServer)
+		std::string token;
+		while (resolv >> token)
 		{
-			if (DNSServer == "nameserver")
+			if (token == "nameserver")
 			{
-				resolv >> DNSServer;
-				if (DNSServer.find_first_not_of("0123456789.") == std::string::npos || DNSServer.find_first_not_of("0123456789ABCDEFabcdef:") == std::string::npos)
-				{
-					ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "<dns:server> set to '%s' as first resolver in /etc/resolv.conf.",DNSServer.c_str());
-					return;
-				}
+				resolv >> token;
+				if (token.find_first_not_of("0123456789.") == std::string::npos || token.find_first_not_of("0123456789ABCDEFabcdef:") == std::string::npos)
+					DNSServers.push_back(token);
 			}
 		}
 
+		if (!DNSServers.empty())
+		{
+			std::string servers = stdalgo::string::join(DNSServers);
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "<dns:server> set to '%s' from the resolvers in /etc/resolv.conf.", servers.c_str());
+			return;
+		}
+
 		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "/etc/resolv.conf contains no viable nameserver entries! Defaulting to nameserver '127.0.0.1'!");
 #endif
-		DNSServer = "127.0.0.1";
+		DNSServers.push_back("127.0.0.1");
 	}
 
  public:
@@ -805,39 +1343,28 @@ class ModuleDNS : public Module
 
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
 	{
-		std::string oldserver = DNSServer;
+		const std::vector<std::string> oldservers = DNSServers;
 		const std::string oldip = SourceIP;
 		const unsigned int oldport = SourcePort;
 
 		ConfigTag* tag = ServerInstance->Config->ConfValue("dns");
-		DNSServer = tag->getString("server");
+		DNSServers.clear();
+		irc::spacesepstream serverstream(tag->getString("server"));
+		for (std::string server; serverstream.GetToken(server); )
+			DNSServers.push_back(server);
 		SourceIP = tag->getString("sourceip");
 		SourcePort = tag->getUInt("sourceport", 0, 0, UINT16_MAX);
 
-		if (DNSServer.empty())
+		if (DNSServers.empty())
 			FindDNSServer();
 
-		if (oldserver != DNSServer || oldip != SourceIP || oldport != SourcePort)
-			this->manager.Rehash(DNSServer, SourceIP, SourcePort);
+		if (oldservers != DNSServers || oldip != SourceIP || oldport != SourcePort)
+			this->manager.Rehash(DNSServers, SourceIP, SourcePort);
 	}
 
 	void OnUnloadModule(Module* mod) CXX11_OVERRIDE
 	{
-		for (unsigned int i = 0; i <= MAX_REQUEST_ID; ++i)
-		{
-			DNS::Request* req = this->manager.requests[i];
-			if (!req)
-				continue;
-
-			if (req->creator == mod)
-			{
-				Query rr(req->question);
-				rr.error = ERROR_UNLOADED;
-				req->OnError(&rr);
-
-				delete req;
-			}
-		}
+		this->manager.FailRequests(mod, ERROR_UNLOADED);
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
@@ -19,6 +19,7 @@
 
 
 #include "inspircd.h"
+#include "numericbuilder.h"
 #include "core_info.h"
 
 CommandMotd::CommandMotd(Module* parent)
@@ -27,6 +28,25 @@ CommandMotd::CommandMotd(Module* parent)
 	syntax = "[<servername>]";
 }
 
+template <typename Sink>
+static void SendMotd(const Sink& sink, const file_cache& motd)
+{
+	Numeric::Numeric start(RPL_MOTDSTART);
+	start.push(InspIRCd::Format("%s message of the day", ServerInstance->Config->ServerName.c_str()));
+	sink(start);
+
+	for (file_cache::const_iterator i = motd.begin(); i != motd.end(); ++i)
+	{
+		Numeric::Numeric line(RPL_MOTD);
+		line.push(InspIRCd::Format("- %s", i->c_str()));
+		sink(line);
+	}
+
+	Numeric::Numeric end(RPL_ENDOFMOTD);
+	end.push("End of message of the day.");
+	sink(end);
+}
+
 /** Handle /MOTD
  */
 CmdResult CommandMotd::Handle(User* user, const Params& parameters)
@@ -52,12 +72,17 @@ CmdResult CommandMotd::Handle(User* user, const Params& parameters)
 		return CMD_SUCCESS;
 	}
 
-	user->WriteRemoteNumeric(RPL_MOTDSTART, InspIRCd::Format("%s message of the day", ServerInstance->Config->ServerName.c_str()));
-
-	for (file_cache::iterator i = motd->second.begin(); i != motd->second.end(); i++)
-		user->WriteRemoteNumeric(RPL_MOTD, InspIRCd::Format("- %s", i->c_str()));
-
-	user->WriteRemoteNumeric(RPL_ENDOFMOTD, "End of message of the day.");
+	if (localuser)
+	{
+		// Long MOTDs are sent to local users as their sendq drains.
+		Numeric::QueuedReply* const reply = new Numeric::QueuedReply(creator);
+		SendMotd(Numeric::QueuedReplySink(*reply), motd->second);
+		localuser->AddGenerator(reply);
+	}
+	else
+	{
+		SendMotd(Numeric::WriteRemoteNumericSink(user), motd->second);
+	}
 
 	return CMD_SUCCESS;
 }
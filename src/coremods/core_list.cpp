@@ -19,15 +19,215 @@
 
 
 #include "inspircd.h"
+#include "numericbuilder.h"
+
+/** A channel as it was at the time a ListSnapshot was taken. The reply is formatted when the
+ * snapshot is taken so the details which are shown always match the ones which were filtered on.
+ */
+struct ListEntry
+{
+	/** The channel or NULL if it does not exist anymore, see IsCurrent(). */
+	Channel* chan;
+
+	/** The name of the channel. */
+	std::string name;
+
+	/** The topic of the channel. */
+	std::string topic;
+
+	/** The number of users in the channel. */
+	size_t users;
+
+	/** The creation time of the channel. */
+	time_t creationtime;
+
+	/** The time the topic was set or 0 if there is no topic. */
+	time_t topictime;
+
+	/** The modes and topic of the channel as shown to users who are not in it. */
+	std::string text;
+
+	/** The modes and topic of the channel as shown to users who are in it or empty if they are the same as text. */
+	std::string membertext;
+
+	/** Check whether the channel in the entry still exists and is the same channel.
+	 * @return The channel if it is still the one the entry was made for, NULL otherwise.
+	 */
+	Channel* IsCurrent() const
+	{
+		Channel* const current = ServerInstance->FindChan(name);
+		if ((current != chan) || (!current) || (current->age != creationtime))
+			return NULL;
+		return current;
+	}
+
+	bool operator<(const ListEntry& other) const
+	{
+		return irc::insensitive_swo()(name, other.name);
+	}
+};
+
+/** All channels on the network sorted by name. A snapshot is shared between every LIST
+ * started while it is current and lives until the last of them has finished.
+ */
+class ListSnapshot : public refcountbase
+{
+ public:
+	/** The channels in the snapshot. */
+	std::vector<ListEntry> entries;
+
+	/** The time at which the snapshot was taken. */
+	const time_t created;
+
+	ListSnapshot()
+		: created(ServerInstance->Time())
+	{
+		const chan_hash& chans = ServerInstance->GetChans();
+		entries.resize(chans.size());
+
+		std::vector<ListEntry>::iterator entry = entries.begin();
+		for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i, ++entry)
+		{
+			Channel* const chan = i->second;
+			entry->chan = chan;
+			entry->name = chan->name;
+			entry->topic = chan->topic;
+			entry->users = chan->GetUserCounter();
+			entry->creationtime = chan->age;
+			entry->topictime = chan->topicset;
+			entry->text = InspIRCd::Format("[+%s] %s", chan->ChanModes(false), chan->topic.c_str());
+
+			const std::string membertext = InspIRCd::Format("[+%s] %s", chan->ChanModes(true), chan->topic.c_str());
+			if (membertext != entry->text)
+				entry->membertext = membertext;
+		}
+		std::sort(entries.begin(), entries.end());
+	}
+};
+
+/** The filters a user specified when running LIST.
+ */
+struct ListFilter
+{
+	// C: Searching based on creation time, via the "C<val" and "C>val" modifiers
+	// to search for a channel creation time that is lower or higher than val
+	// respectively.
+	time_t mincreationtime;
+	time_t maxcreationtime;
+
+	// M: Searching based on mask.
+	// N: Searching based on !mask.
+	bool match_name_topic;
+	bool match_inverted;
+	std::string match;
+
+	// T: Searching based on topic time, via the "T<val" and "T>val" modifiers to
+	// search for a topic time that is lower or higher than val respectively.
+	time_t mintopictime;
+	time_t maxtopictime;
+
+	// U: Searching based on user count within the channel, via the "<val" and
+	// ">val" modifiers to search for a channel that has less than or more than
+	// val users respectively.
+	size_t minusers;
+	size_t maxusers;
+
+	ListFilter()
+		: mincreationtime(0)
+		, maxcreationtime(0)
+		, match_name_topic(false)
+		, match_inverted(false)
+		, mintopictime(0)
+		, maxtopictime(0)
+		, minusers(0)
+		, maxusers(0)
+	{
+	}
+
+	/** Check whether a channel matches this filter.
+	 * @param entry The channel to check.
+	 * @return True if the channel should be listed, false otherwise.
+	 */
+	bool Matches(const ListEntry& entry) const
+	{
+		// Check the user count if a search has been specified.
+		if ((minusers && entry.users <= minusers) || (maxusers && entry.users >= maxusers))
+			return false;
+
+		// Check the creation ts if a search has been specified.
+		if ((mincreationtime && entry.creationtime <= mincreationtime) || (maxcreationtime && entry.creationtime >= maxcreationtime))
+			return false;
+
+		// Check the topic ts if a search has been specified.
+		const time_t topictime = entry.topictime;
+		if ((mintopictime && (!topictime || topictime <= mintopictime)) || (maxtopictime && (!topictime || topictime >= maxtopictime)))
+			return false;
+
+		// Attempt to match a glob pattern.
+		if (match_name_topic)
+		{
+			bool matches = InspIRCd::Match(entry.name, match) || InspIRCd::Match(entry.topic, match);
+
+			// The user specified an match that we did not match.
+			if (!matches && !match_inverted)
+				return false;
+
+			// The user specified an inverted match that we did match.
+			if (matches && match_inverted)
+				return false;
+		}
+
+		return true;
+	}
+};
+
+/** A LIST reply which is in the process of being sent to a user.
+ */
+class ListReply : public Numeric::Generator
+{
+ public:
+	/** The snapshot being listed. */
+	reference<ListSnapshot> snapshot;
+
+	/** The filters specified by the user. */
+	ListFilter filter;
+
+	/** The position of the next channel to list in the snapshot. */
+	size_t position;
+
+	/** Whether the user can see all channels. */
+	bool has_privs;
+
+	/** The secret (+s) channel mode. */
+	ChanModeReference& secretmode;
+
+	/** The private (+p) channel mode. */
+	ChanModeReference& privatemode;
+
+	ListReply(Module* mod, ListSnapshot* Snapshot, bool privs, ChanModeReference& SecretMode, ChanModeReference& PrivateMode)
+		: Numeric::Generator(mod)
+		, snapshot(Snapshot)
+		, position(0)
+		, has_privs(privs)
+		, secretmode(SecretMode)
+		, privatemode(PrivateMode)
+	{
+	}
+
+	bool Generate(LocalUser* user) CXX11_OVERRIDE;
+};
 
 /** Handle /LIST.
  */
-class CommandList : public Command
+class CommandList : public SplitCommand
 {
  private:
 	ChanModeReference secretmode;
 	ChanModeReference privatemode;
 
+	/** The most recent channel snapshot. */
+	reference<ListSnapshot> snapshot;
+
 	/** Parses the creation time or topic set time out of a LIST parameter.
 	 * @param value The parameter containing a minute count.
 	 * @return The UNIX time at \p value minutes ago.
@@ -40,13 +240,27 @@ class CommandList : public Command
 		return ServerInstance->Time() - (minutes * 60);
 	}
 
+	/** Get a channel snapshot, taking a new one if the current one is too old.
+	 * @return A snapshot which is no older than cachetime.
+	 */
+	ListSnapshot* GetSnapshot()
+	{
+		if ((!snapshot) || (ServerInstance->Time() >= snapshot->created + (time_t)cachetime))
+			snapshot = new ListSnapshot();
+		return snapshot;
+	}
+
  public:
+	/** The number of seconds a channel snapshot is reused for. */
+	unsigned long cachetime;
+
 	/** Constructor for list.
 	 */
 	CommandList(Module* parent)
-		: Command(parent,"LIST", 0, 0)
+		: SplitCommand(parent,"LIST", 0, 0)
 		, secretmode(creator, "secret")
 		, privatemode(creator, "private")
+		, cachetime(0)
 	{
 		Penalty = 5;
 	}
@@ -56,137 +270,109 @@ class CommandList : public Command
 	 * @param user The user issuing the command
 	 * @return A value from CmdResult to indicate command success or failure.
 	 */
-	CmdResult Handle(User* user, const Params& parameters) CXX11_OVERRIDE;
+	CmdResult HandleLocal(LocalUser* user, const Params& parameters) CXX11_OVERRIDE;
+
+	/** Discard the cached channel snapshot. */
+	void ResetSnapshot()
+	{
+		snapshot = NULL;
+	}
 };
 
 
 /** Handle /LIST
  */
-CmdResult CommandList::Handle(User* user, const Params& parameters)
+CmdResult CommandList::HandleLocal(LocalUser* user, const Params& parameters)
 {
-	// C: Searching based on creation time, via the "C<val" and "C>val" modifiers
-	// to search for a channel creation time that is lower or higher than val
-	// respectively.
-	time_t mincreationtime = 0;
-	time_t maxcreationtime = 0;
-
-	// M: Searching based on mask.
-	// N: Searching based on !mask.
-	bool match_name_topic = false;
-	bool match_inverted = false;
-	const char* match = NULL;
-
-	// T: Searching based on topic time, via the "T<val" and "T>val" modifiers to
-	// search for a topic time that is lower or higher than val respectively.
-	time_t mintopictime = 0;
-	time_t maxtopictime = 0;
-
-	// U: Searching based on user count within the channel, via the "<val" and
-	// ">val" modifiers to search for a channel that has less than or more than
-	// val users respectively.
-	size_t minusers = 0;
-	size_t maxusers = 0;
-
+	ListReply* const reply = new ListReply(creator, GetSnapshot(), user->HasPrivPermission("channels/auspex"), secretmode, privatemode);
+	ListFilter& filter = reply->filter;
 	if ((parameters.size() == 1) && (!parameters[0].empty()))
 	{
 		if (parameters[0][0] == '<')
 		{
-			maxusers = ConvToNum<size_t>(parameters[0].c_str() + 1);
+			filter.maxusers = ConvToNum<size_t>(parameters[0].c_str() + 1);
 		}
 		else if (parameters[0][0] == '>')
 		{
-			minusers = ConvToNum<size_t>(parameters[0].c_str() + 1);
+			filter.minusers = ConvToNum<size_t>(parameters[0].c_str() + 1);
 		}
 		else if (!parameters[0].compare(0, 2, "C<", 2))
 		{
-			mincreationtime = ParseMinutes(parameters[0]);
+			filter.mincreationtime = ParseMinutes(parameters[0]);
 		}
 		else if (!parameters[0].compare(0, 2, "C>", 2))
 		{
-			maxcreationtime = ParseMinutes(parameters[0]);
+			filter.maxcreationtime = ParseMinutes(parameters[0]);
 		}
 		else if (!parameters[0].compare(0, 2, "T<", 2))
 		{
-			mintopictime = ParseMinutes(parameters[0]);
+			filter.mintopictime = ParseMinutes(parameters[0]);
 		}
 		else if (!parameters[0].compare(0, 2, "T>", 2))
 		{
-			maxtopictime = ParseMinutes(parameters[0]);
+			filter.maxtopictime = ParseMinutes(parameters[0]);
 		}
 		else
 		{
 			// If the glob is prefixed with ! it is inverted.
-			match = parameters[0].c_str();
+			const char* match = parameters[0].c_str();
 			if (match[0] == '!')
 			{
-				match_inverted = true;
+				filter.match_inverted = true;
 				match += 1;
 			}
 
 			// Ensure that the user didn't just run "LIST !".
 			if (match[0])
-				match_name_topic = true;
+			{
+				filter.match_name_topic = true;
+				filter.match = match;
+			}
 		}
 	}
 
-	const bool has_privs = user->HasPrivPermission("channels/auspex");
-
 	user->WriteNumeric(RPL_LISTSTART, "Channel", "Users Name");
-	const chan_hash& chans = ServerInstance->GetChans();
-	for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
-	{
-		Channel* const chan = i->second;
+	user->AddGenerator(reply);
+	return CMD_SUCCESS;
+}
 
-		// Check the user count if a search has been specified.
-		const size_t users = chan->GetUserCounter();
-		if ((minusers && users <= minusers) || (maxusers && users >= maxusers))
+bool ListReply::Generate(LocalUser* user)
+{
+	// Skip over channels until one is listed so every call sends something.
+	const std::vector<ListEntry>& entries = snapshot->entries;
+	while (position < entries.size())
+	{
+		const ListEntry& entry = entries[position++];
+		if (!filter.Matches(entry))
 			continue;
 
-		// Check the creation ts if a search has been specified.
-		const time_t creationtime = chan->age;
-		if ((mincreationtime && creationtime <= mincreationtime) || (maxcreationtime && creationtime >= maxcreationtime))
+		// Skip channels which were destroyed, and possibly recreated, since the snapshot was taken.
+		Channel* const chan = entry.IsCurrent();
+		if (!chan)
 			continue;
 
-		// Check the topic ts if a search has been specified.
-		const time_t topictime = chan->topicset;
-		if ((mintopictime && (!topictime || topictime <= mintopictime)) || (maxtopictime && (!topictime || topictime >= maxtopictime)))
+		// Who can see the channel is decided by its current state so a channel which became
+		// private or secret after the snapshot was taken is not shown to outsiders.
+		const bool n = ((has_privs) || (chan->HasUser(user)));
+
+		// If we're not in the channel and +s is set on it, we want to ignore it
+		if ((!n) && (chan->IsModeSet(secretmode)))
 			continue;
 
-		// Attempt to match a glob pattern.
-		if (match_name_topic)
+		if ((!n) && (chan->IsModeSet(privatemode)))
 		{
-			bool matches = InspIRCd::Match(chan->name, match) || InspIRCd::Match(chan->topic, match);
-
-			// The user specified an match that we did not match.
-			if (!matches && !match_inverted)
-				continue;
-
-			// The user specified an inverted match that we did match.
-			if (matches && match_inverted)
-				continue;
+			// Channel is private (+p) and user is outside/not privileged
+			user->WriteNumeric(RPL_LIST, '*', entry.users, "");
+			return true;
 		}
 
-		// if the channel is not private/secret, OR the user is on the channel anyway
-		bool n = (has_privs || chan->HasUser(user));
-
-		// If we're not in the channel and +s is set on it, we want to ignore it
-		if ((n) || (!chan->IsModeSet(secretmode)))
-		{
-			if ((!n) && (chan->IsModeSet(privatemode)))
-			{
-				// Channel is private (+p) and user is outside/not privileged
-				user->WriteNumeric(RPL_LIST, '*', users, "");
-			}
-			else
-			{
-				/* User is in the channel/privileged, channel is not +s */
-				user->WriteNumeric(RPL_LIST, chan->name, users, InspIRCd::Format("[+%s] %s", chan->ChanModes(n), chan->topic.c_str()));
-			}
-		}
+		/* User is in the channel/privileged, channel is not +s */
+		user->WriteNumeric(RPL_LIST, entry.name, entry.users, ((n) && (!entry.membertext.empty())) ? entry.membertext : entry.text);
+		return true;
 	}
-	user->WriteNumeric(RPL_LISTEND, "End of channel list.");
 
-	return CMD_SUCCESS;
+	user->WriteNumeric(RPL_LISTEND, "End of channel list.");
+	return false;
 }
 
 class CoreModList : public Module
@@ -200,6 +386,13 @@ class CoreModList : public Module
 	{
 	}
 
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("list");
+		cmd.cachetime = tag->getDuration("cachetime", 10, 0, 3600);
+		cmd.ResetSnapshot();
+	}
+
 	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE
 	{
 		tokens["ELIST"] = "CMNTU";
@@ -23,12 +23,132 @@
 
 class MessageDetailsImpl : public MessageDetails
 {
+	/** The analysis of the text of this message. */
+	mutable MessageAnalysis analysis;
+
+	/** The text which analysis was computed for. */
+	mutable std::string analysedtext;
+
+	/** Whether analysis has been computed yet. */
+	mutable bool analysed;
+
+	/** Scans the text of this message and stores the results in analysis. */
+	void Analyse() const
+	{
+		analysis.ctcp = IsCTCP();
+		analysis.ctcpname.clear();
+		analysis.bodystart = 0;
+		analysis.bodylength = text.length();
+		if (analysis.ctcp)
+		{
+			// This finds the same name and body as IsCTCP(name, body) without copying the body.
+			size_t end_of_ctcp = *text.rbegin() == '\x1' ? 1 : 0;
+			size_t end_of_name = text.find(' ', 2);
+			size_t start_of_body = std::string::npos;
+			if (end_of_name == std::string::npos)
+			{
+				analysis.ctcpname.assign(text, 1, text.length() - 1 - end_of_ctcp);
+			}
+			else
+			{
+				analysis.ctcpname.assign(text, 1, end_of_name - 1);
+				start_of_body = text.find_first_not_of(' ', end_of_name + 1);
+			}
+
+			if (start_of_body == std::string::npos)
+			{
+				analysis.bodystart = text.length();
+				analysis.bodylength = 0;
+			}
+			else
+			{
+				analysis.bodystart = start_of_body;
+				analysis.bodylength = text.length() - start_of_body - end_of_ctcp;
+			}
+		}
+
+		std::fill(analysis.octets, analysis.octets + UCHAR_MAX + 1, 0);
+		analysis.formatting.clear();
+		analysis.utf8 = true;
+
+		// The remaining number of UTF-8 continuation octets and the range the next one must be in.
+		unsigned int needed = 0;
+		unsigned char lower = 0x80;
+		unsigned char upper = 0xBF;
+
+		const size_t bodyend = analysis.bodystart + analysis.bodylength;
+		for (size_t pos = 0; pos < text.length(); ++pos)
+		{
+			const unsigned char chr = static_cast<unsigned char>(text[pos]);
+			if (pos >= analysis.bodystart && pos < bodyend)
+				analysis.octets[chr]++;
+
+			// All control codes except \001 for CTCP are formatting.
+			if (chr < 32 && chr != 1)
+				analysis.formatting.push_back(pos);
+
+			if (chr < 0x80 && !needed)
+				continue;
+
+			if (!analysis.utf8)
+				continue;
+
+			if (needed)
+			{
+				if (chr < lower || chr > upper)
+					analysis.utf8 = false;
+				lower = 0x80;
+				upper = 0xBF;
+				needed--;
+			}
+			else if (chr >= 0xC2 && chr <= 0xDF)
+				needed = 1;
+			else if (chr >= 0xE0 && chr <= 0xEF)
+			{
+				// Reject overlong encodings and UTF-16 surrogates.
+				needed = 2;
+				if (chr == 0xE0)
+					lower = 0xA0;
+				else if (chr == 0xED)
+					upper = 0x9F;
+			}
+			else if (chr >= 0xF0 && chr <= 0xF4)
+			{
+				// Reject overlong encodings and code points above U+10FFFF.
+				needed = 3;
+				if (chr == 0xF0)
+					lower = 0x90;
+				else if (chr == 0xF4)
+					upper = 0x8F;
+			}
+			else
+				analysis.utf8 = false;
+		}
+
+		if (needed)
+			analysis.utf8 = false;
+	}
+
 public:
 	MessageDetailsImpl(MessageType mt, const std::string& msg, const ClientProtocol::TagMap& tags)
 		: MessageDetails(mt, msg, tags)
+		, analysed(false)
 	{
 	}
 
+	const MessageAnalysis& GetAnalysis() const CXX11_OVERRIDE
+	{
+		// Modules are allowed to change the text so the analysis is only reused if it
+		// still describes the current text.
+		if (!analysed || analysedtext != text)
+		{
+			analysedtext = text;
+			analysed = true;
+			Analyse();
+		}
+		return analysis;
+	}
+
 	bool IsCTCP(std::string& name, std::string& body) const CXX11_OVERRIDE
 	{
 		if (!this->IsCTCP())
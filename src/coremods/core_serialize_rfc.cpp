@@ -34,7 +34,13 @@ class RFCSerializer : public ClientProtocol::Serializer
 	/** The maximum size of server-originated message tags in an outgoing message including the `@`. */
 	static const std::string::size_type MAX_SERVER_MESSAGE_TAG_LENGTH = 511;
 
-	static void SerializeTags(const ClientProtocol::TagMap& tags, const ClientProtocol::TagSelection& tagwl, std::string& line);
+	/** Choose the tags to send from the whitelisted ones, keeping within the tag space limits.
+	 * @param tags All tags of the message.
+	 * @param tagwl Tags whitelisted for the recipient.
+	 * @param sendtags Tags that will be sent.
+	 * @return Length of the tags part of the message including the `@` and the trailing space.
+	 */
+	static std::string::size_type SelectTags(const ClientProtocol::TagMap& tags, const ClientProtocol::TagSelection& tagwl, ClientProtocol::TagSelection& sendtags);
 
  public:
 	RFCSerializer(Module* mod)
@@ -141,84 +147,139 @@ bool RFCSerializer::Parse(LocalUser* user, const std::string& line, ClientProtoc
 
 namespace
 {
-	void CheckTagLength(std::string& line, size_t prevsize, size_t& length, size_t maxlength)
+	/** Writes into a buffer allocated upfront, silently dropping anything past its end. */
+	class LineWriter
 	{
-		const std::string::size_type diffsize = line.size() - prevsize;
-		if (length + diffsize > maxlength)
-			line.erase(prevsize);
-		else
-			length += diffsize;
+		char* pos;
+		char* const end;
+
+	 public:
+		LineWriter(char* begin, char* End)
+			: pos(begin)
+			, end(End)
+		{
+		}
+
+		void Append(const char* str, std::string::size_type len)
+		{
+			len = std::min<std::string::size_type>(len, end - pos);
+			memcpy(pos, str, len);
+			pos += len;
+		}
+
+		void Append(const std::string& str) { Append(str.data(), str.length()); }
+
+		void Append(char chr)
+		{
+			if (pos != end)
+				*pos++ = chr;
+		}
+	};
+
+	std::string::size_type GetTagLength(const ClientProtocol::TagMap::value_type& tag)
+	{
+		// The leading '@' or ';', the name and an optional '=' followed by the value.
+		const std::string& val = tag.second.value;
+		return 1 + tag.first.length() + (val.empty() ? 0 : 1 + val.length());
 	}
 }
 
-void RFCSerializer::SerializeTags(const ClientProtocol::TagMap& tags, const ClientProtocol::TagSelection& tagwl, std::string& line)
+std::string::size_type RFCSerializer::SelectTags(const ClientProtocol::TagMap& tags, const ClientProtocol::TagSelection& tagwl, ClientProtocol::TagSelection& sendtags)
 {
-	size_t client_tag_length = 0;
-	size_t server_tag_length = 0;
+	std::string::size_type client_tag_length = 0;
+	std::string::size_type server_tag_length = 0;
 	for (ClientProtocol::TagMap::const_iterator i = tags.begin(); i != tags.end(); ++i)
 	{
 		if (!tagwl.IsSelected(tags, i))
 			continue;
 
-		const std::string::size_type prevsize = line.size();
-		line.push_back(prevsize ? ';' : '@');
-		line.append(i->first);
-		const std::string& val = i->second.value;
-		if (!val.empty())
-		{
-			line.push_back('=');
-			line.append(val);
-		}
-
 		// The tags part of the message must not contain more client and server tags than allowed by the
 		// message tags specification. This is complicated by the tag space having separate limits for
-		// both server-originated and client-originated tags. If either of the tag limits is exceeded then
-		// the most recently added tag is removed.
-		if (i->first[0] == '+')
-			CheckTagLength(line, prevsize, client_tag_length, MAX_CLIENT_MESSAGE_TAG_LENGTH);
-		else
-			CheckTagLength(line, prevsize, server_tag_length, MAX_SERVER_MESSAGE_TAG_LENGTH);
+		// both server-originated and client-originated tags. If either of the tag limits would be exceeded
+		// then the tag is skipped.
+		const std::string::size_type taglength = GetTagLength(*i);
+		std::string::size_type& length = (i->first[0] == '+' ? client_tag_length : server_tag_length);
+		const std::string::size_type maxlength = (i->first[0] == '+' ? MAX_CLIENT_MESSAGE_TAG_LENGTH : MAX_SERVER_MESSAGE_TAG_LENGTH);
+		if (length + taglength > maxlength)
+			continue;
+
+		length += taglength;
+		sendtags.Select(tags, i);
 	}
 
-	if (!line.empty())
-		line.push_back(' ');
+	const std::string::size_type total = client_tag_length + server_tag_length;
+	return (total ? total + 1 : 0);
 }
 
 ClientProtocol::SerializedMessage RFCSerializer::Serialize(const ClientProtocol::Message& msg, const ClientProtocol::TagSelection& tagwl) const
 {
-	std::string line;
-	SerializeTags(msg.GetTags(), tagwl, line);
+	// Work out the exact length of the line first so it can be written with a single allocation.
+	const ClientProtocol::TagMap& tags = msg.GetTags();
+	ClientProtocol::TagSelection sendtags;
+	const std::string::size_type tagslength = SelectTags(tags, tagwl, sendtags);
+
+	const std::string* const source = msg.GetSource();
+	const char* const command = msg.GetCommand();
+	const std::string::size_type commandlength = strlen(command);
+	std::string::size_type rfclength = commandlength;
+	if (source)
+		rfclength += source->length() + 2;
+
+	const ClientProtocol::Message::ParamList& params = msg.GetParams();
+	for (ClientProtocol::Message::ParamList::const_iterator i = params.begin(); i != params.end(); ++i)
+		rfclength += static_cast<const std::string&>(*i).length() + 1;
+	if (!params.empty())
+		rfclength++;
 
-	// Save position for length calculation later
-	const std::string::size_type rfcmsg_begin = line.size();
+	// Truncate if too long
+	rfclength = std::min<std::string::size_type>(rfclength, ServerInstance->Config->Limits.MaxLine - 2);
 
-	if (msg.GetSource())
+	std::string line(tagslength + rfclength + 2, '\0');
+	char* const begin = &line[0];
+	LineWriter writer(begin, begin + tagslength + rfclength);
+	if (tagslength)
 	{
-		line.push_back(':');
-		line.append(*msg.GetSource());
-		line.push_back(' ');
+		bool firsttag = true;
+		for (ClientProtocol::TagMap::const_iterator i = tags.begin(); i != tags.end(); ++i)
+		{
+			if (!sendtags.IsSelected(tags, i))
+				continue;
+
+			writer.Append(firsttag ? '@' : ';');
+			firsttag = false;
+			writer.Append(i->first);
+			const std::string& val = i->second.value;
+			if (!val.empty())
+			{
+				writer.Append('=');
+				writer.Append(val);
+			}
+		}
+		writer.Append(' ');
 	}
-	line.append(msg.GetCommand());
 
-	const ClientProtocol::Message::ParamList& params = msg.GetParams();
+	if (source)
+	{
+		writer.Append(':');
+		writer.Append(*source);
+		writer.Append(' ');
+	}
+	writer.Append(command, commandlength);
+
 	if (!params.empty())
 	{
 		for (ClientProtocol::Message::ParamList::const_iterator i = params.begin(); i != params.end()-1; ++i)
 		{
-			const std::string& param = *i;
-			line.push_back(' ');
-			line.append(param);
+			writer.Append(' ');
+			writer.Append(*i);
 		}
 
-		line.append(" :", 2).append(params.back());
+		writer.Append(" :", 2);
+		writer.Append(params.back());
 	}
 
-	// Truncate if too long
-	std::string::size_type maxline = ServerInstance->Config->Limits.MaxLine - 2;
-	if (line.length() - rfcmsg_begin > maxline)
-		line.erase(rfcmsg_begin + maxline);
-
-	line.append("\r\n", 2);
+	line[line.length() - 2] = '\r';
+	line[line.length() - 1] = '\n';
 	return line;
 }
 
@@ -20,6 +20,7 @@
 
 
 #include "inspircd.h"
+#include "numericbuilder.h"
 #include "xline.h"
 #include "modules/stats.h"
 
@@ -311,6 +312,7 @@ void CommandStats::DoStats(Stats::Context& stats)
 			stats.AddRow(249, "unknown commands "+ConvToStr(ServerInstance->stats.Unknown));
 			stats.AddRow(249, "nick collisions "+ConvToStr(ServerInstance->stats.Collisions));
 			stats.AddRow(249, "dns requests "+ConvToStr(ServerInstance->stats.DnsGood+ServerInstance->stats.DnsBad)+" succeeded "+ConvToStr(ServerInstance->stats.DnsGood)+" failed "+ConvToStr(ServerInstance->stats.DnsBad));
+			stats.AddRow(249, "dns cache hits "+ConvToStr(ServerInstance->stats.DnsCacheHit)+" misses "+ConvToStr(ServerInstance->stats.DnsCacheMiss)+" coalesced "+ConvToStr(ServerInstance->stats.DnsCoalesced));
 			stats.AddRow(249, "connection count "+ConvToStr(ServerInstance->stats.Connects));
 			stats.AddRow(249, InspIRCd::Format("bytes sent %5.2fK recv %5.2fK",
 				ServerInstance->stats.Sent / 1024.0, ServerInstance->stats.Recv / 1024.0));
@@ -389,6 +391,18 @@ CmdResult CommandStats::Handle(User* user, const Params& parameters)
 	Stats::Context stats(user, parameters[0][0]);
 	DoStats(stats);
 	const std::vector<Stats::Row>& rows = stats.GetRows();
+
+	// Local users get large listings (e.g. of X-lines) as their sendq drains.
+	LocalUser* localuser = IS_LOCAL(user);
+	if (localuser)
+	{
+		Numeric::QueuedReply* const reply = new Numeric::QueuedReply(creator);
+		for (std::vector<Stats::Row>::const_iterator i = rows.begin(); i != rows.end(); ++i)
+			reply->Add(*i);
+		localuser->AddGenerator(reply);
+		return CMD_SUCCESS;
+	}
+
 	for (std::vector<Stats::Row>::const_iterator i = rows.begin(); i != rows.end(); ++i)
 	{
 		const Stats::Row& row = *i;
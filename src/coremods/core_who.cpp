@@ -21,6 +21,7 @@
 
 
 #include "inspircd.h"
+#include "numericbuilder.h"
 #include "modules/account.h"
 #include "modules/who.h"
 
@@ -77,6 +78,219 @@ struct WhoData : public Who::Request
 	}
 };
 
+/** Indexes over the fields of registered users which WHO can search by using the literal
+ * part of a mask. The indexes only select candidates, every candidate is still checked
+ * with CommandWho::MatchUser().
+ */
+class WhoIndex
+{
+ public:
+	typedef std::multimap<std::string, User*> Index;
+
+ private:
+	/** The positions of a user in the indexes. */
+	struct Entry
+	{
+		Index::iterator host;
+		Index::iterator realhost;
+		Index::iterator server;
+		Index::iterator ip;
+		Index::iterator account;
+		bool hasip;
+		bool hasaccount;
+	};
+
+	typedef std::map<User*, Entry> EntryMap;
+
+	/** The positions of all indexed users. */
+	EntryMap entries;
+
+	/** The extension generation the account index was built at. */
+	unsigned long extgeneration;
+
+	static std::string MapKey(const std::string& str, unsigned const char* map)
+	{
+		std::string key(str);
+		for (std::string::iterator i = key.begin(); i != key.end(); ++i)
+			*i = map[static_cast<unsigned char>(*i)];
+		return key;
+	}
+
+	void AddAccount(User* user, Entry& entry, const std::string* account)
+	{
+		entry.hasaccount = ((account) && (!account->empty()));
+		if (entry.hasaccount)
+			entry.account = accounts.insert(std::make_pair(GetAccountKey(*account), user));
+	}
+
+ public:
+	/** Displayed hosts, reversed and lower case so masks like *.example.com can use them. */
+	Index hosts;
+
+	/** Real hosts in the same format as hosts. */
+	Index realhosts;
+
+	/** Server names in the same format as hosts. */
+	Index servers;
+
+	/** IP addresses as the address family followed by the raw address bytes. */
+	Index ips;
+
+	/** Account names in the case used by InspIRCd::Match(). */
+	Index accounts;
+
+	WhoIndex()
+		: extgeneration(0)
+	{
+	}
+
+	static std::string GetHostKey(const std::string& host)
+	{
+		std::string key = MapKey(host, ascii_case_insensitive_map);
+		std::reverse(key.begin(), key.end());
+		return key;
+	}
+
+	static std::string GetAccountKey(const std::string& account)
+	{
+		return MapKey(account, national_case_insensitive_map);
+	}
+
+	static bool GetIPKey(const irc::sockets::cidr_mask& mask, std::string& key)
+	{
+		if ((mask.type != AF_INET) && (mask.type != AF_INET6))
+			return false;
+
+		// Only whole bytes can be used as a prefix.
+		key.assign(1, static_cast<char>(mask.type));
+		key.append(reinterpret_cast<const char*>(mask.bits), mask.length / 8);
+		return true;
+	}
+
+	static bool GetIPKey(const irc::sockets::sockaddrs& sa, std::string& key)
+	{
+		return GetIPKey(irc::sockets::cidr_mask(sa, 128), key);
+	}
+
+	/** Get all users with a key starting with the given prefix.
+	 * @param index Index to search.
+	 * @param prefix Key prefix to look for.
+	 * @param users List to add the users to.
+	 */
+	static void FindPrefix(const Index& index, const std::string& prefix, std::vector<User*>& users)
+	{
+		for (Index::const_iterator i = index.lower_bound(prefix); i != index.end(); ++i)
+		{
+			if (i->first.compare(0, prefix.length(), prefix))
+				break;
+			users.push_back(i->second);
+		}
+	}
+
+	void Add(User* user)
+	{
+		std::pair<EntryMap::iterator, bool> res = entries.insert(std::make_pair(user, Entry()));
+		if (!res.second)
+			return;
+
+		Entry& entry = res.first->second;
+		entry.host = hosts.insert(std::make_pair(GetHostKey(user->GetDisplayedHost()), user));
+		entry.realhost = realhosts.insert(std::make_pair(GetHostKey(user->GetRealHost()), user));
+		entry.server = servers.insert(std::make_pair(GetHostKey(user->server->GetName()), user));
+
+		std::string ipkey;
+		entry.hasip = GetIPKey(user->client_sa, ipkey);
+		if (entry.hasip)
+			entry.ip = ips.insert(std::make_pair(ipkey, user));
+
+		const AccountExtItem* const accountext = GetAccountExtItem();
+		AddAccount(user, entry, accountext ? accountext->get(user) : NULL);
+	}
+
+	void Remove(User* user)
+	{
+		EntryMap::iterator it = entries.find(user);
+		if (it == entries.end())
+			return;
+
+		Entry& entry = it->second;
+		hosts.erase(entry.host);
+		realhosts.erase(entry.realhost);
+		servers.erase(entry.server);
+		if (entry.hasip)
+			ips.erase(entry.ip);
+		if (entry.hasaccount)
+			accounts.erase(entry.account);
+		entries.erase(it);
+	}
+
+	/** Update the displayed host of a user. This is called before the host is changed.
+	 * @param user User whose host is changing.
+	 * @param newhost The new displayed host of the user.
+	 */
+	void ChangeHost(User* user, const std::string& newhost)
+	{
+		EntryMap::iterator it = entries.find(user);
+		if (it == entries.end())
+			return;
+
+		Entry& entry = it->second;
+		hosts.erase(entry.host);
+		entry.host = hosts.insert(std::make_pair(GetHostKey(newhost.substr(0, ServerInstance->Config->Limits.MaxHost)), user));
+	}
+
+	void ChangeAccount(User* user, const std::string& newaccount)
+	{
+		EntryMap::iterator it = entries.find(user);
+		if (it == entries.end())
+			return;
+
+		Entry& entry = it->second;
+		if (entry.hasaccount)
+			accounts.erase(entry.account);
+		AddAccount(user, entry, &newaccount);
+	}
+
+	/** Rebuild the account index if the account extension has been registered or unregistered
+	 * since it was built, as that happens without an account change event.
+	 */
+	void CheckAccounts()
+	{
+		const unsigned long currgeneration = ServerInstance->Extensions.GetGeneration();
+		if (currgeneration == extgeneration)
+			return;
+
+		extgeneration = currgeneration;
+		accounts.clear();
+		const AccountExtItem* const accountext = GetAccountExtItem();
+		for (EntryMap::iterator i = entries.begin(); i != entries.end(); ++i)
+			AddAccount(i->first, i->second, accountext ? accountext->get(i->first) : NULL);
+	}
+
+	void Clear()
+	{
+		entries.clear();
+		hosts.clear();
+		realhosts.clear();
+		servers.clear();
+		ips.clear();
+		accounts.clear();
+	}
+
+	void Rebuild()
+	{
+		Clear();
+		extgeneration = ServerInstance->Extensions.GetGeneration();
+		const user_hash& users = ServerInstance->Users->GetUsers();
+		for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
+		{
+			User* const user = i->second;
+			if ((user->registered == REG_ALL) && (!user->quitting))
+				Add(user);
+		}
+	}
+};
+
 class CommandWho : public SplitCommand
 {
  private:
@@ -133,7 +347,18 @@ class CommandWho : public SplitCommand
 	template<typename T>
 	void WhoUsers(LocalUser* source, const std::vector<std::string>& parameters, const T& users, WhoData& data);
 
+	/** Uses the indexes to find the users which may match a WHO request.
+	 * @return True if the candidates were found using an index, false if all users need to be checked.
+	 */
+	bool FindCandidates(LocalUser* source, WhoData& data, std::vector<User*>& candidates);
+
  public:
+	/** Indexes over user fields, used for mask searches if enabled. */
+	WhoIndex index;
+
+	/** Whether the indexes are being maintained. */
+	bool useindex;
+
 	CommandWho(Module* parent)
 		: SplitCommand(parent, "WHO", 1, 3)
 		, secretmode(parent, "secret")
@@ -141,6 +366,7 @@ class CommandWho : public SplitCommand
 		, hidechansmode(parent, "hidechans")
 		, invisiblemode(parent, "invisible")
 		, whoevprov(parent, "event/who")
+		, useindex(false)
 	{
 		allow_empty_last_param = false;
 		syntax = "<server>|<nickname>|<channel>|<realname>|<host>|0 [[Aafhilmnoprstux][%acdfhilnorstu] <server>|<nickname>|<channel>|<realname>|<host>|0]";
@@ -155,6 +381,93 @@ class CommandWho : public SplitCommand
 template<> User* CommandWho::GetUser(UserManager::OperList::const_iterator& t) { return *t; }
 template<> User* CommandWho::GetUser(user_hash::const_iterator& t) { return t->second; }
 
+bool CommandWho::FindCandidates(LocalUser* source, WhoData& data, std::vector<User*>& candidates)
+{
+	// The part of the mask before the first wildcard and the part after the last one.
+	const std::string& mask = data.matchtext;
+	const std::string prefix = mask.substr(0, mask.find_first_of("*?"));
+	const std::string::size_type lastwild = mask.find_last_of("*?");
+	const std::string suffix = (lastwild == std::string::npos ? mask : mask.substr(lastwild + 1));
+
+	// The fields are checked in the same order as in MatchUser().
+	bool source_has_users_auspex = source->HasPrivPermission("users/auspex");
+	if (data.flags['A'])
+		return false;
+
+	if (data.flags['a'])
+	{
+		if (prefix.empty())
+			return false;
+
+		index.CheckAccounts();
+		WhoIndex::FindPrefix(index.accounts, WhoIndex::GetAccountKey(prefix), candidates);
+		return true;
+	}
+
+	if (data.flags['h'])
+	{
+		if (suffix.empty())
+			return false;
+
+		// The source always sees their own real host when they specify x.
+		const bool realhost = (source_has_users_auspex && data.flags['x']);
+		WhoIndex::FindPrefix(realhost ? index.realhosts : index.hosts, WhoIndex::GetHostKey(suffix), candidates);
+		if ((!realhost) && (data.flags['x']))
+		{
+			User* const self = source;
+			stdalgo::erase(candidates, self);
+			candidates.push_back(self);
+		}
+		return true;
+	}
+
+	if (data.flags['i'])
+	{
+		// Only the source can match unless they can see the IP address of everyone.
+		if (!source_has_users_auspex)
+		{
+			candidates.push_back(source);
+			return true;
+		}
+
+		// Only plain IP addresses and CIDR ranges can be looked up.
+		if (mask.find_first_of("*?!@") != std::string::npos)
+			return false;
+
+		const std::string::size_type slash = mask.find('/');
+		irc::sockets::sockaddrs sa;
+		if (!irc::sockets::aptosa(mask.substr(0, slash), 0, sa))
+			return false;
+
+		unsigned int length = 128;
+		if (slash != std::string::npos)
+			length = std::min<unsigned int>(ConvToNum<unsigned int>(mask.substr(slash + 1)), 128);
+
+		std::string key;
+		if (!WhoIndex::GetIPKey(irc::sockets::cidr_mask(sa, length), key))
+			return false;
+
+		WhoIndex::FindPrefix(index.ips, key, candidates);
+		return true;
+	}
+
+	if (data.flags['m'] || data.flags['n'] || data.flags['p'] || data.flags['r'])
+		return false;
+
+	if (data.flags['s'])
+	{
+		// Every user is on the hidden server unless the source can see the real ones.
+		bool show_real_server_name = ServerInstance->Config->HideServer.empty() || (source->HasPrivPermission("servers/auspex") && data.flags['x']);
+		if ((!show_real_server_name) || (suffix.empty()))
+			return false;
+
+		WhoIndex::FindPrefix(index.servers, WhoIndex::GetHostKey(suffix), candidates);
+		return true;
+	}
+
+	return false;
+}
+
 bool CommandWho::MatchChannel(LocalUser* source, Membership* memb, WhoData& data)
 {
 	bool source_has_users_auspex = source->HasPrivPermission("users/auspex");
@@ -533,29 +846,80 @@ CmdResult CommandWho::HandleLocal(LocalUser* user, const Params& parameters)
 	else if (data.flags['o'])
 		WhoUsers(user, parameters, ServerInstance->Users->all_opers, data);
 
-	// Otherwise we have to use the global user list.
+	// Otherwise we have to use the global user list unless an index can narrow it down.
 	else
-		WhoUsers(user, parameters, ServerInstance->Users->GetUsers(), data);
+	{
+		std::vector<User*> candidates;
+		if ((useindex) && (FindCandidates(user, data, candidates)))
+			WhoUsers(user, parameters, candidates, data);
+		else
+			WhoUsers(user, parameters, ServerInstance->Users->GetUsers(), data);
+	}
 
-	// Send the results to the source.
+	// Send the results to the source, large result sets are sent as the sendq drains.
+	Numeric::QueuedReply* const reply = new Numeric::QueuedReply(creator);
 	for (std::vector<Numeric::Numeric>::const_iterator n = data.results.begin(); n != data.results.end(); ++n)
-		user->WriteNumeric(*n);
-	user->WriteNumeric(RPL_ENDOFWHO, (data.matchtext.empty() ? "*" : data.matchtext.c_str()), "End of /WHO list.");
+		reply->Add(*n);
+
+	Numeric::Numeric end(RPL_ENDOFWHO);
+	end.push(data.matchtext.empty() ? "*" : data.matchtext);
+	end.push("End of /WHO list.");
+	reply->Add(end);
+	user->AddGenerator(reply);
 
 	// Penalize the source a bit for large queries with one unit of penalty per 200 results.
 	user->CommandFloodPenalty += data.results.size() * 5;
 	return CMD_SUCCESS;
 }
 
-class CoreModWho : public Module
+class CoreModWho : public Module, public AccountEventListener
 {
  private:
 	CommandWho cmd;
 
  public:
 	CoreModWho()
-		: cmd(this)
+		: AccountEventListener(this)
+		, cmd(this)
+	{
+	}
+
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("who");
+		const bool useindex = tag->getBool("index");
+		if (useindex == cmd.useindex)
+			return;
+
+		cmd.useindex = useindex;
+		if (useindex)
+			cmd.index.Rebuild();
+		else
+			cmd.index.Clear();
+	}
+
+	void OnPostConnect(User* user) CXX11_OVERRIDE
+	{
+		if (cmd.useindex)
+			cmd.index.Add(user);
+	}
+
+	void OnUserQuit(User* user, const std::string& message, const std::string& oper_message) CXX11_OVERRIDE
+	{
+		if (cmd.useindex)
+			cmd.index.Remove(user);
+	}
+
+	void OnChangeHost(User* user, const std::string& newhost) CXX11_OVERRIDE
+	{
+		if (cmd.useindex)
+			cmd.index.ChangeHost(user, newhost);
+	}
+
+	void OnAccountChange(User* user, const std::string& newaccount) CXX11_OVERRIDE
 	{
+		if (cmd.useindex)
+			cmd.index.ChangeAccount(user, newaccount);
 	}
 
 	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE
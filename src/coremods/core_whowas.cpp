@@ -50,26 +50,25 @@ CmdResult CommandWhowas::Handle(User* user, const Params& parameters)
 		return CMD_FAILURE;
 	}
 
-	const WhoWas::Nick* const nick = manager.FindNick(parameters[0]);
-	if (!nick)
+	WhoWas::Manager::List list;
+	if (!manager.FindNick(parameters[0], list))
 	{
 		user->WriteNumeric(ERR_WASNOSUCHNICK, parameters[0], "There was no such nickname");
 	}
 	else
 	{
-		const WhoWas::Nick::List& list = nick->entries;
-		for (WhoWas::Nick::List::const_iterator i = list.begin(); i != list.end(); ++i)
+		for (WhoWas::Manager::List::const_iterator i = list.begin(); i != list.end(); ++i)
 		{
-			WhoWas::Entry* u = *i;
+			const WhoWas::Entry& u = *i;
 
-			user->WriteNumeric(RPL_WHOWASUSER, parameters[0], u->ident, u->dhost, '*', u->real);
+			user->WriteNumeric(RPL_WHOWASUSER, parameters[0], u.ident, u.dhost, '*', u.real);
 
 			if (user->HasPrivPermission("users/auspex"))
-				user->WriteNumeric(RPL_WHOWASIP, parameters[0], InspIRCd::Format("was connecting from *@%s", u->host.c_str()));
+				user->WriteNumeric(RPL_WHOWASIP, parameters[0], InspIRCd::Format("was connecting from *@%s", u.host.c_str()));
 
-			std::string signon = InspIRCd::TimeString(u->signon);
+			std::string signon = InspIRCd::TimeString(u.signon);
 			bool hide_server = (!ServerInstance->Config->HideServer.empty() && !user->HasPrivPermission("servers/auspex"));
-			user->WriteNumeric(RPL_WHOISSERVER, parameters[0], (hide_server ? ServerInstance->Config->HideServer : u->server), signon);
+			user->WriteNumeric(RPL_WHOISSERVER, parameters[0], (hide_server ? ServerInstance->Config->HideServer : u.server), signon);
 		}
 	}
 
@@ -77,30 +76,50 @@ CmdResult CommandWhowas::Handle(User* user, const Params& parameters)
 	return CMD_SUCCESS;
 }
 
+// Records are padded to a multiple of this so every record header is suitably aligned.
+static const size_t RecordAlign = sizeof(uint64_t);
+
+// Longest string which can be stored in a record, longer ones are truncated.
+static const size_t MaxFieldLength = 65535;
+
 WhoWas::Manager::Manager()
-	: GroupSize(0), MaxGroups(0), MaxKeep(0)
+	: tail(0)
+	, head(0)
+	, end(0)
+	, wrapped(false)
+	, records(0)
+	, entries(0)
+	, GroupSize(0)
+	, MaxSize(0)
+	, MaxKeep(0)
 {
 }
 
-const WhoWas::Nick* WhoWas::Manager::FindNick(const std::string& nickname) const
+bool WhoWas::Manager::FindNick(const std::string& nickname, List& list) const
 {
-	whowas_users::const_iterator it = whowas.find(nickname);
-	if (it == whowas.end())
-		return NULL;
-	return it->second;
+	NickIndex::const_iterator it = nicks.find(nickname);
+	if (it == nicks.end())
+		return false;
+
+	// Walk from the newest record to the oldest one, filling the list from the back.
+	const NickInfo& info = it->second;
+	list.resize(info.count);
+	size_t offset = info.newest;
+	for (size_t i = info.count; i-- > 0; )
+	{
+		const Record* rec = GetRecord(offset);
+		ReadRecord(rec, list[i]);
+		offset = rec->older;
+	}
+	return true;
 }
 
 WhoWas::Manager::Stats WhoWas::Manager::GetStats() const
 {
-	size_t entrycount = 0;
-	for (whowas_users::const_iterator i = whowas.begin(); i != whowas.end(); ++i)
-	{
-		WhoWas::Nick::List& list = i->second->entries;
-		entrycount += list.size();
-	}
-
 	Stats stats;
-	stats.entrycount = entrycount;
+	stats.entrycount = entries;
+	stats.bytesused = (wrapped ? (end - tail + head) : (head - tail));
+	stats.bytesmax = ring.size();
 	return stats;
 }
 
@@ -109,156 +128,216 @@ void WhoWas::Manager::Add(User* user)
 	if (!IsEnabled())
 		return;
 
-	// Insert nick if it doesn't exist
-	// 'first' will point to the newly inserted element or to the existing element with an equivalent key
-	std::pair<whowas_users::iterator, bool> ret = whowas.insert(std::make_pair(user->nick, static_cast<WhoWas::Nick*>(NULL)));
-
-	if (ret.second) // If inserted
-	{
-		// This nick is new, create a list for it and add the first record to it
-		WhoWas::Nick* nick = new WhoWas::Nick(ret.first->first);
-		nick->entries.push_back(new Entry(user));
-		ret.first->second = nick;
+	Store(user->nick, user->ident, user->GetRealHost(), user->GetDisplayedHost(), user->server->GetName(), user->GetRealName(), user->signon, ServerInstance->Time());
+}
 
-		// Add this nick to the fifo too
-		whowas_fifo.push_back(nick);
+void WhoWas::Manager::Store(const std::string& nick, const std::string& ident, const std::string& host, const std::string& dhost,
+	const std::string& server, const std::string& real, time_t signon, time_t addtime)
+{
+	const uint16_t nicklen = std::min<size_t>(nick.length(), MaxFieldLength);
+	const uint16_t identlen = std::min<size_t>(ident.length(), MaxFieldLength);
+	const uint16_t hostlen = std::min<size_t>(host.length(), MaxFieldLength);
+	const uint16_t dhostlen = (dhost == host ? 0 : std::min<size_t>(dhost.length(), MaxFieldLength));
+	const uint16_t reallen = std::min<size_t>(real.length(), MaxFieldLength);
+
+	size_t size = sizeof(Record) + nicklen + identlen + hostlen + dhostlen + reallen;
+	size = (size + RecordAlign - 1) / RecordAlign * RecordAlign;
+	if (size > ring.size())
+		return;
 
-		if (whowas.size() > this->MaxGroups)
-		{
-			// Too many nicks, remove the nick which was inserted the longest time ago from both the map and the fifo
-			PurgeNick(whowas_fifo.front());
-		}
+	// Make room first as this may remove records of this nick from the index.
+	const size_t offset = Allocate(size);
+	Record* rec = new(&ring[offset]) Record;
+	rec->size = size;
+	rec->signon = signon;
+	rec->addtime = addtime;
+	rec->nicklen = nicklen;
+	rec->identlen = identlen;
+	rec->hostlen = hostlen;
+	rec->dhostlen = dhostlen;
+	rec->reallen = reallen;
+	rec->dead = false;
+
+	ServerNames::iterator serverit = servernames.insert(std::make_pair(server, 0)).first;
+	serverit->second++;
+	rec->server = &serverit->first;
+
+	char* data = &ring[offset + sizeof(Record)];
+	data = std::copy(nick.begin(), nick.begin() + nicklen, data);
+	data = std::copy(ident.begin(), ident.begin() + identlen, data);
+	data = std::copy(host.begin(), host.begin() + hostlen, data);
+	data = std::copy(dhost.begin(), dhost.begin() + dhostlen, data);
+	std::copy(real.begin(), real.begin() + reallen, data);
+
+	records++;
+	entries++;
+
+	std::pair<NickIndex::iterator, bool> ret = nicks.insert(std::make_pair(nick, NickInfo()));
+	NickInfo& info = ret.first->second;
+	if (ret.second)
+	{
+		rec->older = offset;
+		info.count = 1;
 	}
 	else
 	{
-		// We've met this nick before, add a new record to the list
-		WhoWas::Nick::List& list = ret.first->second->entries;
-		list.push_back(new Entry(user));
+		rec->older = info.newest;
+		info.count++;
+	}
+	info.newest = offset;
 
-		// If there are too many records for this nick, remove the oldest (front)
-		if (list.size() > this->GroupSize)
-		{
-			delete list.front();
-			list.pop_front();
-		}
+	// If there are too many records for this nick, remove the oldest one. Its space is
+	// reclaimed when it reaches the tail.
+	if (info.count > GroupSize)
+	{
+		size_t oldest = info.newest;
+		for (uint32_t i = 1; i < info.count; ++i)
+			oldest = GetRecord(oldest)->older;
+
+		GetRecord(oldest)->dead = true;
+		info.count--;
+		entries--;
 	}
 }
 
-/* on rehash, refactor maps according to new conf values */
-void WhoWas::Manager::Prune()
+size_t WhoWas::Manager::Allocate(size_t size)
 {
-	time_t min = ServerInstance->Time() - this->MaxKeep;
-
-	/* first cut the list to new size (maxgroups) and also prune entries that are timed out. */
-	while (!whowas_fifo.empty())
+	for (;;)
 	{
-		WhoWas::Nick* nick = whowas_fifo.front();
-		if ((whowas_fifo.size() > this->MaxGroups) || (nick->addtime < min))
-			PurgeNick(nick);
-		else
-			break;
-	}
+		if (!records)
+		{
+			tail = head = 0;
+			wrapped = false;
+		}
 
-	/* Then cut the whowas sets to new size (groupsize) */
-	for (whowas_users::iterator i = whowas.begin(); i != whowas.end(); )
-	{
-		WhoWas::Nick::List& list = i->second->entries;
-		while (list.size() > this->GroupSize)
+		if (!wrapped)
 		{
-			delete list.front();
-			list.pop_front();
+			if (head + size <= ring.size())
+				break;
+
+			// Not enough room at the end of the buffer, continue at the start.
+			end = head;
+			head = 0;
+			wrapped = true;
 		}
 
-		if (list.empty())
-			PurgeNick(i++);
-		else
-			++i;
+		if (head + size <= tail)
+			break;
+
+		RemoveOldest();
 	}
+
+	const size_t offset = head;
+	head += size;
+	return offset;
 }
 
-/* call maintain once an hour to remove expired nicks */
-void WhoWas::Manager::Maintain()
+void WhoWas::Manager::RemoveOldest()
 {
-	time_t min = ServerInstance->Time() - this->MaxKeep;
-	for (whowas_users::iterator i = whowas.begin(); i != whowas.end(); )
+	Record* rec = GetRecord(tail);
+	if (!rec->dead)
 	{
-		WhoWas::Nick::List& list = i->second->entries;
-		while (!list.empty() && list.front()->signon < min)
+		// The oldest record is always the oldest live record of its nick.
+		NickIndex::iterator it = nicks.find(std::string(rec->GetNick(), rec->nicklen));
+		if (it == nicks.end())
 		{
-			delete list.front();
-			list.pop_front();
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "ERROR: Inconsistency detected in whowas database, please report");
 		}
-
-		if (list.empty())
-			PurgeNick(i++);
-		else
-			++i;
+		else if (--it->second.count == 0)
+		{
+			nicks.erase(it);
+		}
+		entries--;
 	}
-}
 
-WhoWas::Manager::~Manager()
-{
-	for (whowas_users::iterator i = whowas.begin(); i != whowas.end(); ++i)
+	ServerNames::iterator serverit = servernames.find(*rec->server);
+	if (--serverit->second == 0)
+		servernames.erase(serverit);
+
+	tail += rec->size;
+	records--;
+	if ((wrapped) && (tail == end))
 	{
-		WhoWas::Nick* nick = i->second;
-		delete nick;
+		tail = 0;
+		wrapped = false;
 	}
 }
 
-bool WhoWas::Manager::IsEnabled() const
+void WhoWas::Manager::Clear()
 {
-	return ((GroupSize != 0) && (MaxGroups != 0));
+	tail = head = end = 0;
+	wrapped = false;
+	records = entries = 0;
+	nicks.clear();
+	servernames.clear();
 }
 
-void WhoWas::Manager::UpdateConfig(unsigned int NewGroupSize, unsigned int NewMaxGroups, unsigned int NewMaxKeep)
+void WhoWas::Manager::ReadRecord(const Record* rec, Entry& entry)
 {
-	if ((NewGroupSize == GroupSize) && (NewMaxGroups == MaxGroups) && (NewMaxKeep == MaxKeep))
-		return;
-
-	GroupSize = NewGroupSize;
-	MaxGroups = NewMaxGroups;
-	MaxKeep = NewMaxKeep;
-	Prune();
+	entry.host.assign(rec->GetHost(), rec->hostlen);
+	entry.dhost.assign(rec->GetDisplayedHost(), (rec->dhostlen ? rec->dhostlen : rec->hostlen));
+	entry.ident.assign(rec->GetIdent(), rec->identlen);
+	entry.server = *rec->server;
+	entry.real.assign(rec->GetRealName(), rec->reallen);
+	entry.signon = rec->signon;
 }
 
-void WhoWas::Manager::PurgeNick(whowas_users::iterator it)
+/* call maintain once an hour to remove expired entries */
+void WhoWas::Manager::Maintain()
 {
-	WhoWas::Nick* nick = it->second;
-	whowas_fifo.erase(nick);
-	whowas.erase(it);
-	delete nick;
+	// Records are stored in the order they were added so expired ones are all at the tail.
+	time_t min = ServerInstance->Time() - this->MaxKeep;
+	while ((records) && (GetRecord(tail)->addtime < min))
+		RemoveOldest();
 }
 
-void WhoWas::Manager::PurgeNick(WhoWas::Nick* nick)
+bool WhoWas::Manager::IsEnabled() const
 {
-	whowas_users::iterator it = whowas.find(nick->nick);
-	if (it == whowas.end())
-	{
-		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "ERROR: Inconsistency detected in whowas database, please report");
-		return;
-	}
-	PurgeNick(it);
+	return ((GroupSize != 0) && (MaxSize != 0));
 }
 
-WhoWas::Entry::Entry(User* user)
-	: host(user->GetRealHost())
-	, dhost(user->GetDisplayedHost())
-	, ident(user->ident)
-	, server(user->server->GetName())
-	, real(user->GetRealName())
-	, signon(user->signon)
+/* on rehash, rebuild the store according to new conf values */
+void WhoWas::Manager::UpdateConfig(unsigned int NewGroupSize, size_t NewMaxSize, unsigned int NewMaxKeep)
 {
-}
+	NewMaxSize -= NewMaxSize % RecordAlign;
+	if ((NewGroupSize == GroupSize) && (NewMaxSize == MaxSize) && (NewMaxKeep == MaxKeep))
+		return;
 
-WhoWas::Nick::Nick(const std::string& nickname)
-	: addtime(ServerInstance->Time())
-	, nick(nickname)
-{
-}
+	GroupSize = NewGroupSize;
+	MaxSize = NewMaxSize;
+	MaxKeep = NewMaxKeep;
 
-WhoWas::Nick::~Nick()
-{
-	stdalgo::delete_all(entries);
+	// Take the old records (and the server names they point to) out and add them back
+	// oldest first, which applies the new limits.
+	std::vector<char> oldring;
+	oldring.swap(ring);
+	ServerNames oldservers;
+	oldservers.swap(servernames);
+	size_t offset = tail;
+	const size_t oldend = end;
+	const bool oldwrapped = wrapped;
+	size_t count = records;
+	Clear();
+
+	if (!IsEnabled())
+		return;
+
+	ring.resize(MaxSize);
+	time_t min = ServerInstance->Time() - this->MaxKeep;
+	for (; count; --count)
+	{
+		const Record* rec = reinterpret_cast<const Record*>(&oldring[offset]);
+		if ((!rec->dead) && (rec->addtime >= min))
+		{
+			Entry entry;
+			ReadRecord(rec, entry);
+			Store(std::string(rec->GetNick(), rec->nicklen), entry.ident, entry.host, entry.dhost, entry.server, entry.real, entry.signon, rec->addtime);
+		}
+
+		offset += rec->size;
+		if ((oldwrapped) && (offset == oldend))
+			offset = 0;
+	}
 }
 
 class ModuleWhoWas : public Module, public Stats::EventListener
@@ -286,7 +365,11 @@ class ModuleWhoWas : public Module, public Stats::EventListener
 	ModResult OnStats(Stats::Context& stats) CXX11_OVERRIDE
 	{
 		if (stats.GetSymbol() == 'z')
-			stats.AddRow(249, "Whowas entries: "+ConvToStr(cmd.manager.GetStats().entrycount));
+		{
+			WhoWas::Manager::Stats whowasstats = cmd.manager.GetStats();
+			stats.AddRow(249, InspIRCd::Format("Whowas entries: %lu (%lu of %lu bytes used)", (unsigned long)whowasstats.entrycount,
+				(unsigned long)whowasstats.bytesused, (unsigned long)whowasstats.bytesmax));
+		}
 
 		return MOD_RES_PASSTHRU;
 	}
@@ -295,10 +378,24 @@ class ModuleWhoWas : public Module, public Stats::EventListener
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("whowas");
 		unsigned int NewGroupSize = tag->getUInt("groupsize", 10, 0, 10000);
-		unsigned int NewMaxGroups = tag->getUInt("maxgroups", 10240, 0, 1000000);
+		size_t NewMaxSize = tag->getUInt("maxsize", 4 * 1024 * 1024, 0, 1024 * 1024 * 1024);
+		if (!tag->getString("maxgroups").empty())
+		{
+			if (tag->getString("maxsize").empty())
+			{
+				// Keep the limit of old configs, assuming an entry takes 128 bytes on average.
+				const unsigned long maxgroups = tag->getUInt("maxgroups", 100000, 0, 1000000);
+				NewMaxSize = maxgroups * 128;
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "<whowas:maxgroups> is deprecated, using a <whowas:maxsize> of %lu bytes for %lu groups at %s. Set <whowas:maxsize> instead.",
+					(unsigned long)NewMaxSize, maxgroups, tag->getTagLocation().c_str());
+			}
+			else
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "<whowas:maxgroups> is deprecated and ignored as <whowas:maxsize> is set at %s.", tag->getTagLocation().c_str());
+		}
+
 		unsigned int NewMaxKeep = tag->getDuration("maxkeep", 3600, 3600);
 
-		cmd.manager.UpdateConfig(NewGroupSize, NewMaxGroups, NewMaxKeep);
+		cmd.manager.UpdateConfig(NewGroupSize, NewMaxSize, NewMaxKeep);
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
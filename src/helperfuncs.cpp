@@ -112,7 +112,9 @@ void InspIRCd::StripColor(std::string &sentence)
 	/* refactor this completely due to SQUIT bug since the old code would strip last char and replace with \0 --peavey */
 	int seq = 0;
 
-	for (std::string::iterator i = sentence.begin(); i != sentence.end();)
+	// The kept characters are moved down in place so the string is only walked once.
+	std::string::iterator out = sentence.begin();
+	for (std::string::iterator i = sentence.begin(); i != sentence.end(); ++i)
 	{
 		if (*i == 3)
 			seq = 1;
@@ -128,11 +130,10 @@ void InspIRCd::StripColor(std::string &sentence)
 			seq = 0;
 
 		// Strip all control codes too except \001 for CTCP
-		if (seq || ((*i >= 0) && (*i < 32) && (*i != 1)))
-			i = sentence.erase(i);
-		else
-			++i;
+		if (!seq && !((*i >= 0) && (*i < 32) && (*i != 1)))
+			*out++ = *i;
 	}
+	sentence.erase(out, sentence.end());
 }
 
 void InspIRCd::ProcessColors(file_cache& input)
@@ -484,9 +484,15 @@ void StreamSocket::OnEventHandlerWrite()
 		return;
 
 	DoWrite();
+	if (error.empty())
+		OnDataWritten();
 	CheckError(I_ERR_OTHER);
 }
 
+void StreamSocket::OnDataWritten()
+{
+}
+
 void StreamSocket::CheckError(BufferedSocketError errcode)
 {
 	if (!error.empty())
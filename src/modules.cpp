@@ -359,6 +359,11 @@ void ModuleManager::DoSafeUnload(Module* mod)
 	// i.e. before we unregister the services of the module being unloaded
 	FOREACH_MOD(OnUnloadModule, (mod));
 
+	// Replies being generated by the module can't be continued once it is gone
+	const UserManager::LocalList& localusers = ServerInstance->Users->GetLocalUsers();
+	for (UserManager::LocalList::const_iterator i = localusers.begin(); i != localusers.end(); ++i)
+		(*i)->RemoveGenerators(mod);
+
 	std::map<std::string, Module*>::iterator modfind = Modules.find(mod->ModuleSourceFile);
 
 	// Unregister modes before extensions because modes may require their extension to show the mode being unset
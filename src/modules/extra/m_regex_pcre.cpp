@@ -62,6 +62,109 @@ class PCRERegex : public Regex
 	}
 };
 
+/** PCRE can not report which of several alternatives matched so patterns are combined into
+ * a single alternation which rejects text that matches none of them in one pass. Only the
+ * patterns in a set which matched something need to be checked individually.
+ */
+class PCRERegexSet : public RegexSet
+{
+	/** The individual patterns in this set. */
+	std::vector<Regex*> regexes;
+
+	/** Whether each pattern is part of the combined pattern. */
+	std::vector<bool> combinable;
+
+	/** A pattern which matches if any of the combinable patterns match or NULL if there is none. */
+	pcre* combined;
+
+	/** The result of studying the combined pattern. */
+	pcre_extra* extra;
+
+	/** Determines whether a pattern still behaves the same when it is part of a larger pattern.
+	 * Back references and group numbers change, and options and verbs may apply to the whole
+	 * pattern, so patterns using them are always checked individually.
+	 */
+	static bool CanCombine(const std::string& rx)
+	{
+		if (rx.find("(?") != std::string::npos || rx.find("(*") != std::string::npos)
+			return false;
+
+		for (std::string::size_type pos = rx.find('\\'); pos != std::string::npos; pos = rx.find('\\', pos + 2))
+		{
+			if (pos + 1 < rx.length() && (isdigit(rx[pos + 1]) || strchr("gkQE", rx[pos + 1])))
+				return false;
+		}
+		return true;
+	}
+
+ public:
+	PCRERegexSet()
+		: combined(NULL)
+		, extra(NULL)
+	{
+	}
+
+	~PCRERegexSet()
+	{
+		stdalgo::delete_all(regexes);
+		if (extra)
+			pcre_free_study(extra);
+		if (combined)
+			pcre_free(combined);
+	}
+
+	size_t Add(const std::string& rx) CXX11_OVERRIDE
+	{
+		regexes.push_back(new PCRERegex(rx));
+		combinable.push_back(CanCombine(rx));
+		return regexes.size() - 1;
+	}
+
+	void Compile() CXX11_OVERRIDE
+	{
+		std::string alternation;
+		for (size_t i = 0; i < regexes.size(); ++i)
+		{
+			if (!combinable[i])
+				continue;
+
+			if (!alternation.empty())
+				alternation.push_back('|');
+			alternation.append("(?:").append(regexes[i]->GetRegexString()).push_back(')');
+		}
+
+		if (alternation.empty())
+			return;
+
+		const char* error;
+		int erroffset;
+		combined = pcre_compile(alternation.c_str(), 0, &error, &erroffset, NULL);
+		if (!combined)
+		{
+			// Fall back to checking every pattern individually.
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Unable to combine %lu patterns: %s", static_cast<unsigned long>(regexes.size()), error);
+			combinable.assign(combinable.size(), false);
+			return;
+		}
+		extra = pcre_study(combined, 0, &error);
+	}
+
+	bool Matches(const std::string& text, MatchList& matches) CXX11_OVERRIDE
+	{
+		matches.clear();
+		const bool anycombined = combined && (pcre_exec(combined, extra, text.c_str(), text.length(), 0, 0, NULL, 0) >= 0);
+		for (size_t i = 0; i < regexes.size(); ++i)
+		{
+			if (combinable[i] && !anycombined)
+				continue;
+
+			if (regexes[i]->Matches(text))
+				matches.push_back(i);
+		}
+		return !matches.empty();
+	}
+};
+
 class PCREFactory : public RegexFactory
 {
  public:
@@ -70,6 +173,11 @@ class PCREFactory : public RegexFactory
 	{
 		return new PCRERegex(expr);
 	}
+
+	RegexSet* CreateSet() CXX11_OVERRIDE
+	{
+		return new PCRERegexSet;
+	}
 };
 
 class ModuleRegexPCRE : public Module
@@ -38,6 +38,7 @@
 #endif
 
 #include <re2/re2.h>
+#include <re2/set.h>
 
 class RE2Regex : public Regex
 {
@@ -58,6 +59,48 @@ class RE2Regex : public Regex
 	}
 };
 
+class RE2RegexSet : public RegexSet
+{
+	RE2::Set regexset;
+	std::vector<int> results;
+
+	static RE2::Options GetOptions()
+	{
+		RE2::Options options;
+		options.set_log_errors(false);
+		return options;
+	}
+
+ public:
+	RE2RegexSet() : regexset(GetOptions(), RE2::ANCHOR_BOTH) { }
+
+	size_t Add(const std::string& rx) CXX11_OVERRIDE
+	{
+		std::string error;
+		int index = regexset.Add(rx, &error);
+		if (index < 0)
+			throw RegexException(rx, error);
+		return index;
+	}
+
+	void Compile() CXX11_OVERRIDE
+	{
+		if (!regexset.Compile())
+			throw RegexException("", "unable to compile the set of patterns");
+	}
+
+	bool Matches(const std::string& text, MatchList& matches) CXX11_OVERRIDE
+	{
+		matches.clear();
+		if (!regexset.Match(text, &results))
+			return false;
+
+		matches.assign(results.begin(), results.end());
+		std::sort(matches.begin(), matches.end());
+		return true;
+	}
+};
+
 class RE2Factory : public RegexFactory
 {
  public:
@@ -66,6 +109,11 @@ class RE2Factory : public RegexFactory
 	{
 		return new RE2Regex(expr);
 	}
+
+	RegexSet* CreateSet() CXX11_OVERRIDE
+	{
+		return new RE2RegexSet;
+	}
 };
 
 class ModuleRegexRE2 : public Module
@@ -35,6 +35,8 @@
 
 #include "inspircd.h"
 #include "modules/ssl.h"
+#include "modules/stats.h"
+#include "modules/workerpool.h"
 #include <memory>
 
 // Fix warnings about the use of commas at end of enumerator lists on C++03.
@@ -108,8 +110,21 @@ typedef gnutls_connection_end_t inspircd_gnutls_session_init_flags_t;
 #define INSPIRCD_GNUTLS_HAS_CORK
 #endif
 
+#if INSPIRCD_GNUTLS_HAS_VERSION(2, 10, 0)
+#define INSPIRCD_GNUTLS_HAS_SESSION_TICKETS
+#endif
+
+// Since 3.6.4 GnuTLS derives the keys it encrypts tickets with from the master key and
+// rotates them itself, in a way which keeps recently issued tickets valid.
+#if INSPIRCD_GNUTLS_HAS_VERSION(3, 6, 4)
+#define INSPIRCD_GNUTLS_ROTATES_TICKET_KEYS
+#endif
+
 static Module* thismod;
 
+/** Worker threads which server side handshakes are done on, NULL if they are done on the main thread */
+static WorkerPool::Pool* handshakepool = NULL;
+
 class RandGen
 {
  public:
@@ -564,6 +579,170 @@ namespace GnuTLS
 		int ret() const { return retval; }
 	};
 
+	/** Sessions which clients can resume, for servers
+	 */
+	class SessionCache
+	{
+		struct Entry
+		{
+			std::string data;
+			time_t expires;
+		};
+		typedef TR1NS::unordered_map<std::string, Entry> EntryMap;
+
+		EntryMap entries;
+
+		/** Guards the entries as sessions can be stored by handshakes on worker threads
+		 */
+		Mutex lock;
+
+		/** Maximum number of sessions to remember
+		 */
+		const size_t maxsize;
+
+		/** Number of seconds a session can be resumed for
+		 */
+		const unsigned int timeout;
+
+		static int Store(void* ptr, gnutls_datum_t key, gnutls_datum_t data)
+		{
+			SessionCache* cache = static_cast<SessionCache*>(ptr);
+			cache->lock.Lock();
+			if (cache->entries.size() >= cache->maxsize)
+			{
+				cache->Prune();
+				if (cache->entries.size() >= cache->maxsize)
+					cache->entries.erase(cache->entries.begin());
+			}
+
+			Entry& entry = cache->entries[std::string(reinterpret_cast<const char*>(key.data), key.size)];
+			entry.data.assign(reinterpret_cast<const char*>(data.data), data.size);
+			entry.expires = ServerInstance->Time() + cache->timeout;
+			cache->lock.Unlock();
+			return 0;
+		}
+
+		static gnutls_datum_t Retrieve(void* ptr, gnutls_datum_t key)
+		{
+			gnutls_datum_t ret = { NULL, 0 };
+
+			SessionCache* cache = static_cast<SessionCache*>(ptr);
+			cache->lock.Lock();
+			EntryMap::iterator it = cache->entries.find(std::string(reinterpret_cast<const char*>(key.data), key.size));
+			if ((it != cache->entries.end()) && (it->second.expires <= ServerInstance->Time()))
+			{
+				cache->entries.erase(it);
+				it = cache->entries.end();
+			}
+
+			if (it != cache->entries.end())
+			{
+				ret.data = static_cast<unsigned char*>(gnutls_malloc(it->second.data.size()));
+				if (ret.data)
+				{
+					memcpy(ret.data, it->second.data.data(), it->second.data.size());
+					ret.size = it->second.data.size();
+				}
+			}
+			cache->lock.Unlock();
+			return ret;
+		}
+
+		static int Remove(void* ptr, gnutls_datum_t key)
+		{
+			SessionCache* cache = static_cast<SessionCache*>(ptr);
+			cache->lock.Lock();
+			const size_t erased = cache->entries.erase(std::string(reinterpret_cast<const char*>(key.data), key.size));
+			cache->lock.Unlock();
+			return erased ? 0 : -1;
+		}
+
+		void Prune()
+		{
+			for (EntryMap::iterator i = entries.begin(); i != entries.end(); )
+			{
+				if (i->second.expires <= ServerInstance->Time())
+					entries.erase(i++);
+				else
+					++i;
+			}
+		}
+
+	 public:
+		SessionCache(size_t size, unsigned int expiration)
+			: maxsize(size)
+			, timeout(expiration)
+		{
+		}
+
+		void SetupSession(gnutls_session_t sess)
+		{
+			gnutls_db_set_ptr(sess, this);
+			gnutls_db_set_store_function(sess, Store);
+			gnutls_db_set_retrieve_function(sess, Retrieve);
+			gnutls_db_set_remove_function(sess, Remove);
+		}
+	};
+
+#ifdef INSPIRCD_GNUTLS_HAS_SESSION_TICKETS
+	/** Master key for encrypting session tickets
+	 */
+	class TicketKey : public Timer
+	{
+		gnutls_datum_t key;
+
+		/** The key which was replaced last, kept until the next rotation as sessions may still use it
+		 */
+		gnutls_datum_t oldkey;
+
+		static void Free(gnutls_datum_t& datum)
+		{
+			if (!datum.data)
+				return;
+
+			memset(datum.data, 0, datum.size);
+			gnutls_free(datum.data);
+			datum.data = NULL;
+			datum.size = 0;
+		}
+
+	 public:
+		TicketKey(unsigned int rotate)
+			: Timer(rotate, true)
+		{
+			oldkey.data = NULL;
+			oldkey.size = 0;
+			ThrowOnError(gnutls_session_ticket_key_generate(&key), "Unable to generate session ticket key");
+#ifndef INSPIRCD_GNUTLS_ROTATES_TICKET_KEYS
+			ServerInstance->Timers.AddTimer(this);
+#endif
+		}
+
+		~TicketKey()
+		{
+			Free(key);
+			Free(oldkey);
+		}
+
+		bool Tick(time_t) CXX11_OVERRIDE
+		{
+			gnutls_datum_t newkey;
+			if (gnutls_session_ticket_key_generate(&newkey) < 0)
+				return true;
+
+			Free(oldkey);
+			oldkey = key;
+			key = newkey;
+			return true;
+		}
+
+		void SetupSession(gnutls_session_t sess)
+		{
+			gnutls_session_ticket_enable_server(sess, &key);
+		}
+	};
+#endif
+
 	class Profile
 	{
 		/** Name of this profile
@@ -594,6 +773,25 @@ namespace GnuTLS
 		 */
 		const bool requestclientcert;
 
+		/** Number of seconds a session can be resumed for
+		 */
+		const unsigned int sessiontimeout;
+
+		/** Sessions which can be resumed, NULL if the session cache is disabled
+		 */
+		std::auto_ptr<SessionCache> sessioncache;
+
+#ifdef INSPIRCD_GNUTLS_HAS_SESSION_TICKETS
+		/** Key for encrypting session tickets, NULL if tickets are disabled
+		 */
+		std::auto_ptr<TicketKey> ticketkey;
+#endif
+
+		/** Number of handshakes completed and how many of them resumed an earlier session
+		 */
+		unsigned long handshakes;
+		unsigned long resumed;
+
 		static std::string ReadFile(const std::string& filename)
 		{
 			FileReader reader(filename);
@@ -647,6 +845,12 @@ namespace GnuTLS
 			unsigned int outrecsize;
 			bool requestclientcert;
 
+			bool sessioncache;
+			unsigned int sessioncachesize;
+			unsigned int sessiontimeout;
+			bool tickets;
+			unsigned int ticketrotate;
+
 			Config(const std::string& profilename, ConfigTag* tag)
 				: name(profilename)
 				, certstr(ReadFile(tag->getString("certfile", "cert.pem")))
@@ -656,6 +860,11 @@ namespace GnuTLS
 				, mindh(tag->getUInt("mindhbits", 1024))
 				, hashstr(tag->getString("hash", "md5"))
 				, requestclientcert(tag->getBool("requestclientcert", true))
+				, sessioncache(tag->getBool("sessioncache", true))
+				, sessioncachesize(tag->getUInt("sessioncachesize", 20480, 1))
+				, sessiontimeout(tag->getDuration("sessiontimeout", 3600, 1))
+				, tickets(tag->getBool("tickets", true))
+				, ticketrotate(tag->getDuration("ticketrotate", sessiontimeout, 60))
 			{
 				// Load trusted CA and revocation list, if set
 				std::string filename = tag->getString("cafile");
@@ -685,14 +894,27 @@ namespace GnuTLS
 			, priority(config.priostr)
 			, outrecsize(config.outrecsize)
 			, requestclientcert(config.requestclientcert)
+			, sessiontimeout(config.sessiontimeout)
+			, handshakes(0)
+			, resumed(0)
 		{
 			x509cred.SetDH(config.dh);
 			x509cred.SetCA(config.ca, config.crl);
+
+			// Let reconnecting clients skip the full handshake.
+			if (config.sessioncache)
+				sessioncache.reset(new SessionCache(config.sessioncachesize, config.sessiontimeout));
+#ifdef INSPIRCD_GNUTLS_HAS_SESSION_TICKETS
+			if (config.tickets)
+				ticketkey.reset(new TicketKey(config.ticketrotate));
+#endif
 		}
 		/** Set up the given session with the settings in this profile
 		 */
-		void SetupSession(gnutls_session_t sess)
+		void SetupSession(gnutls_session_t sess, bool server)
 		{
+			// Used by X509Credentials::cert_callback() which can run on a worker thread.
+			gnutls_session_set_ptr(sess, this);
 			priority.SetupSession(sess);
 			x509cred.SetupSession(sess);
 			gnutls_dh_set_prime_bits(sess, min_dh_bits);
@@ -700,15 +922,114 @@ namespace GnuTLS
 			// Request client certificate if enabled and we are a server, no-op if we're a client
 			if (requestclientcert)
 				gnutls_certificate_server_set_request(sess, GNUTLS_CERT_REQUEST);
+
+			if (!server)
+				return;
+
+			gnutls_db_set_cache_expiration(sess, sessiontimeout);
+			if (sessioncache.get())
+				sessioncache->SetupSession(sess);
+#ifdef INSPIRCD_GNUTLS_HAS_SESSION_TICKETS
+			if (ticketkey.get())
+				ticketkey->SetupSession(sess);
+#endif
+		}
+
+		void OnHandshake(bool sessionresumed)
+		{
+			handshakes++;
+			if (sessionresumed)
+				resumed++;
 		}
 
 		const std::string& GetName() const { return name; }
 		X509Credentials& GetX509Credentials() { return x509cred; }
 		gnutls_digest_algorithm_t GetHash() const { return hash.get(); }
 		unsigned int GetOutgoingRecordSize() const { return outrecsize; }
+		unsigned long GetHandshakes() const { return handshakes; }
+		unsigned long GetResumed() const { return resumed; }
 	};
 }
 
+class GnuTLSIOHook;
+
+/** Runs a step of a server side handshake on a worker thread
+ */
+class GnuTLSHandshakeJob : public WorkerPool::Job
+{
+	static ssize_t Pull(gnutls_transport_ptr_t transportptr, void* buffer, size_t size)
+	{
+		GnuTLSHandshakeJob* job = reinterpret_cast<GnuTLSHandshakeJob*>(transportptr);
+		if (job->inputpos >= job->input.length())
+		{
+			gnutls_transport_set_errno(job->sess, EAGAIN);
+			return -1;
+		}
+
+		size = std::min(size, job->input.length() - job->inputpos);
+		memcpy(buffer, job->input.data() + job->inputpos, size);
+		job->inputpos += size;
+		return size;
+	}
+
+	static ssize_t Push(gnutls_transport_ptr_t transportptr, const void* buffer, size_t size)
+	{
+		GnuTLSHandshakeJob* job = reinterpret_cast<GnuTLSHandshakeJob*>(transportptr);
+		job->output.append(static_cast<const char*>(buffer), size);
+		return size;
+	}
+
+ public:
+	/** The hook which started this step, NULL if it has closed since
+	 */
+	GnuTLSIOHook* hook;
+
+	/** Keeps the profile of the session alive while the step runs
+	 */
+	reference<IOHookProvider> prov;
+
+	/** Session to advance, owned by this job if hook is NULL
+	 */
+	const gnutls_session_t sess;
+
+	/** Data received from the client and how much of it GnuTLS has read
+	 */
+	std::string input;
+	size_t inputpos;
+
+	/** Data to send to the client
+	 */
+	std::string output;
+
+	/** Result of gnutls_handshake()
+	 */
+	int result;
+
+	GnuTLSHandshakeJob(GnuTLSIOHook* iohook, IOHookProvider* hookprov, gnutls_session_t session)
+		: hook(iohook)
+		, prov(hookprov)
+		, sess(session)
+		, inputpos(0)
+		, result(GNUTLS_E_AGAIN)
+	{
+		// GnuTLS must not touch the socket from another thread, it talks to this job instead.
+		gnutls_transport_set_ptr(sess, reinterpret_cast<gnutls_transport_ptr_t>(this));
+		gnutls_transport_set_push_function(sess, Push);
+		gnutls_transport_set_pull_function(sess, Pull);
+	}
+
+	void Run() CXX11_OVERRIDE
+	{
+		do
+		{
+			result = gnutls_handshake(sess);
+		}
+		while (result == GNUTLS_E_INTERRUPTED);
+	}
+
+	void Finish() CXX11_OVERRIDE;
+};
+
 class GnuTLSIOHook : public SSLIOHook
 {
  private:
@@ -718,9 +1039,40 @@ class GnuTLSIOHook : public SSLIOHook
 	size_t gbuffersize;
 #endif
 
+	/** The socket this hook is attached to
+	 */
+	StreamSocket* const sock;
+
+	/** True if the handshake is done by GnuTLSHandshakeJob on a worker thread
+	 * and has not completed yet
+	 */
+	bool offloaded;
+
+	/** The handshake step which is running on a worker thread, if any
+	 */
+	GnuTLSHandshakeJob* job;
+
+	/** Handshake data which could not be sent to the client yet
+	 */
+	std::string handshakeout;
+
+	/** Data which was received during a handshake done on a worker thread but not read by GnuTLS
+	 */
+	std::string leftover;
+
+	/** Why a handshake done on a worker thread failed, reported by the next read
+	 */
+	std::string handshakeerror;
+
 	void CloseSession()
 	{
-		if (this->sess)
+		if (job)
+		{
+			// The session is in use on a worker thread, the job frees it when it finishes.
+			job->hook = NULL;
+			job = NULL;
+		}
+		else if (this->sess)
 		{
 			gnutls_bye(this->sess, GNUTLS_SHUT_WR);
 			gnutls_deinit(this->sess);
@@ -766,6 +1118,7 @@ class GnuTLSIOHook : public SSLIOHook
 		{
 			// Change the seesion state
 			this->status = ISSL_HANDSHAKEN;
+			GetProfile().OnHandshake(gnutls_session_is_resumed(this->sess));
 
 			VerifyCertificate();
 
@@ -880,33 +1233,119 @@ info_done_dealloc:
 		gnutls_x509_crt_deinit(cert);
 	}
 
+	/** Read handshake data from the client and give it to a worker thread
+	 * @return 0 if the handshake is in progress, -1 if it failed
+	 */
+	int ReadHandshake()
+	{
+		if (job)
+			return 0;
+
+		char* buffer = ServerInstance->GetReadBuffer();
+		const int ret = SocketEngine::Recv(sock, buffer, ServerInstance->Config->NetBufferSize, 0);
+		if (ret == 0)
+		{
+			sock->SetError("Connection closed");
+			CloseSession();
+			return -1;
+		}
+		else if (ret < 0)
+		{
+			if (SocketEngine::IgnoreError())
+				return 0;
+
+			sock->SetError(SocketEngine::LastError());
+			CloseSession();
+			return -1;
+		}
+
+		job = new GnuTLSHandshakeJob(this, prov, sess);
+		job->input.assign(buffer, ret);
+
+		// Stop reading until the job is done, the data which arrives in the meantime
+		// is picked up by the trial read added by OnHandshakeJobDone().
+		SocketEngine::ChangeEventMask(sock, FD_WANT_NO_READ);
+
+		if (handshakepool)
+		{
+			handshakepool->Submit(job);
+		}
+		else
+		{
+			// The pool was disabled by a rehash after this hook was created.
+			GnuTLSHandshakeJob* const localjob = job;
+			localjob->Run();
+			localjob->Finish();
+			delete localjob;
+		}
+		return 0;
+	}
+
+	/** Send handshake data which was produced on a worker thread to the client
+	 * @return 1 if all of it was sent, 0 if the socket blocked, -1 on error
+	 */
+	int FlushHandshake()
+	{
+		while (!handshakeout.empty())
+		{
+			const int ret = SocketEngine::Send(sock, handshakeout.data(), handshakeout.length(), 0);
+			if (ret > 0)
+			{
+				handshakeout.erase(0, ret);
+			}
+			else if ((ret < 0) && (SocketEngine::IgnoreError()))
+			{
+				SocketEngine::ChangeEventMask(sock, FD_WANT_SINGLE_WRITE);
+				return 0;
+			}
+			else
+			{
+				return -1;
+			}
+		}
+		return 1;
+	}
+
+	/** Make GnuTLS read from and write to the socket
+	 */
+	void SetSocketTransport()
+	{
+		gnutls_transport_set_ptr(sess, reinterpret_cast<gnutls_transport_ptr_t>(sock));
+#ifdef INSPIRCD_GNUTLS_HAS_VECTOR_PUSH
+		gnutls_transport_set_vec_push_function(sess, VectorPush);
+#else
+		gnutls_transport_set_push_function(sess, gnutls_push_wrapper);
+#endif
+		gnutls_transport_set_pull_function(sess, gnutls_pull_wrapper);
+	}
+
 	// Returns 1 if application I/O should proceed, 0 if it must wait for the underlying protocol to progress, -1 on fatal error
-	int PrepareIO(StreamSocket* sock)
+	int PrepareIO(StreamSocket* user)
 	{
 		if (status == ISSL_HANDSHAKEN)
 			return 1;
 		else if (status == ISSL_HANDSHAKING)
 		{
 			// The handshake isn't finished, try to finish it
-			return Handshake(sock);
+			return Handshake(user);
 		}
 
 		CloseSession();
-		sock->SetError("No SSL session");
+		user->SetError("No SSL session");
 		return -1;
 	}
 
 #ifdef INSPIRCD_GNUTLS_HAS_CORK
-	int FlushBuffer(StreamSocket* sock)
+	int FlushBuffer(StreamSocket* user)
 	{
 		// If GnuTLS has some data buffered, write it
 		if (gbuffersize)
-			return HandleWriteRet(sock, gnutls_record_uncork(this->sess, 0));
+			return HandleWriteRet(user, gnutls_record_uncork(this->sess, 0));
 		return 1;
 	}
 #endif
 
-	int HandleWriteRet(StreamSocket* sock, int ret)
+	int HandleWriteRet(StreamSocket* user, int ret)
 	{
 		if (ret > 0)
 		{
@@ -914,7 +1353,7 @@ info_done_dealloc:
 			gbuffersize -= ret;
 			if (gbuffersize)
 			{
-				SocketEngine::ChangeEventMask(sock, FD_WANT_SINGLE_WRITE);
+				SocketEngine::ChangeEventMask(user, FD_WANT_SINGLE_WRITE);
 				return 0;
 			}
 #endif
@@ -922,12 +1361,12 @@ info_done_dealloc:
 		}
 		else if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED || ret == 0)
 		{
-			SocketEngine::ChangeEventMask(sock, FD_WANT_SINGLE_WRITE);
+			SocketEngine::ChangeEventMask(user, FD_WANT_SINGLE_WRITE);
 			return 0;
 		}
 		else // (ret < 0)
 		{
-			sock->SetError(gnutls_strerror(ret));
+			user->SetError(gnutls_strerror(ret));
 			CloseSession();
 			return -1;
 		}
@@ -1047,27 +1486,99 @@ info_done_dealloc:
 	}
 #endif // INSPIRCD_GNUTLS_HAS_VECTOR_PUSH
 
+	/** Gives GnuTLS the data which was left over from a handshake done on a worker thread,
+	 * then switches to reading from the socket
+	 */
+	static ssize_t LeftoverPull(gnutls_transport_ptr_t transportptr, void* buffer, size_t size)
+	{
+		GnuTLSIOHook* hook = reinterpret_cast<GnuTLSIOHook*>(transportptr);
+		if (hook->leftover.empty())
+		{
+			hook->SetSocketTransport();
+			return gnutls_pull_wrapper(reinterpret_cast<gnutls_transport_ptr_t>(hook->sock), buffer, size);
+		}
+
+		size = std::min(size, hook->leftover.length());
+		memcpy(buffer, hook->leftover.data(), size);
+		hook->leftover.erase(0, size);
+		return size;
+	}
+
  public:
-	GnuTLSIOHook(IOHookProvider* hookprov, StreamSocket* sock, inspircd_gnutls_session_init_flags_t flags)
+	/** Create a new hook
+	 * @param hookprov Provider of the hook
+	 * @param socket Socket to attach the hook to
+	 * @param flags Flags to pass to gnutls_init()
+	 * @param offload True to do the handshake on the worker threads in handshakepool, only for servers
+	 */
+	GnuTLSIOHook(IOHookProvider* hookprov, StreamSocket* socket, inspircd_gnutls_session_init_flags_t flags, bool offload)
 		: SSLIOHook(hookprov)
 		, sess(NULL)
 		, status(ISSL_NONE)
 #ifdef INSPIRCD_GNUTLS_HAS_CORK
 		, gbuffersize(0)
 #endif
+		, sock(socket)
+		, offloaded(offload)
+		, job(NULL)
 	{
 		gnutls_init(&sess, flags);
-		gnutls_transport_set_ptr(sess, reinterpret_cast<gnutls_transport_ptr_t>(sock));
-#ifdef INSPIRCD_GNUTLS_HAS_VECTOR_PUSH
-		gnutls_transport_set_vec_push_function(sess, VectorPush);
-#else
-		gnutls_transport_set_push_function(sess, gnutls_push_wrapper);
-#endif
-		gnutls_transport_set_pull_function(sess, gnutls_pull_wrapper);
-		GetProfile().SetupSession(sess);
+		SetSocketTransport();
+		GetProfile().SetupSession(sess, (flags & GNUTLS_SERVER));
 
 		sock->AddIOHook(this);
-		Handshake(sock);
+		if (offloaded)
+		{
+			status = ISSL_HANDSHAKING;
+			SocketEngine::ChangeEventMask(sock, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
+		}
+		else
+		{
+			Handshake(sock);
+		}
+	}
+
+	/** Called on the main thread when a handshake step run by a worker thread is done
+	 * @param done The job which ran the step
+	 */
+	void OnHandshakeJobDone(GnuTLSHandshakeJob* done)
+	{
+		job = NULL;
+
+		handshakeout.append(done->output);
+		if (FlushHandshake() < 0)
+			handshakeerror = SocketEngine::LastError();
+		else if ((done->result < 0) && (done->result != GNUTLS_E_AGAIN))
+			handshakeerror = "Handshake Failed - " + std::string(gnutls_strerror(done->result));
+
+		if (!handshakeerror.empty())
+		{
+			// The socket can't be told about the error from here, the trial read makes
+			// OnStreamSocketRead() report it.
+			CloseSession();
+			SocketEngine::ChangeEventMask(sock, FD_WANT_POLL_READ | FD_ADD_TRIAL_READ);
+			return;
+		}
+
+		if (done->result == GNUTLS_E_SUCCESS)
+		{
+			offloaded = false;
+			status = ISSL_HANDSHAKEN;
+			GetProfile().OnHandshake(gnutls_session_is_resumed(sess));
+			VerifyCertificate();
+
+			// The client may have sent application data along with the end of its handshake.
+			SetSocketTransport();
+			leftover.assign(done->input, done->inputpos, std::string::npos);
+			if (!leftover.empty())
+			{
+				gnutls_transport_set_ptr2(sess, reinterpret_cast<gnutls_transport_ptr_t>(this), reinterpret_cast<gnutls_transport_ptr_t>(sock));
+				gnutls_transport_set_pull_function(sess, LeftoverPull);
+			}
+		}
+
+		// Read data which arrived while the job was running.
+		SocketEngine::ChangeEventMask(sock, FD_WANT_POLL_READ | FD_ADD_TRIAL_READ);
 	}
 
 	void OnStreamSocketClose(StreamSocket* user) CXX11_OVERRIDE
@@ -1077,6 +1588,14 @@ info_done_dealloc:
 
 	int OnStreamSocketRead(StreamSocket* user, std::string& recvq) CXX11_OVERRIDE
 	{
+		if (!handshakeerror.empty())
+		{
+			user->SetError(handshakeerror);
+			return -1;
+		}
+		if ((offloaded) && (status == ISSL_HANDSHAKING))
+			return ReadHandshake();
+
 		// Finish handshake if needed
 		int prepret = PrepareIO(user);
 		if (prepret <= 0)
@@ -1089,8 +1608,8 @@ info_done_dealloc:
 			if (ret > 0)
 			{
 				reader.appendto(recvq);
-				// Schedule a read if there is still data in the GnuTLS buffer
-				if (gnutls_record_check_pending(sess) > 0)
+				// Schedule a read if there is still data in the GnuTLS buffer or left over from the handshake
+				if ((gnutls_record_check_pending(sess) > 0) || (!leftover.empty()))
 					SocketEngine::ChangeEventMask(user, FD_ADD_TRIAL_READ);
 				return 1;
 			}
@@ -1115,6 +1634,16 @@ info_done_dealloc:
 
 	int OnStreamSocketWrite(StreamSocket* user, StreamSocket::SendQueue& sendq) CXX11_OVERRIDE
 	{
+		// Send what is left of a handshake done on a worker thread before anything else
+		if (!handshakeout.empty())
+		{
+			int flushret = FlushHandshake();
+			if (flushret <= 0)
+				return flushret;
+		}
+		if ((offloaded) && (status == ISSL_HANDSHAKING))
+			return 0;
+
 		// Finish handshake if needed
 		int prepret = PrepareIO(user);
 		if (prepret <= 0)
@@ -1209,6 +1738,18 @@ info_done_dealloc:
 	bool IsHandshakeDone() const { return (status == ISSL_HANDSHAKEN); }
 };
 
+void GnuTLSHandshakeJob::Finish()
+{
+	if (hook)
+	{
+		hook->OnHandshakeJobDone(this);
+	}
+	else
+	{
+		gnutls_deinit(sess);
+	}
+}
+
 int GnuTLS::X509Credentials::cert_callback(gnutls_session_t sess, const gnutls_datum_t* req_ca_rdn, int nreqs, const gnutls_pk_algorithm_t* sign_algos, int sign_algos_length, cert_cb_last_param_type* st)
 {
 #ifndef GNUTLS_NEW_CERT_CALLBACK_API
@@ -1217,8 +1758,7 @@ int GnuTLS::X509Credentials::cert_callback(gnutls_session_t sess, const gnutls_d
 	st->cert_type = GNUTLS_CRT_X509;
 	st->key_type = GNUTLS_PRIVKEY_X509;
 #endif
-	StreamSocket* sock = reinterpret_cast<StreamSocket*>(gnutls_transport_get_ptr(sess));
-	GnuTLS::X509Credentials& cred = static_cast<GnuTLSIOHook*>(sock->GetModHook(thismod))->GetProfile().GetX509Credentials();
+	GnuTLS::X509Credentials& cred = static_cast<GnuTLS::Profile*>(gnutls_session_get_ptr(sess))->GetX509Credentials();
 
 	st->ncerts = cred.certs.size();
 	st->cert.x509 = cred.certs.raw();
@@ -1247,12 +1787,12 @@ class GnuTLSIOHookProvider : public IOHookProvider
 
 	void OnAccept(StreamSocket* sock, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server) CXX11_OVERRIDE
 	{
-		new GnuTLSIOHook(this, sock, GNUTLS_SERVER);
+		new GnuTLSIOHook(this, sock, GNUTLS_SERVER, handshakepool != NULL);
 	}
 
 	void OnConnect(StreamSocket* sock) CXX11_OVERRIDE
 	{
-		new GnuTLSIOHook(this, sock, GNUTLS_CLIENT);
+		new GnuTLSIOHook(this, sock, GNUTLS_CLIENT, false);
 	}
 
 	GnuTLS::Profile& GetProfile() { return profile; }
@@ -1264,7 +1804,7 @@ GnuTLS::Profile& GnuTLSIOHook::GetProfile()
 	return static_cast<GnuTLSIOHookProvider*>(hookprov)->GetProfile();
 }
 
-class ModuleSSLGnuTLS : public Module
+class ModuleSSLGnuTLS : public Module, public Stats::EventListener
 {
 	typedef std::vector<reference<GnuTLSIOHookProvider> > ProfileList;
 
@@ -1311,33 +1851,64 @@ class ModuleSSLGnuTLS : public Module
 				continue;
 			}
 
-			reference<GnuTLSIOHookProvider> prov;
+			reference<GnuTLSIOHookProvider> profile;
 			try
 			{
 				GnuTLS::Profile::Config profileconfig(name, tag);
-				prov = new GnuTLSIOHookProvider(this, profileconfig);
+				profile = new GnuTLSIOHookProvider(this, profileconfig);
 			}
 			catch (CoreException& ex)
 			{
 				throw ModuleException("Error while initializing SSL profile \"" + name + "\" at " + tag->getTagLocation() + " - " + ex.GetReason());
 			}
 
-			newprofiles.push_back(prov);
+			newprofiles.push_back(profile);
 		}
 
 		// New profiles are ok, begin using them
 		// Old profiles are deleted when their refcount drops to zero
 		for (ProfileList::iterator i = profiles.begin(); i != profiles.end(); ++i)
 		{
-			GnuTLSIOHookProvider& prov = **i;
-			ServerInstance->Modules.DelService(prov);
+			GnuTLSIOHookProvider& oldprofile = **i;
+			ServerInstance->Modules.DelService(oldprofile);
 		}
 
 		profiles.swap(newprofiles);
 	}
 
+	void ReadHandshakeThreads()
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("gnutls");
+		const unsigned int threads = tag->getUInt("handshakethreads", 0, 0, 256);
+		const size_t oldthreads = handshakepool ? handshakepool->GetSize() : 0;
+		if (threads == oldthreads)
+			return;
+
+		// Jobs which are still running are finished by the old pool before it is deleted.
+		WorkerPool::Pool* oldpool = handshakepool;
+		handshakepool = NULL;
+		delete oldpool;
+
+		if (!threads)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Doing handshakes on the main thread");
+			return;
+		}
+
+		try
+		{
+			handshakepool = new WorkerPool::Pool(threads);
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Doing server side handshakes on %u worker threads", threads);
+		}
+		catch (CoreException& ex)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to start handshake threads, doing handshakes on the main thread: %s", ex.GetReason().c_str());
+		}
+	}
+
  public:
 	ModuleSSLGnuTLS()
+		: Stats::EventListener(this)
 	{
 #ifndef GNUTLS_HAS_RND
 		gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
@@ -1349,6 +1920,7 @@ class ModuleSSLGnuTLS : public Module
 	{
 		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "GnuTLS lib version %s module was compiled for " GNUTLS_VERSION, gnutls_check_version(NULL));
 		ReadProfiles();
+		ReadHandshakeThreads();
 		ServerInstance->GenRandom = RandGen::Call;
 	}
 
@@ -1365,10 +1937,13 @@ class ModuleSSLGnuTLS : public Module
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, ex.GetReason() + " Not applying settings.");
 		}
+		ReadHandshakeThreads();
 	}
 
 	~ModuleSSLGnuTLS()
 	{
+		delete handshakepool;
+		handshakepool = NULL;
 		ServerInstance->GenRandom = &InspIRCd::DefaultGenRandom;
 	}
 
@@ -1392,6 +1967,22 @@ class ModuleSSLGnuTLS : public Module
 		return Version("Provides SSL support for clients", VF_VENDOR);
 	}
 
+	ModResult OnStats(Stats::Context& stats) CXX11_OVERRIDE
+	{
+		if (stats.GetSymbol() != 'r')
+			return MOD_RES_PASSTHRU;
+
+		for (ProfileList::const_iterator i = profiles.begin(); i != profiles.end(); ++i)
+		{
+			const GnuTLS::Profile& profile = (*i)->GetProfile();
+			const unsigned long handshakes = profile.GetHandshakes();
+			const unsigned long percent = handshakes ? profile.GetResumed() * 100 / handshakes : 0;
+			stats.AddRow(304, "SSLSTATS Profile \"" + profile.GetName() + "\" (gnutls) completed " + ConvToStr(handshakes) +
+				" handshakes of which " + ConvToStr(profile.GetResumed()) + " (" + ConvToStr(percent) + "%) resumed a session");
+		}
+		return MOD_RES_PASSTHRU;
+	}
+
 	ModResult OnCheckReady(LocalUser* user) CXX11_OVERRIDE
 	{
 		const GnuTLSIOHook* const iohook = static_cast<GnuTLSIOHook*>(user->eh.GetModHook(this));
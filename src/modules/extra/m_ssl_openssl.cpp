@@ -33,6 +33,8 @@
 #include "inspircd.h"
 #include "iohook.h"
 #include "modules/ssl.h"
+#include "modules/stats.h"
+#include "modules/workerpool.h"
 
 // Ignore OpenSSL deprecation warnings on OS X Lion and newer.
 #if defined __APPLE__
@@ -49,6 +51,7 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/dh.h>
+#include <openssl/rand.h>
 
 #ifdef _WIN32
 # pragma comment(lib, "ssleay32.lib")
@@ -76,13 +79,32 @@
 
 #else
 # define INSPIRCD_OPENSSL_OPAQUE_BIO
+// Handshakes on worker threads need SSL_set0_rbio() and SSL_set0_wbio() from OpenSSL 1.1.
+# define INSPIRCD_OPENSSL_HANDSHAKE_THREADS
+#endif
+
+// Kernel TLS is supported by OpenSSL 3.0 and newer on Linux if it was not disabled at build time.
+#if defined __linux__ && defined SSL_OP_ENABLE_KTLS && !defined OPENSSL_NO_KTLS
+# define INSPIRCD_OPENSSL_KTLS
+#endif
+
+// OpenSSL 3.0 deprecated the HMAC_CTX based session ticket key callback.
+#if !(defined LIBRESSL_VERSION_NUMBER) && (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+# include <openssl/core_names.h>
+# define INSPIRCD_OPENSSL_TICKET_EVP_MAC
+typedef EVP_MAC_CTX TicketMACContext;
+#else
+# include <openssl/hmac.h>
+typedef HMAC_CTX TicketMACContext;
 #endif
 
 enum issl_status { ISSL_NONE, ISSL_HANDSHAKING, ISSL_OPEN };
 
-static bool SelfSigned = false;
 static int exdataindex;
 
+/** Worker threads which server side handshakes are done on, NULL if they are done on the main thread */
+static WorkerPool::Pool* handshakepool = NULL;
+
 char* get_error()
 {
 	return ERR_error_string(ERR_get_error(), NULL);
@@ -90,6 +112,7 @@ char* get_error()
 
 static int OnVerify(int preverify_ok, X509_STORE_CTX* ctx);
 static void StaticSSLInfoCallback(const SSL* ssl, int where, int rc);
+static int StaticTicketKeyCallback(SSL* ssl, unsigned char* keyname, unsigned char* iv, EVP_CIPHER_CTX* cipherctx, TicketMACContext* macctx, int enc);
 
 namespace OpenSSL
 {
@@ -129,6 +152,119 @@ namespace OpenSSL
 		}
 	};
 
+	/** Keys used to encrypt session tickets, replaced periodically.
+	 * Tickets encrypted with the previous key are still accepted and renewed.
+	 */
+	class TicketKeys : public Timer
+	{
+		struct Key
+		{
+			unsigned char name[16];
+			unsigned char aeskey[32];
+			unsigned char hmackey[32];
+		};
+
+		/** Key used to encrypt new tickets
+		 */
+		Key current;
+
+		/** Key which was replaced by current, valid if haveprevious is true
+		 */
+		Key previous;
+		bool haveprevious;
+
+		/** Guards the keys as tickets can be used by handshakes on worker threads
+		 */
+		Mutex lock;
+
+		static void Generate(Key& key)
+		{
+			if (RAND_bytes(reinterpret_cast<unsigned char*>(&key), sizeof(key)) != 1)
+				throw Exception("Unable to generate session ticket key");
+		}
+
+		static bool InitMAC(TicketMACContext* macctx, unsigned char* hmackey)
+		{
+#ifdef INSPIRCD_OPENSSL_TICKET_EVP_MAC
+			char digest[] = "SHA256";
+			OSSL_PARAM params[3];
+			params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, hmackey, 32);
+			params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0);
+			params[2] = OSSL_PARAM_construct_end();
+			return EVP_MAC_CTX_set_params(macctx, params) == 1;
+#else
+			return HMAC_Init_ex(macctx, hmackey, 32, EVP_sha256(), NULL) == 1;
+#endif
+		}
+
+	 public:
+		TicketKeys(unsigned int rotate)
+			: Timer(rotate, true)
+			, haveprevious(false)
+		{
+			Generate(current);
+			ServerInstance->Timers.AddTimer(this);
+		}
+
+		bool Tick(time_t) CXX11_OVERRIDE
+		{
+			lock.Lock();
+			previous = current;
+			haveprevious = true;
+			try
+			{
+				Generate(current);
+			}
+			catch (Exception& ex)
+			{
+				// Keep using the old key rather than stopping resumption.
+				current = previous;
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, ex.GetReason());
+			}
+			lock.Unlock();
+			return true;
+		}
+
+		/** Set up the cipher and MAC contexts for encrypting or decrypting a ticket
+		 * @return -1 on error, 0 if the ticket was encrypted with an unknown key, 1 if the ticket
+		 * is usable and 2 if it is usable but was encrypted with an old key and should be renewed.
+		 */
+		int Setup(unsigned char* keyname, unsigned char* iv, EVP_CIPHER_CTX* cipherctx, TicketMACContext* macctx, int enc)
+		{
+			lock.Lock();
+			const int ret = SetupLocked(keyname, iv, cipherctx, macctx, enc);
+			lock.Unlock();
+			return ret;
+		}
+
+	 private:
+		int SetupLocked(unsigned char* keyname, unsigned char* iv, EVP_CIPHER_CTX* cipherctx, TicketMACContext* macctx, int enc)
+		{
+			if (enc)
+			{
+				memcpy(keyname, current.name, sizeof(current.name));
+				if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+					return -1;
+
+				if (!EVP_EncryptInit_ex(cipherctx, EVP_aes_256_cbc(), NULL, current.aeskey, iv) || !InitMAC(macctx, current.hmackey))
+					return -1;
+				return 1;
+			}
+
+			Key* key;
+			if (!memcmp(keyname, current.name, sizeof(current.name)))
+				key = &current;
+			else if (haveprevious && !memcmp(keyname, previous.name, sizeof(previous.name)))
+				key = &previous;
+			else
+				return 0;
+
+			if (!EVP_DecryptInit_ex(cipherctx, EVP_aes_256_cbc(), NULL, key->aeskey, iv) || !InitMAC(macctx, key->hmackey))
+				return -1;
+			return (key == &current ? 1 : 2);
+		}
+	};
+
 	class Context
 	{
 		SSL_CTX* const ctx;
@@ -166,6 +302,42 @@ namespace OpenSSL
 			SSL_CTX_free(ctx);
 		}
 
+		/** Set the options shared by cached sessions and session tickets
+		 * @param sessionid Identifies sessions which belong to this context
+		 * @param timeout Number of seconds a session can be resumed for
+		 */
+		void SetSessionOptions(const std::string& sessionid, long timeout)
+		{
+			SSL_CTX_set_timeout(ctx, timeout);
+			SSL_CTX_set_session_id_context(ctx, reinterpret_cast<const unsigned char*>(sessionid.data()), std::min<size_t>(sessionid.length(), SSL_MAX_SID_CTX_LENGTH));
+		}
+
+		/** Remember sessions so that returning clients can resume them
+		 * @param size Maximum number of sessions to remember
+		 */
+		void EnableSessionCache(long size)
+		{
+			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+			SSL_CTX_sess_set_cache_size(ctx, size);
+		}
+
+		/** Allow clients to resume sessions using tickets encrypted with keys from StaticTicketKeyCallback()
+		 * @param keys Keys to encrypt tickets with, must outlive this context
+		 */
+		void EnableTickets(TicketKeys* keys)
+		{
+			SSL_CTX_set_app_data(ctx, keys);
+#ifdef SSL_OP_NO_TICKET
+			ctx_options &= ~SSL_OP_NO_TICKET;
+			SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+#endif
+#ifdef INSPIRCD_OPENSSL_TICKET_EVP_MAC
+			SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, StaticTicketKeyCallback);
+#else
+			SSL_CTX_set_tlsext_ticket_key_cb(ctx, StaticTicketKeyCallback);
+#endif
+		}
+
 		bool SetDH(DHParams& dh)
 		{
 			ERR_clear_error();
@@ -316,10 +488,23 @@ namespace OpenSSL
 		 */
 		const bool allowrenego;
 
+		/** True if the kernel should take over encryption once handshakes complete
+		 */
+		bool kerneltls;
+
 		/** Rough max size of records to send
 		 */
 		const unsigned int outrecsize;
 
+		/** Keys for encrypting session tickets, NULL if tickets are disabled
+		 */
+		TicketKeys* ticketkeys;
+
+		/** Number of handshakes completed and how many of them resumed an earlier session
+		 */
+		unsigned long handshakes;
+		unsigned long resumed;
+
 		static int error_callback(const char* str, size_t len, void* u)
 		{
 			Profile* profile = reinterpret_cast<Profile*>(u);
@@ -359,7 +544,11 @@ namespace OpenSSL
 			, ctx(SSL_CTX_new(SSLv23_server_method()))
 			, clictx(SSL_CTX_new(SSLv23_client_method()))
 			, allowrenego(tag->getBool("renegotiation")) // Disallow by default
+			, kerneltls(tag->getBool("ktls"))
 			, outrecsize(tag->getUInt("outrecsize", 2048, 512, 16384))
+			, ticketkeys(NULL)
+			, handshakes(0)
+			, resumed(0)
 		{
 			if ((!ctx.SetDH(dh)) || (!clictx.SetDH(dh)))
 				throw Exception("Couldn't set DH parameters");
@@ -385,6 +574,20 @@ namespace OpenSSL
 				ctx.SetECDH(curvename);
 #endif
 
+			// Let reconnecting clients skip the full handshake.
+			const unsigned long sessiontimeout = tag->getDuration("sessiontimeout", 3600, 1);
+			ctx.SetSessionOptions(name, sessiontimeout);
+			if (tag->getBool("sessioncache", true))
+				ctx.EnableSessionCache(tag->getUInt("sessioncachesize", 20480, 1));
+
+#ifndef INSPIRCD_OPENSSL_KTLS
+			if (kerneltls)
+			{
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Kernel TLS needs Linux and OpenSSL 3.0 or newer built with kTLS support, ignoring ktls for profile %s", name.c_str());
+				kerneltls = false;
+			}
+#endif
+
 			SetContextOptions("server", tag, ctx);
 			SetContextOptions("client", tag, clictx);
 
@@ -422,6 +625,18 @@ namespace OpenSSL
 			clictx.SetVerifyCert();
 			if (tag->getBool("requestclientcert", true))
 				ctx.SetVerifyCert();
+
+			// This is done last so the keys are not leaked if anything above throws.
+			if (tag->getBool("tickets", true))
+			{
+				ticketkeys = new TicketKeys(tag->getDuration("ticketrotate", sessiontimeout, 60));
+				ctx.EnableTickets(ticketkeys);
+			}
+		}
+
+		~Profile()
+		{
+			delete ticketkeys;
 		}
 
 		const std::string& GetName() const { return name; }
@@ -429,7 +644,18 @@ namespace OpenSSL
 		SSL* CreateClientSession() { return clictx.CreateClientSession(); }
 		const EVP_MD* GetDigest() { return digest; }
 		bool AllowRenegotiation() const { return allowrenego; }
+		bool UseKernelTLS() const { return kerneltls; }
 		unsigned int GetOutgoingRecordSize() const { return outrecsize; }
+
+		void OnHandshake(bool sessionresumed)
+		{
+			handshakes++;
+			if (sessionresumed)
+				resumed++;
+		}
+
+		unsigned long GetHandshakes() const { return handshakes; }
+		unsigned long GetResumed() const { return resumed; }
 	};
 
 	namespace BIOMethod
@@ -499,14 +725,85 @@ static int OnVerify(int preverify_ok, X509_STORE_CTX *ctx)
 	 * In the future if we want an option to not allow this,
 	 * we can just return preverify_ok here, and openssl
 	 * will boot off self-signed and invalid peer certs.
+	 *
+	 * The outcome is read back with SSL_get_verify_result() once
+	 * the handshake is done, which also works for resumed sessions.
 	 */
-	int ve = X509_STORE_CTX_get_error(ctx);
-
-	SelfSigned = (ve == X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT);
-
 	return 1;
 }
 
+static BIO* CreateSocketBIO(StreamSocket* sock)
+{
+	// Create BIO instance and store a pointer to the socket in it which will be used by the read and write functions
+#ifdef INSPIRCD_OPENSSL_OPAQUE_BIO
+	BIO* bio = BIO_new(biomethods);
+#else
+	BIO* bio = BIO_new(&biomethods);
+#endif
+	BIO_set_data(bio, sock);
+	return bio;
+}
+
+class OpenSSLIOHook;
+
+/** Runs a step of a server side handshake on a worker thread
+ */
+class OpenSSLHandshakeJob : public WorkerPool::Job
+{
+ public:
+	/** The hook which started this step, NULL if it has closed since
+	 */
+	OpenSSLIOHook* hook;
+
+	/** Keeps the context of the session alive while the step runs
+	 */
+	reference<IOHookProvider> prov;
+
+	/** Session to advance, owned by this job if hook is NULL
+	 */
+	SSL* const sess;
+
+	/** Data received from the client
+	 */
+	std::string input;
+
+	/** Data to send to the client
+	 */
+	std::string output;
+
+	/** Result of SSL_do_handshake() and SSL_get_error()
+	 */
+	int result;
+	int error;
+
+	OpenSSLHandshakeJob(OpenSSLIOHook* iohook, IOHookProvider* hookprov, SSL* session)
+		: hook(iohook)
+		, prov(hookprov)
+		, sess(session)
+		, result(-1)
+		, error(SSL_ERROR_NONE)
+	{
+	}
+
+	void Run() CXX11_OVERRIDE
+	{
+		BIO_write(SSL_get_rbio(sess), input.data(), input.length());
+
+		ERR_clear_error();
+		result = SSL_do_handshake(sess);
+		if (result <= 0)
+			error = SSL_get_error(sess, result);
+		ERR_clear_error();
+
+		char buffer[4096];
+		int len;
+		while ((len = BIO_read(SSL_get_wbio(sess), buffer, sizeof(buffer))) > 0)
+			output.append(buffer, len);
+	}
+
+	void Finish() CXX11_OVERRIDE;
+};
+
 class OpenSSLIOHook : public SSLIOHook
 {
  private:
@@ -514,6 +811,35 @@ class OpenSSLIOHook : public SSLIOHook
 	issl_status status;
 	bool data_to_write;
 
+	/** The socket this hook is attached to
+	 */
+	StreamSocket* const sock;
+
+	/** True if the handshake is done by OpenSSLHandshakeJob on a worker thread
+	 * and has not completed yet
+	 */
+	bool offloaded;
+
+	/** The handshake step which is running on a worker thread, if any
+	 */
+	OpenSSLHandshakeJob* job;
+
+	/** True if OpenSSL is reading data which was left over from a handshake done on a worker thread
+	 */
+	bool leftoverdata;
+
+	/** True if the session uses socket BIOs so that OpenSSL can hand encryption over to the kernel
+	 */
+	bool kerneltls;
+
+	/** True if the kernel encrypts the data sent on this session, it is written to the socket as is
+	 */
+	bool ktlssend;
+
+	/** Handshake data which could not be sent to the client yet
+	 */
+	std::string handshakeout;
+
 	// Returns 1 if handshake succeeded, 0 if it is still in progress, -1 if it failed
 	int Handshake(StreamSocket* user)
 	{
@@ -544,6 +870,10 @@ class OpenSSLIOHook : public SSLIOHook
 		else if (ret > 0)
 		{
 			// Handshake complete.
+			const bool resumed = SSL_session_reused(sess);
+			GetProfile().OnHandshake(resumed);
+			CheckKernelTLS();
+
 			VerifyCertificate();
 
 			status = ISSL_OPEN;
@@ -561,7 +891,13 @@ class OpenSSLIOHook : public SSLIOHook
 
 	void CloseSession()
 	{
-		if (sess)
+		if (job)
+		{
+			// The session is in use on a worker thread, the job frees it when it finishes.
+			job->hook = NULL;
+			job = NULL;
+		}
+		else if (sess)
 		{
 			SSL_shutdown(sess);
 			SSL_free(sess);
@@ -587,9 +923,10 @@ class OpenSSLIOHook : public SSLIOHook
 			return;
 		}
 
-		certinfo->invalid = (SSL_get_verify_result(sess) != X509_V_OK);
+		const long verifyresult = SSL_get_verify_result(sess);
+		certinfo->invalid = (verifyresult != X509_V_OK);
 
-		if (!SelfSigned)
+		if (verifyresult != X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT)
 		{
 			certinfo->unknownsigner = false;
 			certinfo->trusted = true;
@@ -639,32 +976,145 @@ class OpenSSLIOHook : public SSLIOHook
 			// The other side is trying to renegotiate, kill the connection and change status
 			// to ISSL_NONE so CheckRenego() closes the session
 			status = ISSL_NONE;
-			BIO* bio = SSL_get_rbio(sess);
-			EventHandler* eh = static_cast<StreamSocket*>(BIO_get_data(bio));
-			SocketEngine::Shutdown(eh, 2);
+			SocketEngine::Shutdown(sock, 2);
 		}
 	}
 
-	bool CheckRenego(StreamSocket* sock)
+	bool CheckRenego(StreamSocket* user)
 	{
 		if (status != ISSL_NONE)
 			return true;
 
 		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Session %p killed, attempted to renegotiate", (void*)sess);
 		CloseSession();
-		sock->SetError("Renegotiation is not allowed");
+		user->SetError("Renegotiation is not allowed");
 		return false;
 	}
 
+	/** Read handshake data from the client and give it to a worker thread
+	 * @return 0 if the handshake is in progress, -1 if it failed
+	 */
+	int ReadHandshake()
+	{
+		if (job)
+			return 0;
+
+		char* buffer = ServerInstance->GetReadBuffer();
+		const int ret = SocketEngine::Recv(sock, buffer, ServerInstance->Config->NetBufferSize, 0);
+		if (ret == 0)
+		{
+			CloseSession();
+			sock->SetError("Connection closed");
+			return -1;
+		}
+		else if (ret < 0)
+		{
+			if (SocketEngine::IgnoreError())
+				return 0;
+
+			CloseSession();
+			sock->SetError(SocketEngine::LastError());
+			return -1;
+		}
+
+		job = new OpenSSLHandshakeJob(this, prov, sess);
+		job->input.assign(buffer, ret);
+
+		// Callbacks must not use this hook while OpenSSL runs on another thread. Stop
+		// reading until the job is done, the data which arrives in the meantime is
+		// picked up by the trial read added by OnHandshakeJobDone().
+		SSL_set_ex_data(sess, exdataindex, NULL);
+		SocketEngine::ChangeEventMask(sock, FD_WANT_NO_READ);
+
+		if (handshakepool)
+		{
+			handshakepool->Submit(job);
+		}
+		else
+		{
+			// The pool was disabled by a rehash after this hook was created.
+			OpenSSLHandshakeJob* const localjob = job;
+			localjob->Run();
+			localjob->Finish();
+			delete localjob;
+		}
+		return 0;
+	}
+
+	/** Send handshake data which was produced on a worker thread to the client
+	 * @return 1 if all of it was sent, 0 if the socket blocked, -1 on error
+	 */
+	int FlushHandshake()
+	{
+		while (!handshakeout.empty())
+		{
+			const int ret = SocketEngine::Send(sock, handshakeout.data(), handshakeout.length(), 0);
+			if (ret > 0)
+			{
+				handshakeout.erase(0, ret);
+			}
+			else if ((ret < 0) && (SocketEngine::IgnoreError()))
+			{
+				SocketEngine::ChangeEventMask(sock, FD_WANT_SINGLE_WRITE);
+				return 0;
+			}
+			else
+			{
+				return -1;
+			}
+		}
+		return 1;
+	}
+
+	/** Make OpenSSL read from the socket again once the data which was left over from a
+	 * handshake done on a worker thread has been consumed
+	 */
+	void CheckLeftoverData()
+	{
+#ifdef INSPIRCD_OPENSSL_HANDSHAKE_THREADS
+		if ((!leftoverdata) || (BIO_ctrl_pending(SSL_get_rbio(sess)) > 0))
+			return;
+
+		// The write BIO is the socket BIO, share it.
+		BIO* wbio = SSL_get_wbio(sess);
+		BIO_up_ref(wbio);
+		SSL_set0_rbio(sess, wbio);
+		leftoverdata = false;
+#endif
+	}
+
+	/** Find out which directions the kernel took over after a handshake on a session set up for
+	 * kernel TLS. Whatever it does not handle, e.g. because the tls module is not loaded, goes back
+	 * through our own BIO.
+	 */
+	void CheckKernelTLS()
+	{
+#ifdef INSPIRCD_OPENSSL_KTLS
+		if (!kerneltls)
+			return;
+
+		kerneltls = false;
+		ktlssend = BIO_get_ktls_send(SSL_get_wbio(sess));
+		const bool ktlsrecv = BIO_get_ktls_recv(SSL_get_rbio(sess));
+		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Session %p kernel TLS send: %s receive: %s", (void*)sess,
+			ktlssend ? "yes" : "no", ktlsrecv ? "yes" : "no");
+
+		if (!ktlssend)
+			SSL_set0_wbio(sess, CreateSocketBIO(sock));
+		if (!ktlsrecv)
+			SSL_set0_rbio(sess, CreateSocketBIO(sock));
+#endif
+	}
+
 	// Returns 1 if application I/O should proceed, 0 if it must wait for the underlying protocol to progress, -1 on fatal error
-	int PrepareIO(StreamSocket* sock)
+	int PrepareIO(StreamSocket* user)
 	{
 		if (status == ISSL_OPEN)
 			return 1;
 		else if (status == ISSL_HANDSHAKING)
 		{
 			// The handshake isn't finished, try to finish it
-			return Handshake(sock);
+			return Handshake(user);
 		}
 
 		CloseSession();
@@ -675,24 +1125,94 @@ class OpenSSLIOHook : public SSLIOHook
 	friend void StaticSSLInfoCallback(const SSL* ssl, int where, int rc);
 
  public:
-	OpenSSLIOHook(IOHookProvider* hookprov, StreamSocket* sock, SSL* session)
+	/** Create a new hook
+	 * @param hookprov Provider of the hook
+	 * @param socket Socket to attach the hook to
+	 * @param session Session to use, must be a server session if offload is true
+	 * @param offload True to do the handshake on the worker threads in handshakepool
+	 */
+	OpenSSLIOHook(IOHookProvider* hookprov, StreamSocket* socket, SSL* session, bool offload)
 		: SSLIOHook(hookprov)
 		, sess(session)
 		, status(ISSL_NONE)
 		, data_to_write(false)
+		, sock(socket)
+		, offloaded(offload)
+		, job(NULL)
+		, leftoverdata(false)
+		, kerneltls(!offload && GetProfile().UseKernelTLS())
+		, ktlssend(false)
 	{
-		// Create BIO instance and store a pointer to the socket in it which will be used by the read and write functions
-#ifdef INSPIRCD_OPENSSL_OPAQUE_BIO
-		BIO* bio = BIO_new(biomethods);
-#else
-		BIO* bio = BIO_new(&biomethods);
+		if (offloaded)
+		{
+			// The handshake is done on memory BIOs as the socket BIO can't be used from other
+			// threads, OnHandshakeJobDone() switches to the socket BIO when it completes.
+			SSL_set_bio(sess, BIO_new(BIO_s_mem()), BIO_new(BIO_s_mem()));
+		}
+#ifdef INSPIRCD_OPENSSL_KTLS
+		else if (kerneltls)
+		{
+			// OpenSSL can only give the keys to the kernel through its own socket BIOs. Use one for
+			// each direction so that CheckKernelTLS() can replace them independently.
+			SSL_set_bio(sess, BIO_new_socket(sock->GetFd(), BIO_NOCLOSE), BIO_new_socket(sock->GetFd(), BIO_NOCLOSE));
+			SSL_set_options(sess, SSL_OP_ENABLE_KTLS);
+		}
 #endif
-		BIO_set_data(bio, sock);
-		SSL_set_bio(sess, bio, bio);
+		else
+		{
+			BIO* bio = CreateSocketBIO(sock);
+			SSL_set_bio(sess, bio, bio);
+		}
 
 		SSL_set_ex_data(sess, exdataindex, this);
 		sock->AddIOHook(this);
-		Handshake(sock);
+		if (offloaded)
+		{
+			status = ISSL_HANDSHAKING;
+			SocketEngine::ChangeEventMask(sock, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
+		}
+		else
+		{
+			Handshake(sock);
+		}
+	}
+
+	/** Called on the main thread when a handshake step run by a worker thread is done
+	 * @param done The job which ran the step
+	 */
+	void OnHandshakeJobDone(OpenSSLHandshakeJob* done)
+	{
+		job = NULL;
+		SSL_set_ex_data(sess, exdataindex, this);
+
+		handshakeout.append(done->output);
+		if ((FlushHandshake() < 0) || ((done->result <= 0) && (done->error != SSL_ERROR_WANT_READ)))
+		{
+			// The socket can't be told about the error from here, the trial read makes
+			// OnStreamSocketRead() report it.
+			CloseSession();
+			SocketEngine::ChangeEventMask(sock, FD_WANT_POLL_READ | FD_ADD_TRIAL_READ);
+			return;
+		}
+
+		if (done->result > 0)
+		{
+			offloaded = false;
+			status = ISSL_OPEN;
+			GetProfile().OnHandshake(SSL_session_reused(sess));
+			VerifyCertificate();
+
+			// Everything OpenSSL writes from now on goes to the socket. The client may have sent
+			// application data along with the end of its handshake, the read BIO is switched
+			// over by CheckLeftoverData() once that has been read.
+#ifdef INSPIRCD_OPENSSL_HANDSHAKE_THREADS
+			SSL_set0_wbio(sess, CreateSocketBIO(sock));
+			leftoverdata = true;
+#endif
+		}
+
+		// Read data which arrived while the job was running.
+		SocketEngine::ChangeEventMask(sock, FD_WANT_POLL_READ | FD_ADD_TRIAL_READ);
 	}
 
 	void OnStreamSocketClose(StreamSocket* user) CXX11_OVERRIDE
@@ -702,11 +1222,16 @@ class OpenSSLIOHook : public SSLIOHook
 
 	int OnStreamSocketRead(StreamSocket* user, std::string& recvq) CXX11_OVERRIDE
 	{
+		if ((offloaded) && (status == ISSL_HANDSHAKING))
+			return ReadHandshake();
+
 		// Finish handshake if needed
 		int prepret = PrepareIO(user);
 		if (prepret <= 0)
 			return prepret;
 
+		CheckLeftoverData();
+
 		// If we resumed the handshake then this->status will be ISSL_OPEN
 		{
 			ERR_clear_error();
@@ -721,8 +1246,8 @@ class OpenSSLIOHook : public SSLIOHook
 			{
 				recvq.append(buffer, ret);
 				int mask = 0;
-				// Schedule a read if there is still data in the OpenSSL buffer
-				if (SSL_pending(sess) > 0)
+				// Schedule a read if there is still data in the OpenSSL buffer or in the read BIO
+				if ((SSL_pending(sess) > 0) || (leftoverdata))
 					mask |= FD_ADD_TRIAL_READ;
 				if (data_to_write)
 					mask |= FD_WANT_POLL_READ | FD_WANT_SINGLE_WRITE;
@@ -762,11 +1287,30 @@ class OpenSSLIOHook : public SSLIOHook
 
 	int OnStreamSocketWrite(StreamSocket* user, StreamSocket::SendQueue& sendq) CXX11_OVERRIDE
 	{
+		// Send what is left of a handshake done on a worker thread before anything else
+		if (!handshakeout.empty())
+		{
+			int flushret = FlushHandshake();
+			if (flushret <= 0)
+				return flushret;
+		}
+		if ((offloaded) && (status == ISSL_HANDSHAKING))
+			return 0;
+
 		// Finish handshake if needed
 		int prepret = PrepareIO(user);
 		if (prepret <= 0)
 			return prepret;
 
+		if (ktlssend)
+		{
+			// The kernel encrypts everything written to the socket so the data does not need to go through OpenSSL.
+			user->FlushSendQ(sendq);
+			if (!user->getError().empty())
+				return -1;
+			return (sendq.empty() ? 1 : 0);
+		}
+
 		data_to_write = true;
 
 		// Session is ready for transferring application data
@@ -845,10 +1389,29 @@ class OpenSSLIOHook : public SSLIOHook
 	OpenSSL::Profile& GetProfile();
 };
 
+void OpenSSLHandshakeJob::Finish()
+{
+	if (hook)
+		hook->OnHandshakeJobDone(this);
+	else
+		SSL_free(sess);
+}
+
 static void StaticSSLInfoCallback(const SSL* ssl, int where, int rc)
 {
+	// The hook is not set while a worker thread is doing the handshake.
 	OpenSSLIOHook* hook = static_cast<OpenSSLIOHook*>(SSL_get_ex_data(ssl, exdataindex));
-	hook->SSLInfoCallback(where, rc);
+	if (hook)
+		hook->SSLInfoCallback(where, rc);
+}
+
+static int StaticTicketKeyCallback(SSL* ssl, unsigned char* keyname, unsigned char* iv, EVP_CIPHER_CTX* cipherctx, TicketMACContext* macctx, int enc)
+{
+	// This can be called on a worker thread so the keys are found through the context rather than the hook.
+	OpenSSL::TicketKeys* keys = static_cast<OpenSSL::TicketKeys*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+	if (!keys)
+		return 0;
+	return keys->Setup(keyname, iv, cipherctx, macctx, enc);
 }
 
 static int OpenSSL::BIOMethod::write(BIO* bio, const char* buffer, int size)
@@ -916,12 +1479,13 @@ class OpenSSLIOHookProvider : public IOHookProvider
 
 	void OnAccept(StreamSocket* sock, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server) CXX11_OVERRIDE
 	{
-		new OpenSSLIOHook(this, sock, profile.CreateServerSession());
+		// Kernel TLS needs the handshake to be done on the socket so it can't be offloaded.
+		new OpenSSLIOHook(this, sock, profile.CreateServerSession(), (handshakepool != NULL) && (!profile.UseKernelTLS()));
 	}
 
 	void OnConnect(StreamSocket* sock) CXX11_OVERRIDE
 	{
-		new OpenSSLIOHook(this, sock, profile.CreateClientSession());
+		new OpenSSLIOHook(this, sock, profile.CreateClientSession(), false);
 	}
 
 	OpenSSL::Profile& GetProfile() { return profile; }
@@ -933,7 +1497,7 @@ OpenSSL::Profile& OpenSSLIOHook::GetProfile()
 	return static_cast<OpenSSLIOHookProvider*>(hookprov)->GetProfile();
 }
 
-class ModuleSSLOpenSSL : public Module
+class ModuleSSLOpenSSL : public Module, public Stats::EventListener
 {
 	typedef std::vector<reference<OpenSSLIOHookProvider> > ProfileList;
 
@@ -973,39 +1537,82 @@ class ModuleSSLOpenSSL : public Module
 				continue;
 			}
 
-			reference<OpenSSLIOHookProvider> prov;
+			reference<OpenSSLIOHookProvider> profile;
 			try
 			{
-				prov = new OpenSSLIOHookProvider(this, name, tag);
+				profile = new OpenSSLIOHookProvider(this, name, tag);
 			}
 			catch (CoreException& ex)
 			{
 				throw ModuleException("Error while initializing SSL profile \"" + name + "\" at " + tag->getTagLocation() + " - " + ex.GetReason());
 			}
 
-			newprofiles.push_back(prov);
+			newprofiles.push_back(profile);
 		}
 
 		for (ProfileList::iterator i = profiles.begin(); i != profiles.end(); ++i)
 		{
-			OpenSSLIOHookProvider& prov = **i;
-			ServerInstance->Modules.DelService(prov);
+			OpenSSLIOHookProvider& oldprofile = **i;
+			ServerInstance->Modules.DelService(oldprofile);
 		}
 
 		profiles.swap(newprofiles);
 	}
 
+	void ReadHandshakeThreads()
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("openssl");
+		unsigned int threads = tag->getUInt("handshakethreads", 0, 0, 256);
+#ifndef INSPIRCD_OPENSSL_HANDSHAKE_THREADS
+		if (threads)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Handshake threads need OpenSSL 1.1 or newer, doing handshakes on the main thread");
+			threads = 0;
+		}
+#endif
+
+		const size_t oldthreads = handshakepool ? handshakepool->GetSize() : 0;
+		if (threads == oldthreads)
+			return;
+
+		// Jobs which are still running are finished by the old pool before it is deleted.
+		WorkerPool::Pool* oldpool = handshakepool;
+		handshakepool = NULL;
+		delete oldpool;
+
+		if (!threads)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Doing handshakes on the main thread");
+			return;
+		}
+
+		try
+		{
+			handshakepool = new WorkerPool::Pool(threads);
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Doing server side handshakes on %u worker threads", threads);
+		}
+		catch (CoreException& ex)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to start handshake threads, doing handshakes on the main thread: %s", ex.GetReason().c_str());
+		}
+	}
+
  public:
 	ModuleSSLOpenSSL()
+		: Stats::EventListener(this)
 	{
 		// Initialize OpenSSL
 		OPENSSL_init_ssl(0, NULL);
 #ifdef INSPIRCD_OPENSSL_OPAQUE_BIO
 		biomethods = OpenSSL::BIOMethod::alloc();
+#endif
 	}
 
 	~ModuleSSLOpenSSL()
 	{
+		delete handshakepool;
+		handshakepool = NULL;
+#ifdef INSPIRCD_OPENSSL_OPAQUE_BIO
 		BIO_meth_free(biomethods);
 #endif
 	}
@@ -1021,6 +1628,7 @@ class ModuleSSLOpenSSL : public Module
 			throw ModuleException("Failed to register application specific data");
 
 		ReadProfiles();
+		ReadHandshakeThreads();
 	}
 
 	void OnModuleRehash(User* user, const std::string &param) CXX11_OVERRIDE
@@ -1036,6 +1644,7 @@ class ModuleSSLOpenSSL : public Module
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, ex.GetReason() + " Not applying settings.");
 		}
+		ReadHandshakeThreads();
 	}
 
 	void OnCleanup(ExtensionItem::ExtensibleType type, Extensible* item) CXX11_OVERRIDE
@@ -1053,6 +1662,22 @@ class ModuleSSLOpenSSL : public Module
 		}
 	}
 
+	ModResult OnStats(Stats::Context& stats) CXX11_OVERRIDE
+	{
+		if (stats.GetSymbol() != 'r')
+			return MOD_RES_PASSTHRU;
+
+		for (ProfileList::const_iterator i = profiles.begin(); i != profiles.end(); ++i)
+		{
+			const OpenSSL::Profile& profile = (*i)->GetProfile();
+			const unsigned long handshakes = profile.GetHandshakes();
+			const unsigned long percent = handshakes ? profile.GetResumed() * 100 / handshakes : 0;
+			stats.AddRow(304, "SSLSTATS Profile \"" + profile.GetName() + "\" (openssl) completed " + ConvToStr(handshakes) +
+				" handshakes of which " + ConvToStr(profile.GetResumed()) + " (" + ConvToStr(percent) + "%) resumed a session");
+		}
+		return MOD_RES_PASSTHRU;
+	}
+
 	ModResult OnCheckReady(LocalUser* user) CXX11_OVERRIDE
 	{
 		const OpenSSLIOHook* const iohook = static_cast<OpenSSLIOHook*>(user->eh.GetModHook(this));
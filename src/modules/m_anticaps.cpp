@@ -221,14 +221,9 @@ class ModuleAntiCaps : public Module
 
 		// If the message is a CTCP then we skip it unless it is
 		// an ACTION in which case we just check against the body.
-		std::string ctcpname;
-		std::string msgbody(details.text);
-		if (details.IsCTCP(ctcpname, msgbody))
-		{
-			// If the CTCP is not an action then skip it.
-			if (!irc::equals(ctcpname, "ACTION"))
-				return MOD_RES_PASSTHRU;
-		}
+		const MessageAnalysis& analysis = details.GetAnalysis();
+		if (analysis.ctcp && !irc::equals(analysis.ctcpname, "ACTION"))
+			return MOD_RES_PASSTHRU;
 
 		// Retrieve the anticaps config. This should never be
 		// null but its better to be safe than sorry.
@@ -238,21 +233,13 @@ class ModuleAntiCaps : public Module
 
 		// If the message is shorter than the minimum length then
 		// we don't need to do anything else.
-		size_t length = msgbody.length();
-		if (length < config->minlen)
+		if (analysis.bodylength < config->minlen)
 			return MOD_RES_PASSTHRU;
 
-		// Count the characters to see how many upper case and
-		// ignored (non upper or lower) characters there are.
-		size_t upper = 0;
-		for (std::string::const_iterator iter = msgbody.begin(); iter != msgbody.end(); ++iter)
-		{
-			unsigned char chr = static_cast<unsigned char>(*iter);
-			if (uppercase.test(chr))
-				upper += 1;
-			else if (!lowercase.test(chr))
-				length -= 1;
-		}
+		// Count the characters to see how many upper case and lower
+		// case characters there are. Anything else is ignored.
+		size_t upper = analysis.Count(uppercase);
+		size_t length = upper + analysis.Count(lowercase & ~uppercase);
 
 		// If the message was entirely symbols then the message
 		// can't contain any upper case letters.
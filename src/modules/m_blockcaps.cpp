@@ -61,32 +61,19 @@ public:
 			{
 				// If the message is a CTCP then we skip it unless it is
 				// an ACTION in which case we just check against the body.
-				std::string ctcpname;
-				std::string message(details.text);
-				if (details.IsCTCP(ctcpname, message))
-				{
-					// If the CTCP is not an action then skip it.
-					if (!irc::equals(ctcpname, "ACTION"))
-						return MOD_RES_PASSTHRU;
-				}
+				const MessageAnalysis& analysis = details.GetAnalysis();
+				if (analysis.ctcp && !irc::equals(analysis.ctcpname, "ACTION"))
+					return MOD_RES_PASSTHRU;
 
 				// If the message is shorter than the minimum length
 				// then we don't need to do anything else.
-				size_t length = message.length();
-				if (length < minlen)
+				if (analysis.bodylength < minlen)
 					return MOD_RES_PASSTHRU;
 
-				// Count the characters to see how many upper case and
-				// ignored (non upper or lower) characters there are.
-				size_t upper = 0;
-				for (std::string::const_iterator iter = message.begin(); iter != message.end(); ++iter)
-				{
-					unsigned char chr = static_cast<unsigned char>(*iter);
-					if (uppercase.test(chr))
-						upper += 1;
-					else if (!lowercase.test(chr))
-						length -= 1;
-				}
+				// Count the characters to see how many upper case and lower
+				// case characters there are. Anything else is ignored.
+				size_t upper = analysis.Count(uppercase);
+				size_t length = upper + analysis.Count(lowercase & ~uppercase);
 
 				// Calculate the percentage which is upper case. If the
 				// message was entirely symbols then it can't contain
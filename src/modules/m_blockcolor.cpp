@@ -53,14 +53,11 @@ class ModuleBlockColor : public Module
 
 			if (!c->GetExtBanStatus(user, 'c').check(!c->IsModeSet(bc)))
 			{
-				for (std::string::iterator i = details.text.begin(); i != details.text.end(); i++)
+				// Block all control codes except \001 for CTCP
+				if (!details.GetAnalysis().formatting.empty())
 				{
-					// Block all control codes except \001 for CTCP
-					if ((*i >= 0) && (*i < 32) && (*i != 1))
-					{
-						user->WriteNumeric(ERR_CANNOTSENDTOCHAN, c->name, "Can't send colors to channel (+c set)");
-						return MOD_RES_DENY;
-					}
+					user->WriteNumeric(ERR_CANNOTSENDTOCHAN, c->name, "Can't send colors to channel (+c set)");
+					return MOD_RES_DENY;
 				}
 			}
 		}
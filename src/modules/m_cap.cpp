@@ -164,6 +164,11 @@ class Cap::ManagerImpl : public Cap::Manager, public ReloadModule::EventListener
 			Capability* cap = i->second;
 			cap->Unregister();
 		}
+
+		// The caps of all users are lost with the extension item, reset their fingerprints to match
+		const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
+		for (UserManager::LocalList::const_iterator i = list.begin(); i != list.end(); ++i)
+			(*i)->capfingerprint = 0;
 	}
 
 	void AddCap(Cap::Capability* cap) CXX11_OVERRIDE
@@ -227,7 +232,7 @@ class Cap::ManagerImpl : public Cap::Manager, public ReloadModule::EventListener
 
 	void Set302Protocol(LocalUser* user)
 	{
-		capext.set(user, capext.get(user) | CAP_302_BIT);
+		capext.SetCaps(user, capext.get(user) | CAP_302_BIT);
 	}
 
 	bool HandleReq(LocalUser* user, const std::string& reqlist)
@@ -250,7 +255,7 @@ class Cap::ManagerImpl : public Cap::Manager, public ReloadModule::EventListener
 				usercaps = cap->AddToMask(usercaps);
 		}
 
-		capext.set(user, usercaps);
+		capext.SetCaps(user, usercaps);
 		return true;
 	}
 
@@ -287,7 +292,7 @@ class Cap::ManagerImpl : public Cap::Manager, public ReloadModule::EventListener
 	void HandleClear(LocalUser* user, std::string& result)
 	{
 		HandleList(result, user, false, false, true);
-		capext.unset(user);
+		capext.UnsetCaps(user);
 	}
 };
 
@@ -22,6 +22,7 @@
 
 #include "inspircd.h"
 #include "modules/exemption.h"
+#include "modules/wordmatch.h"
 
 typedef insp::flat_map<std::string, std::string, irc::insensitive_swo> censor_t;
 
@@ -29,6 +30,13 @@ class ModuleCensor : public Module
 {
 	CheckExemption::EventProvider exemptionprov;
 	censor_t censors;
+
+	/** Finds the censored words in a message. The identifier of each word is its index in censors. */
+	WordMatch::Matcher matcher;
+
+	/** The censored words which were found in the last message. */
+	WordMatch::OccurrenceList found;
+
 	SimpleUserModeHandler cu;
 	SimpleChannelModeHandler cc;
 
@@ -81,20 +89,31 @@ class ModuleCensor : public Module
 				return MOD_RES_PASSTHRU;
 		}
 
-		for (censor_t::iterator index = censors.begin(); index != censors.end(); index++)
+		if (!matcher.FindAll(details.text, found))
+			return MOD_RES_PASSTHRU;
+
+		// Words without a replacement block the message wherever they are.
+		for (WordMatch::OccurrenceList::const_iterator i = found.begin(); i != found.end(); ++i)
 		{
-			size_t censorpos;
-			while ((censorpos = irc::find(details.text, index->first)) != std::string::npos)
+			const censor_t::value_type& censor = censors.begin()[i->id];
+			if (censor.second.empty())
 			{
-				if (index->second.empty())
-				{
-					user->WriteNumeric(numeric, targetname, "Your message contained a censored word (" + index->first + "), and was blocked");
-					return MOD_RES_DENY;
-				}
-
-				details.text.replace(censorpos, index->first.size(), index->second);
+				user->WriteNumeric(numeric, targetname, "Your message contained a censored word (" + censor.first + "), and was blocked");
+				return MOD_RES_DENY;
 			}
 		}
+
+		// Replace the leftmost longest words which don't overlap in a single pass.
+		matcher.FindAll(details.text, found, false);
+		std::string text;
+		size_t pos = 0;
+		for (WordMatch::OccurrenceList::const_iterator i = found.begin(); i != found.end(); ++i)
+		{
+			text.append(details.text, pos, i->start - pos).append(censors.begin()[i->id].second);
+			pos = i->start + i->length;
+		}
+		text.append(details.text, pos, std::string::npos);
+		details.text.swap(text);
 		return MOD_RES_PASSTHRU;
 	}
 
@@ -118,6 +137,11 @@ class ModuleCensor : public Module
 			newcensors[text] = replace;
 		}
 		censors.swap(newcensors);
+
+		matcher.Clear();
+		for (censor_t::const_iterator i = censors.begin(); i != censors.end(); ++i)
+			matcher.Add(i->first, i - censors.begin());
+		matcher.Compile();
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
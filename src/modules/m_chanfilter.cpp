@@ -26,6 +26,84 @@
 #include "inspircd.h"
 #include "listmode.h"
 #include "modules/exemption.h"
+#include "modules/wordmatch.h"
+
+/** Finds the +g entries which could match a message without having to glob match every one.
+ * Each entry is indexed by the longest run of literal text in it which a message has to
+ * contain for the entry to match.
+ */
+class FilterCache
+{
+	/** Marks the entries whose literal text was found in a message. */
+	struct Marker
+	{
+		std::vector<bool>& candidates;
+		Marker(std::vector<bool>& Candidates) : candidates(Candidates) { }
+
+		bool operator()(const WordMatch::Occurrence& occurrence)
+		{
+			candidates[occurrence.id] = true;
+			return true;
+		}
+	};
+
+	/** Finds the literal text of the entries. */
+	WordMatch::Matcher matcher;
+
+	/** Whether each entry has to be checked regardless of the matcher. */
+	std::vector<bool> unindexed;
+
+	/** Whether each entry could match the message being checked. */
+	std::vector<bool> candidates;
+
+ public:
+	FilterCache(const ListModeBase::ModeList& list)
+		: unindexed(list.size(), false)
+	{
+		for (size_t i = 0; i < list.size(); ++i)
+		{
+			const std::string& mask = list[i].mask;
+			std::string::size_type beststart = 0;
+			std::string::size_type bestlength = 0;
+			for (std::string::size_type start = 0; start < mask.length(); )
+			{
+				const std::string::size_type end = std::min(mask.find_first_of("*?", start), mask.length());
+				if (end - start > bestlength)
+				{
+					beststart = start;
+					bestlength = end - start;
+				}
+				start = end + 1;
+			}
+
+			if (bestlength)
+				matcher.Add(mask.substr(beststart, bestlength), i);
+			else
+				unindexed[i] = true;
+		}
+		matcher.Compile();
+	}
+
+	/** Finds the first entry in a list which matches some text.
+	 * @param list The list this cache was built from.
+	 * @param text The text to check.
+	 * @return The matching entry or NULL if no entry matches.
+	 */
+	const ListModeBase::ListItem* Find(const ListModeBase::ModeList& list, const std::string& text)
+	{
+		candidates = unindexed;
+		Marker marker(candidates);
+		matcher.Search(text, marker);
+
+		// The list is checked in order so the entry reported is the same as without the index.
+		for (size_t i = 0; i < list.size(); ++i)
+		{
+			if (candidates[i] && InspIRCd::Match(text, list[i].mask))
+				return &list[i];
+		}
+		return NULL;
+	}
+};
 
 /** Handles channel mode +g
  */
@@ -33,12 +111,34 @@ class ChanFilter : public ListModeBase
 {
  public:
 	unsigned long maxlen;
+	SimpleExtItem<FilterCache> cache;
 
 	ChanFilter(Module* Creator)
 		: ListModeBase(Creator, "filter", 'g', "End of channel spamfilter list", 941, 940, false)
+		, cache("filtercache", ExtensionItem::EXT_CHANNEL, Creator)
 	{
 	}
 
+	ModeAction OnModeChange(User* source, User* dest, Channel* channel, std::string& parameter, bool adding) CXX11_OVERRIDE
+	{
+		ModeAction result = ListModeBase::OnModeChange(source, dest, channel, parameter, adding);
+		if (result == MODEACTION_ALLOW)
+			cache.unset(channel);
+		return result;
+	}
+
+	/** Retrieves the cache for the +g list of a channel, building it if needed. */
+	FilterCache* GetCache(Channel* chan, const ModeList& words)
+	{
+		FilterCache* fc = cache.get(chan);
+		if (!fc)
+		{
+			fc = new FilterCache(words);
+			cache.set(chan, fc);
+		}
+		return fc;
+	}
+
 	bool ValidateParam(User* user, Channel* chan, std::string& word) CXX11_OVERRIDE
 	{
 		if (word.length() > maxlen)
@@ -73,6 +173,11 @@ class ModuleChanFilter : public Module
 		cf.maxlen = tag->getUInt("maxlen", 35, 10, 100);
 		notifyuser = tag->getBool("notifyuser", true);
 		cf.DoRehash();
+
+		// The case mapping may have changed so the caches are rebuilt when next needed.
+		const chan_hash& chans = ServerInstance->GetChans();
+		for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
+			cf.cache.unset(i->second);
 	}
 
 	ModResult OnUserPreMessage(User* user, const MessageTarget& target, MessageDetails& details) CXX11_OVERRIDE
@@ -88,24 +193,22 @@ class ModuleChanFilter : public Module
 
 		ListModeBase::ModeList* list = cf.GetList(chan);
 
-		if (list)
+		if (list && !list->empty())
 		{
-			for (ListModeBase::ModeList::iterator i = list->begin(); i != list->end(); i++)
+			const ListModeBase::ListItem* item = cf.GetCache(chan, *list)->Find(*list, details.text);
+			if (item)
 			{
-				if (InspIRCd::Match(details.text, i->mask))
+				if (!notifyuser)
 				{
-					if (!notifyuser)
-					{
-						details.echo_original = true;
-						return MOD_RES_DENY;
-					}
-
-					if (hidemask)
-						user->WriteNumeric(ERR_CANNOTSENDTOCHAN, chan->name, "Cannot send to channel (your message contained a censored word)");
-					else
-						user->WriteNumeric(ERR_CANNOTSENDTOCHAN, chan->name, "Cannot send to channel (your message contained a censored word: " + i->mask + ")");
+					details.echo_original = true;
 					return MOD_RES_DENY;
 				}
+
+				if (hidemask)
+					user->WriteNumeric(ERR_CANNOTSENDTOCHAN, chan->name, "Cannot send to channel (your message contained a censored word)");
+				else
+					user->WriteNumeric(ERR_CANNOTSENDTOCHAN, chan->name, "Cannot send to channel (your message contained a censored word: " + item->mask + ")");
+				return MOD_RES_DENY;
 			}
 		}
 
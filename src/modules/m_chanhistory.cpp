@@ -22,6 +22,14 @@
 #include "modules/ircv3_batch.h"
 #include "modules/server.h"
 
+#include <fstream>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#endif
+
 struct HistoryItem
 {
 	time_t ts;
@@ -34,6 +42,39 @@ struct HistoryItem
 		, sourcemask(source->GetFullHost())
 	{
 	}
+
+	HistoryItem(time_t Ts, const std::string& Sourcemask, const std::string& Text)
+		: ts(Ts)
+		, text(Text)
+		, sourcemask(Sourcemask)
+	{
+	}
+};
+
+/** The history lines of a channel serialized for a group of users who get them in the same form.
+ */
+struct SerializedHistory
+{
+	/** The serializer of the users. */
+	ClientProtocol::Serializer* serializer;
+
+	/** A fixed probe message as serialized for the users, it identifies the tags they get. */
+	ClientProtocol::SerializedMessage probe;
+
+	/** The sequence number of the first line in lines. */
+	unsigned long firstseq;
+
+	/** The serialized lines, oldest first. Lines added to the history since the last replay are
+	 * serialized on the next replay.
+	 */
+	std::deque<ClientProtocol::SerializedMessage> lines;
+
+	SerializedHistory(ClientProtocol::Serializer* ser, const ClientProtocol::SerializedMessage& probestr, unsigned long seq)
+		: serializer(ser)
+		, probe(probestr)
+		, firstseq(seq)
+	{
+	}
 };
 
 struct HistoryList
@@ -42,16 +83,629 @@ struct HistoryList
 	unsigned int maxlen, maxtime;
 	std::string param;
 
+	/** The total size of the text and source masks of the lines. */
+	size_t bytes;
+
+	/** The sequence number of the oldest line. */
+	unsigned long firstseq;
+
+	/** The lines serialized for the users who joined recently, most recently used first. */
+	std::list<SerializedHistory> serialized;
+
 	HistoryList(unsigned int len, unsigned int time, const std::string& oparam)
-		: maxlen(len), maxtime(time), param(oparam) { }
+		: maxlen(len), maxtime(time), param(oparam), bytes(0), firstseq(0) { }
+
+	void Add(const HistoryItem& item)
+	{
+		lines.push_back(item);
+		bytes += item.text.length() + item.sourcemask.length();
+	}
+
+	/** Remove lines until the history is within its line count, age and size limits.
+	 * @param maxbytes The maximum total size of the lines.
+	 */
+	void Prune(size_t maxbytes)
+	{
+		const time_t mintime = (maxtime ? ServerInstance->Time() - maxtime : 0);
+		while ((!lines.empty()) && ((lines.size() > maxlen) || (bytes > maxbytes) || (lines.front().ts < mintime)))
+		{
+			bytes -= lines.front().text.length() + lines.front().sourcemask.length();
+			lines.pop_front();
+			firstseq++;
+		}
+	}
+};
+
+/** The history of a channel stored on disk. Lines are appended to the file in the order they were
+ * sent and expired lines are removed from the start of the file by compacting it. The file is only
+ * open while the log is in use, see HistoryStore, but its length and time index are kept in memory.
+ */
+class HistoryLog
+{
+	/** The header of a line in the file. The source mask and the text of the line follow it. */
+	struct Record
+	{
+		/** The size of the record including padding, 0 marks the end of the log. */
+		uint32_t size;
+		uint32_t sourcelen;
+		uint32_t textlen;
+		uint32_t reserved;
+		int64_t ts;
+	};
+
+	/** Records are padded to a multiple of this to keep their headers aligned. */
+	static const size_t RecordAlign = 8;
+
+	/** The minimum number of bytes between two entries of the time index. */
+	static const size_t IndexInterval = 4096;
+
+	/** The path to the file. */
+	const std::string path;
+
+	/** The file descriptor of the file or -1 if it is not open. */
+	int fd;
+
+	/** The number of bytes in the file or 0 if the file has not been read yet. */
+	size_t length;
+
+	/** The time of the newest line in the log. */
+	time_t newest;
+
+	/** The time and offset of a record every IndexInterval bytes, used to find the first
+	 * line sent after a given time without reading the whole file.
+	 */
+	std::vector<std::pair<time_t, size_t> > timeindex;
+
+	static const char* GetMagic() { return "IRCHIST\x01"; }
+	static size_t GetMagicSize() { return 8; }
+
+	void Index(size_t offset, time_t ts)
+	{
+		if ((timeindex.empty()) || (offset - timeindex.back().second >= IndexInterval))
+			timeindex.push_back(std::make_pair(ts, offset));
+		newest = std::max(newest, ts);
+	}
+
+	/** Find where to start reading to find the lines sent at or after a given time.
+	 * @param from The time to look for.
+	 * @return The offset of a record at or before the first record sent at or after the given time.
+	 */
+	size_t FindStart(time_t from) const
+	{
+		std::vector<std::pair<time_t, size_t> >::const_iterator it = std::lower_bound(timeindex.begin(), timeindex.end(), std::make_pair(from, size_t(0)));
+		if (it == timeindex.begin())
+			return GetMagicSize();
+		return (--it)->second;
+	}
+
+	/** Read the header of a record.
+	 * @param stream The stream to read from.
+	 * @param offset The offset of the record.
+	 * @param rec The record to read into.
+	 * @return True if a valid record was read, false otherwise.
+	 */
+	static bool ReadRecord(std::istream& stream, size_t offset, size_t filesize, Record& rec)
+	{
+		stream.seekg(offset);
+		if ((offset + sizeof(Record) > filesize) || (!stream.read(reinterpret_cast<char*>(&rec), sizeof(Record))))
+			return false;
+
+		return ((rec.size != 0) && (rec.size % RecordAlign == 0) && (rec.size <= filesize - offset)
+			&& (sizeof(Record) + rec.sourcelen + rec.textlen <= rec.size));
+	}
+
+	/** Find the end of the log and build the time index. Anything after an invalid record, e.g. one
+	 * which was partly written when the server crashed, is discarded.
+	 * @return True if the file is a history log, false otherwise.
+	 */
+	bool Scan()
+	{
+#ifndef _WIN32
+		struct stat sb;
+		if (fstat(fd, &sb) != 0)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to read history log \"%s\": %s (%d)", path.c_str(), strerror(errno), errno);
+			return false;
+		}
+
+		const size_t filesize = sb.st_size;
+		if (filesize < GetMagicSize())
+		{
+			if (pwrite(fd, GetMagic(), GetMagicSize(), 0) != static_cast<ssize_t>(GetMagicSize()))
+			{
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to write history log \"%s\": %s (%d)", path.c_str(), strerror(errno), errno);
+				return false;
+			}
+			length = GetMagicSize();
+			return true;
+		}
+
+		std::ifstream stream(path.c_str(), std::ios::in | std::ios::binary);
+		char header[8];
+		if ((!stream.read(header, GetMagicSize())) || (memcmp(header, GetMagic(), GetMagicSize()) != 0))
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "History log \"%s\" is not in the expected format, ignoring it", path.c_str());
+			return false;
+		}
+
+		length = GetMagicSize();
+		Record rec;
+		while (ReadRecord(stream, length, filesize, rec))
+		{
+			Index(length, rec.ts);
+			length += rec.size;
+		}
+
+		if ((length < filesize) && (ftruncate(fd, length) != 0))
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to trim history log \"%s\": %s (%d)", path.c_str(), strerror(errno), errno);
+		return true;
+#else
+		return false;
+#endif
+	}
+
+ public:
+	/** The time the log was last used, see HistoryStore. */
+	time_t lastused;
+
+	HistoryLog(const std::string& Path)
+		: path(Path)
+		, fd(-1)
+		, length(0)
+		, newest(0)
+		, lastused(0)
+	{
+	}
+
+	~HistoryLog()
+	{
+		Close();
+	}
+
+	bool IsOpen() const { return (fd >= 0); }
+
+	/** Open the file, reading it if it has not been read yet.
+	 * @return True if the file was opened, false on error.
+	 */
+	bool Open()
+	{
+#ifndef _WIN32
+		if (fd >= 0)
+			return true;
+
+		fd = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+		if (fd < 0)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to open history log \"%s\": %s (%d)", path.c_str(), strerror(errno), errno);
+			return false;
+		}
+
+		if ((!length) && (!Scan()))
+		{
+			Close();
+			return false;
+		}
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	/** Close the file. The log can be opened again without reading the file. */
+	void Close()
+	{
+#ifndef _WIN32
+		if (fd >= 0)
+			close(fd);
+#endif
+		fd = -1;
+	}
+
+	/** Check whether a file is a history log by looking at its header.
+	 * @param filename The path to the file.
+	 * @return True if the file starts with the header of a history log, false otherwise.
+	 */
+	static bool IsLog(const std::string& filename)
+	{
+		char header[8];
+		std::ifstream stream(filename.c_str(), std::ios::in | std::ios::binary);
+		stream.read(header, GetMagicSize());
+		return ((stream.gcount() == static_cast<std::streamsize>(GetMagicSize())) && (!memcmp(header, GetMagic(), GetMagicSize())));
+	}
+
+	/** Close and delete the file. */
+	void Remove()
+	{
+		Close();
+		remove(path.c_str());
+		length = 0;
+		newest = 0;
+		timeindex.clear();
+	}
+
+	/** Add a line to the end of the log. The log must be open.
+	 * @param item The line to add.
+	 */
+	void Append(const HistoryItem& item)
+	{
+#ifndef _WIN32
+		if (fd < 0)
+			return;
+
+		Record rec;
+		rec.size = sizeof(Record) + item.sourcemask.length() + item.text.length();
+		rec.size = (rec.size + RecordAlign - 1) / RecordAlign * RecordAlign;
+		rec.sourcelen = item.sourcemask.length();
+		rec.textlen = item.text.length();
+		rec.reserved = 0;
+		rec.ts = item.ts;
+
+		std::string buffer(reinterpret_cast<const char*>(&rec), sizeof(Record));
+		buffer.append(item.sourcemask).append(item.text);
+		buffer.resize(rec.size, '\0');
+
+		const ssize_t written = pwrite(fd, buffer.data(), buffer.length(), length);
+		if (written != static_cast<ssize_t>(buffer.length()))
+		{
+			// Don't leave a partly written record behind, the next one would be written after it.
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to write history log \"%s\": %s (%d)", path.c_str(), strerror(errno), errno);
+			if ((written > 0) && (ftruncate(fd, length) != 0))
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to trim history log \"%s\": %s (%d)", path.c_str(), strerror(errno), errno);
+			return;
+		}
+
+		Index(length, item.ts);
+		length += rec.size;
+#endif
+	}
+
+	/** Read the lines sent at or after a given time.
+	 * @param from The time to read from.
+	 * @param max The maximum number of lines to read, the newest ones are kept.
+	 * @param list The list to add the lines to.
+	 */
+	void Read(time_t from, size_t max, HistoryList* list) const
+	{
+		if (length <= GetMagicSize())
+			return;
+
+		std::ifstream stream(path.c_str(), std::ios::in | std::ios::binary);
+		std::deque<HistoryItem> lines;
+		std::vector<char> buffer;
+		Record rec;
+		for (size_t offset = FindStart(from); ReadRecord(stream, offset, length, rec); offset += rec.size)
+		{
+			if (rec.ts < from)
+				continue;
+
+			buffer.resize(rec.sourcelen + rec.textlen + 1);
+			if (!stream.read(&buffer[0], rec.sourcelen + rec.textlen))
+				break;
+
+			lines.push_back(HistoryItem(rec.ts, std::string(&buffer[0], rec.sourcelen), std::string(&buffer[rec.sourcelen], rec.textlen)));
+			if (lines.size() > max)
+				lines.pop_front();
+		}
+
+		for (std::deque<HistoryItem>::const_iterator i = lines.begin(); i != lines.end(); ++i)
+			list->Add(*i);
+	}
+
+	/** Remove the lines sent before a given time. The file is rewritten once at least half of it
+	 * is expired, the file is closed if that happens.
+	 * @param mintime The time of the oldest line to keep.
+	 * @param budget The number of bytes which may still be rewritten in this tick, reduced by the
+	 * number of bytes which were rewritten.
+	 * @return True if the log still has lines, false if it is empty.
+	 */
+	bool Compact(time_t mintime, size_t& budget)
+	{
+		if ((length <= GetMagicSize()) || (newest < mintime))
+		{
+			Remove();
+			return false;
+		}
+
+		// The first record which is kept is before the first index entry which is not expired so
+		// the index tells whether rewriting the file may be worth it without reading it.
+		std::vector<std::pair<time_t, size_t> >::const_iterator next = std::lower_bound(timeindex.begin(), timeindex.end(), std::make_pair(mintime, size_t(0)));
+		if (((next == timeindex.end()) ? length : next->second) - GetMagicSize() < length / 2)
+			return true;
+
+		// Find the first record which is kept, this reads at most IndexInterval bytes of headers.
+		std::ifstream stream(path.c_str(), std::ios::in | std::ios::binary);
+		size_t offset = FindStart(mintime);
+		Record rec;
+		while ((ReadRecord(stream, offset, length, rec)) && (rec.ts < mintime))
+			offset += rec.size;
+
+		if (offset - GetMagicSize() < length / 2)
+			return true;
+
+		// Write the lines which are kept to a new file and replace the old file with it.
+		const std::string newpath = path + ".tmp";
+		std::ofstream newstream(newpath.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		newstream.write(GetMagic(), GetMagicSize());
+		stream.clear();
+		stream.seekg(offset);
+		char buffer[65536];
+		for (size_t left = length - offset; (left) && (stream) && (newstream); )
+		{
+			const size_t chunk = std::min(left, sizeof(buffer));
+			stream.read(buffer, chunk);
+			newstream.write(buffer, stream.gcount());
+			left -= stream.gcount();
+		}
+		newstream.close();
+		budget -= std::min(budget, length - offset);
+
+		if ((newstream.fail()) || (!stream))
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to write history log \"%s\": %s (%d)", newpath.c_str(), strerror(errno), errno);
+			remove(newpath.c_str());
+			return true;
+		}
+
+		Close();
+		if (rename(newpath.c_str(), path.c_str()) < 0)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to replace history log \"%s\": %s (%d)", path.c_str(), strerror(errno), errno);
+			remove(newpath.c_str());
+			return true;
+		}
+
+		// Move the time index along with the lines.
+		const size_t expired = offset - GetMagicSize();
+		std::vector<std::pair<time_t, size_t> > newindex;
+		for (std::vector<std::pair<time_t, size_t> >::const_iterator i = timeindex.begin(); i != timeindex.end(); ++i)
+		{
+			if (i->second >= offset)
+				newindex.push_back(std::make_pair(i->first, i->second - expired));
+		}
+		timeindex.swap(newindex);
+		length -= expired;
+		return true;
+	}
+};
+
+/** The history logs of the channels which have their history stored on disk. Only a limited number
+ * of logs are open at the same time, the least recently used one is closed when another one has to
+ * be opened and logs which were not used for a while are closed.
+ */
+class HistoryStore : public Timer
+{
+	typedef std::map<std::string, HistoryLog*, irc::insensitive_swo> LogMap;
+
+	/** The maximum number of logs which are open at the same time. */
+	static const size_t MaxOpenLogs = 32;
+
+	/** The number of seconds after which a log which was not used is closed. */
+	static const time_t IdleTime = 300;
+
+	/** The maximum number of bytes rewritten by compacting logs in one tick. */
+	static const size_t CompactBudget = 4 * 1024 * 1024;
+
+	/** The directory the logs are stored in. */
+	const std::string dir;
+
+	/** How long lines are kept in the logs. */
+	const unsigned long keep;
+
+	/** The logs of the channels, open or not. */
+	LogMap logs;
+
+	/** The logs which are open, most recently used first. */
+	std::list<HistoryLog*> openlogs;
+
+	/** The name of the channel whose log was compacted last. */
+	std::string lastcompacted;
+
+	std::string GetPath(const std::string& channel) const
+	{
+		// Channel names may contain any character so the file name is the hex encoded lower
+		// case channel name.
+		std::string name;
+		for (std::string::const_iterator i = channel.begin(); i != channel.end(); ++i)
+			name.push_back(national_case_insensitive_map[static_cast<unsigned char>(*i)]);
+		return dir + "/history-" + BinToHex(name) + ".log";
+	}
+
+	/** Make sure a log is open, closing the least recently used log if too many are open.
+	 * @param log The log to use.
+	 * @return True if the log is open, false if it could not be opened.
+	 */
+	bool Use(HistoryLog* log)
+	{
+		log->lastused = ServerInstance->Time();
+		std::list<HistoryLog*>::iterator it = std::find(openlogs.begin(), openlogs.end(), log);
+		if (it != openlogs.end())
+		{
+			if (log->IsOpen())
+			{
+				openlogs.splice(openlogs.begin(), openlogs, it);
+				return true;
+			}
+
+			// The log was closed by Compact().
+			openlogs.erase(it);
+		}
+
+		if (!log->Open())
+			return false;
+
+		openlogs.push_front(log);
+		while (openlogs.size() > MaxOpenLogs)
+		{
+			openlogs.back()->Close();
+			openlogs.pop_back();
+		}
+		return true;
+	}
+
+	/** Delete a log, keeping its file.
+	 * @param it The log to delete.
+	 */
+	void Delete(LogMap::iterator it)
+	{
+		openlogs.remove(it->second);
+		delete it->second;
+		logs.erase(it);
+	}
+
+ public:
+	HistoryStore(const std::string& Dir, unsigned long Keep)
+		: Timer(60, true)
+		, dir(Dir)
+		, keep(Keep)
+	{
+#ifndef _WIN32
+		mkdir(dir.c_str(), 0700);
+
+		// Remove the logs which were last written to before the oldest line to keep. Only files which
+		// were created by us are removed in case the directory is shared with something else.
+		DIR* library = opendir(dir.c_str());
+		if (!library)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to open history directory \"%s\": %s (%d)", dir.c_str(), strerror(errno), errno);
+			return;
+		}
+
+		dirent* entry;
+		while ((entry = readdir(library)))
+		{
+			const std::string path = dir + "/" + entry->d_name;
+			struct stat sb;
+			if ((InspIRCd::Match(entry->d_name, "history-*.log")) && (stat(path.c_str(), &sb) == 0)
+				&& (sb.st_mtime < ServerInstance->Time() - static_cast<time_t>(keep)) && (HistoryLog::IsLog(path)))
+				remove(path.c_str());
+		}
+		closedir(library);
+#endif
+		ServerInstance->Timers.AddTimer(this);
+	}
+
+	~HistoryStore()
+	{
+		for (LogMap::iterator i = logs.begin(); i != logs.end(); ++i)
+			delete i->second;
+	}
+
+	const std::string& GetDirectory() const { return dir; }
+	unsigned long GetKeep() const { return keep; }
+
+	/** Get the log of a channel, reading it if needed.
+	 * @param chan The channel to get the log of.
+	 * @return The log of the channel or NULL if it could not be read.
+	 */
+	HistoryLog* GetLog(Channel* chan)
+	{
+		LogMap::iterator it = logs.find(chan->name);
+		if (it != logs.end())
+			return it->second;
+
+		HistoryLog* log = new HistoryLog(GetPath(chan->name));
+		if (!Use(log))
+		{
+			delete log;
+			return NULL;
+		}
+
+		logs.insert(std::make_pair(chan->name, log));
+		return log;
+	}
+
+	/** Load the stored history of a channel.
+	 * @param chan The channel to load the history of.
+	 * @param list The list to load the history into.
+	 */
+	void Load(Channel* chan, HistoryList* list)
+	{
+		HistoryLog* log = GetLog(chan);
+		if (log)
+			log->Read(list->maxtime ? ServerInstance->Time() - list->maxtime : 0, list->maxlen, list);
+	}
+
+	/** Add a line to the log of a channel.
+	 * @param chan The channel the line was sent to.
+	 * @param item The line to add.
+	 */
+	void Append(Channel* chan, const HistoryItem& item)
+	{
+		HistoryLog* log = GetLog(chan);
+		if ((log) && (Use(log)))
+			log->Append(item);
+	}
+
+	/** Close the log of a channel, keeping its lines on disk.
+	 * @param chan The channel to close the log of.
+	 */
+	void CloseLog(Channel* chan)
+	{
+		LogMap::iterator it = logs.find(chan->name);
+		if (it != logs.end())
+			Delete(it);
+	}
+
+	/** Delete the log of a channel.
+	 * @param chan The channel to delete the log of.
+	 */
+	void RemoveLog(Channel* chan)
+	{
+		LogMap::iterator it = logs.find(chan->name);
+		if (it != logs.end())
+		{
+			it->second->Remove();
+			Delete(it);
+			return;
+		}
+
+		// The log may have been closed when the mode was removed by a server.
+		const std::string path = GetPath(chan->name);
+		if (HistoryLog::IsLog(path))
+			remove(path.c_str());
+	}
+
+	/** Close the logs which were not used recently and compact some of the logs, continuing where
+	 * the previous call stopped.
+	 */
+	bool Tick(time_t now) CXX11_OVERRIDE
+	{
+		while ((!openlogs.empty()) && (openlogs.back()->lastused + IdleTime < now))
+		{
+			openlogs.back()->Close();
+			openlogs.pop_back();
+		}
+
+		const time_t mintime = now - keep;
+		size_t budget = CompactBudget;
+		LogMap::iterator it = logs.upper_bound(lastcompacted);
+		while (budget)
+		{
+			if (it == logs.end())
+			{
+				lastcompacted.clear();
+				break;
+			}
+
+			lastcompacted = it->first;
+			if (it->second->Compact(mintime, budget))
+				++it;
+			else
+				Delete(it++);
+		}
+		return true;
+	}
 };
 
 class HistoryMode : public ParamMode<HistoryMode, SimpleExtItem<HistoryList> >
 {
  public:
 	unsigned int maxlines;
+	size_t maxbytes;
+	HistoryStore* store;
 	HistoryMode(Module* Creator)
 		: ParamMode<HistoryMode, SimpleExtItem<HistoryList> >(Creator, "history", 'H')
+		, store(NULL)
 	{
 	}
 
@@ -84,21 +738,39 @@ class HistoryMode : public ParamMode<HistoryMode, SimpleExtItem<HistoryList> >
 		HistoryList* history = ext.get(channel);
 		if (history)
 		{
-			// Shrink the list if the new line number limit is lower than the old one
-			if (len < history->lines.size())
-				history->lines.erase(history->lines.begin(), history->lines.begin() + (history->lines.size() - len));
-
 			history->maxlen = len;
 			history->maxtime = time;
 			history->param = parameter;
+
+			// Shrink the list if the new limits are lower than the old ones
+			history->Prune(maxbytes);
 		}
 		else
 		{
-			ext.set(channel, new HistoryList(len, time, parameter));
+			// Continue from the stored history if there is one, e.g. after a restart.
+			history = new HistoryList(len, time, parameter);
+			if (store)
+				store->Load(channel, history);
+			history->Prune(maxbytes);
+			ext.set(channel, history);
 		}
 		return MODEACTION_ALLOW;
 	}
 
+	void OnUnset(User* source, Channel* channel) CXX11_OVERRIDE
+	{
+		if (!store)
+			return;
+
+		// A user removing the mode doesn't want the history anymore so don't keep it on disk either.
+		// When a server removes it, e.g. because the channel lost a TS comparison in a netburst, the
+		// log is kept so the history can be restored if the mode is set again.
+		if (IS_SERVER(source))
+			store->CloseLog(channel);
+		else
+			store->RemoveLog(channel);
+	}
+
 	void SerializeParam(Channel* chan, const HistoryList* history, std::string& out)
 	{
 		out.append(history->param);
@@ -118,6 +790,65 @@ class ModuleChanHistory
 	IRCv3::Batch::Batch batch;
 	IRCv3::ServerTime::API servertimemanager;
 
+	/** The maximum number of serialized copies of the history kept per channel. */
+	static const size_t MaxSerialized = 4;
+
+	/** Get the history of a channel serialized for a user, serializing lines added since the last
+	 * replay to users of the same kind. The lines are serialized with the batch tag so users who get
+	 * a different batch reference tag use a separate copy. As the reference tag is only different
+	 * when another batch is running at the same time this rarely happens.
+	 * @param list The history of the channel.
+	 * @param chan The channel.
+	 * @param user The user who joined.
+	 * @return The serialized history.
+	 */
+	SerializedHistory& GetSerialized(HistoryList* list, Channel* chan, LocalUser* user)
+	{
+		// Users who get the probe in the same form get every history line in the same form. This also
+		// sends the batch start message to the user if they get the batch tag.
+		ClientProtocol::Messages::Privmsg probemsg(ClientProtocol::Messages::Privmsg::nocopy, ServerInstance->Config->ServerName, chan, "");
+		if (servertimemanager)
+			servertimemanager->Set(probemsg, 0);
+		batch.AddToBatch(probemsg);
+		const ClientProtocol::SerializedMessage& probe = user->serializer->SerializeForUser(user, probemsg);
+
+		std::list<SerializedHistory>::iterator it = list->serialized.begin();
+		while ((it != list->serialized.end()) && ((it->serializer != user->serializer) || (it->probe != probe)))
+			++it;
+
+		if (it == list->serialized.end())
+		{
+			list->serialized.push_front(SerializedHistory(user->serializer, probe, list->firstseq));
+			if (list->serialized.size() > MaxSerialized)
+				list->serialized.pop_back();
+		}
+		else
+		{
+			list->serialized.splice(list->serialized.begin(), list->serialized, it);
+		}
+
+		// Drop the lines which were pruned from the history and serialize the new ones.
+		SerializedHistory& ser = list->serialized.front();
+		while ((!ser.lines.empty()) && (ser.firstseq < list->firstseq))
+		{
+			ser.lines.pop_front();
+			ser.firstseq++;
+		}
+		if (ser.lines.empty())
+			ser.firstseq = list->firstseq;
+
+		for (size_t i = ser.firstseq - list->firstseq + ser.lines.size(); i < list->lines.size(); ++i)
+		{
+			const HistoryItem& item = list->lines[i];
+			ClientProtocol::Messages::Privmsg msg(ClientProtocol::Messages::Privmsg::nocopy, item.sourcemask, chan, item.text);
+			if (servertimemanager)
+				servertimemanager->Set(msg, item.ts);
+			batch.AddToBatch(msg);
+			ser.lines.push_back(user->serializer->SerializeForUser(user, msg));
+		}
+		return ser;
+	}
+
  public:
 	ModuleChanHistory()
 		: ServerEventListener(this)
@@ -130,12 +861,35 @@ class ModuleChanHistory
 	{
 	}
 
+	~ModuleChanHistory()
+	{
+		delete m.store;
+	}
+
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("chanhistory");
+		const std::string storage = tag->getString("storage");
+		const unsigned long keep = tag->getDuration("keep", 86400, 3600);
+#ifdef _WIN32
+		if (!storage.empty())
+			throw ModuleException("<chanhistory:storage> is not supported on Windows, at " + tag->getTagLocation());
+#endif
+
 		m.maxlines = tag->getUInt("maxlines", 50, 1);
+		m.maxbytes = tag->getUInt("maxbytes", 64 * 1024, 1024);
 		sendnotice = tag->getBool("notice", true);
 		dobots = tag->getBool("bots", true);
+
+		const std::string storagedir = (storage.empty() ? storage : ServerInstance->Config->Paths.PrependData(storage));
+		if ((m.store) && ((m.store->GetDirectory() != storagedir) || (m.store->GetKeep() != keep)))
+		{
+			delete m.store;
+			m.store = NULL;
+		}
+
+		if ((!m.store) && (!storagedir.empty()))
+			m.store = new HistoryStore(storagedir, keep);
 	}
 
 	ModResult OnBroadcastMessage(Channel* channel, const Server* server) CXX11_OVERRIDE
@@ -151,9 +905,11 @@ class ModuleChanHistory
 			HistoryList* list = m.ext.get(c);
 			if (list)
 			{
-				list->lines.push_back(HistoryItem(user, details.text));
-				if (list->lines.size() > list->maxlen)
-					list->lines.pop_front();
+				list->Add(HistoryItem(user, details.text));
+				list->Prune(m.maxbytes);
+
+				if (m.store)
+					m.store->Append(c, list->lines.back());
 			}
 		}
 	}
@@ -170,9 +926,9 @@ class ModuleChanHistory
 		HistoryList* list = m.ext.get(memb->chan);
 		if (!list)
 			return;
-		time_t mintime = 0;
-		if (list->maxtime)
-			mintime = ServerInstance->Time() - list->maxtime;
+
+		// Remove the lines which are too old to be replayed.
+		list->Prune(m.maxbytes);
 
 		if ((sendnotice) && (!batchcap.get(localuser)))
 		{
@@ -188,11 +944,16 @@ class ModuleChanHistory
 			batch.GetBatchStartMessage().PushParamRef(memb->chan->name);
 		}
 
-		for(std::deque<HistoryItem>::iterator i = list->lines.begin(); i != list->lines.end(); ++i)
+		if (list->lines.empty())
 		{
-			const HistoryItem& item = *i;
-			if (item.ts >= mintime)
+			// Nothing to replay.
+		}
+		else if ((ServerInstance->GetRFCEvents().privmsg.HasSubscribers()) || (ServerInstance->Modules->HasEventHandlers(I_OnUserWrite)))
+		{
+			// Modules may alter or block the messages per user so build them for this user only.
+			for (std::deque<HistoryItem>::iterator i = list->lines.begin(); i != list->lines.end(); ++i)
 			{
+				const HistoryItem& item = *i;
 				ClientProtocol::Messages::Privmsg msg(ClientProtocol::Messages::Privmsg::nocopy, item.sourcemask, memb->chan, item.text);
 				if (servertimemanager)
 					servertimemanager->Set(msg, item.ts);
@@ -200,11 +961,45 @@ class ModuleChanHistory
 				localuser->Send(ServerInstance->GetRFCEvents().privmsg, msg);
 			}
 		}
+		else
+		{
+			// Send the lines as they were serialized for earlier users of the same kind.
+			const SerializedHistory& ser = GetSerialized(list, memb->chan, localuser);
+			for (std::deque<ClientProtocol::SerializedMessage>::const_iterator i = ser.lines.begin(); i != ser.lines.end(); ++i)
+				localuser->Write(*i);
+		}
 
 		if (batchmanager)
 			batchmanager->End(batch);
 	}
 
+	void OnChannelDelete(Channel* chan) CXX11_OVERRIDE
+	{
+		// The channel is gone so its history is not needed anymore. Permanent channels are not
+		// deleted so their history is kept across restarts.
+		if ((m.store) && (chan->IsModeSet(m)))
+			m.store->RemoveLog(chan);
+	}
+
+	void OnUnloadModule(Module* mod) CXX11_OVERRIDE
+	{
+		if (mod == this)
+		{
+			// Close the logs before the mode is removed from every channel so they are kept.
+			delete m.store;
+			m.store = NULL;
+		}
+
+		// The serializer of the module may be among the ones used for the serialized histories.
+		const chan_hash& chans = ServerInstance->GetChans();
+		for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
+		{
+			HistoryList* list = m.ext.get(i->second);
+			if (list)
+				list->serialized.clear();
+		}
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Provides channel history replayed on join", VF_VENDOR);
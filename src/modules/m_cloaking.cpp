@@ -41,11 +41,20 @@ static const char base32[] = "0123456789abcdefghijklmnopqrstuv";
 // The minimum length of a cloak key.
 static const size_t minkeylen = 30;
 
+// The maximum number of cloak lists which are remembered for reconnecting users.
+static const size_t maxcachesize = 4096;
+
+// The number of users who are given new cloaks each second after the cloak config changes.
+static const size_t recloakbatchsize = 100;
+
 struct CloakInfo
 {
 	// The method used for cloaking users.
 	CloakMode mode;
 
+	// Whether segments are hashed with HMAC-SHA256 rather than the 2.0 MD5 method.
+	bool hmac;
+
 	// The number of parts of the hostname shown when using half cloaking.
 	unsigned int domainparts;
 
@@ -58,18 +67,89 @@ struct CloakInfo
 	// The suffix for IP cloaks (e.g. .IP).
 	std::string suffix;
 
-	CloakInfo(CloakMode Mode, const std::string& Key, const std::string& Prefix, const std::string& Suffix, unsigned int DomainParts = 0)
+	CloakInfo(CloakMode Mode, bool Hmac, const std::string& Key, const std::string& Prefix, const std::string& Suffix, unsigned int DomainParts = 0)
 		: mode(Mode)
+		, hmac(Hmac)
 		, domainparts(DomainParts)
 		, key(Key)
 		, prefix(Prefix)
 		, suffix(Suffix)
 	{
 	}
+
+	bool operator==(const CloakInfo& other) const
+	{
+		return mode == other.mode && hmac == other.hmac && domainparts == other.domainparts
+			&& key == other.key && prefix == other.prefix && suffix == other.suffix;
+	}
 };
 
 typedef std::vector<std::string> CloakList;
 
+/** Remembers the cloaks generated for recently seen users so that users who reconnect from
+ * the same address don't need to be hashed again. The least recently used entry is dropped
+ * when the cache is full.
+ */
+class CloakCache
+{
+	typedef std::list<std::pair<std::string, CloakList> > EntryList;
+	typedef TR1NS::unordered_map<std::string, EntryList::iterator> EntryMap;
+
+	/** The cached cloaks ordered from most to least recently used. */
+	EntryList entries;
+
+	/** The cached cloaks indexed by their key. */
+	EntryMap index;
+
+ public:
+	/** Builds the key which the cloaks for a user are cached under. */
+	static std::string MakeKey(const std::string& ip, const std::string& host)
+	{
+		return ip + ' ' + host;
+	}
+
+	/** Retrieves the cloaks cached under a key.
+	 * @return The cloaks or NULL if there are none cached.
+	 */
+	const CloakList* Get(const std::string& key)
+	{
+		EntryMap::iterator it = index.find(key);
+		if (it == index.end())
+			return NULL;
+
+		entries.splice(entries.begin(), entries, it->second);
+		return &it->second->second;
+	}
+
+	/** Caches the cloaks for a key, dropping the least recently used entry if full. */
+	void Set(const std::string& key, const CloakList& cloaklist)
+	{
+		EntryMap::iterator it = index.find(key);
+		if (it != index.end())
+		{
+			it->second->second = cloaklist;
+			entries.splice(entries.begin(), entries, it->second);
+			return;
+		}
+
+		if (index.size() >= maxcachesize)
+		{
+			index.erase(entries.back().first);
+			entries.pop_back();
+		}
+
+		entries.push_front(std::make_pair(key, cloaklist));
+		index[key] = entries.begin();
+	}
+
+	/** Removes all cached cloaks. */
+	void Clear()
+	{
+		entries.clear();
+		index.clear();
+	}
+};
+
 /** Handles user mode +x
  */
 class CloakUser : public ModeHandler
@@ -174,6 +254,45 @@ class CommandCloak : public Command
 	CmdResult Handle(User* user, const Params& parameters) CXX11_OVERRIDE;
 };
 
+class ModuleCloaking;
+
+/** Gives existing users new cloaks a batch at a time after the cloak config changes so
+ * that rehashing a server with many users does not stall it.
+ */
+class RecloakTimer : public Timer
+{
+	ModuleCloaking* const mod;
+
+	/** The UUIDs of the users who still need to be given new cloaks. */
+	std::deque<std::string> pending;
+
+ public:
+	RecloakTimer(ModuleCloaking* Mod)
+		: Timer(1, true)
+		, mod(Mod)
+	{
+	}
+
+	/** Queues every local user to be given new cloaks. */
+	void Start()
+	{
+		const bool running = !pending.empty();
+		pending.clear();
+
+		const UserManager::LocalList& users = ServerInstance->Users.GetLocalUsers();
+		for (UserManager::LocalList::const_iterator i = users.begin(); i != users.end(); ++i)
+			pending.push_back((*i)->uuid);
+
+		if (!running && !pending.empty())
+		{
+			SetTrigger(ServerInstance->Time() + GetInterval());
+			ServerInstance->Timers.AddTimer(this);
+		}
+	}
+
+	bool Tick(time_t) CXX11_OVERRIDE;
+};
+
 class ModuleCloaking : public Module
 {
  public:
@@ -181,11 +300,16 @@ class ModuleCloaking : public Module
 	CommandCloak ck;
 	std::vector<CloakInfo> cloaks;
 	dynamic_reference<HashProvider> Hash;
+	dynamic_reference<HashProvider> HMACHash;
+	CloakCache cache;
+	RecloakTimer recloaker;
 
 	ModuleCloaking()
 		: cu(this)
 		, ck(this)
 		, Hash(this, "hash/md5")
+		, HMACHash(this, "hash/sha256")
+		, recloaker(this)
 	{
 	}
 
@@ -243,6 +367,19 @@ class ModuleCloaking : public Module
 	 */
 	std::string SegmentCloak(const CloakInfo& info, const std::string& item, char id, size_t len)
 	{
+		if (info.hmac)
+		{
+			std::string input;
+			input.reserve(1 + item.length());
+			input.append(1, id);
+			input.append(item);
+
+			std::string rv = HMACHash->hmac(info.key, input).substr(0, len);
+			for (size_t i = 0; i < len; i++)
+				rv[i] = base32[rv[i] & 0x1F];
+			return rv;
+		}
+
 		std::string input;
 		input.reserve(info.key.length() + 3 + item.length());
 		input.append(1, id);
@@ -378,10 +515,21 @@ class ModuleCloaking : public Module
 		cu.active = false;
 	}
 
+	/** Determines whether the hash providers needed by every configured cloak method are available. */
+	bool CanCloak()
+	{
+		for (std::vector<CloakInfo>::const_iterator iter = cloaks.begin(); iter != cloaks.end(); ++iter)
+		{
+			if (!(iter->hmac ? HMACHash : Hash))
+				return false;
+		}
+		return true;
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		std::string testcloak = "broken";
-		if (Hash && !cloaks.empty())
+		if (!cloaks.empty() && (cloaks.front().hmac ? HMACHash : Hash))
 		{
 			const CloakInfo& info = cloaks.front();
 			switch (info.mode)
@@ -424,22 +572,62 @@ class ModuleCloaking : public Module
 			if (i == tags.first && key.length() < minkeylen)
 				throw ModuleException("Your cloaking key is not secure. It should be at least " + ConvToStr(minkeylen) + " characters long, at " + tag->getTagLocation());
 
-			const std::string mode = tag->getString("mode");
+			std::string mode = tag->getString("mode");
 			const std::string prefix = tag->getString("prefix");
 			const std::string suffix = tag->getString("suffix", ".IP");
+
+			const bool hmac = stdalgo::string::equalsci(mode.substr(0, 5), "hmac-");
+			if (hmac)
+				mode.erase(0, 5);
+
 			if (stdalgo::string::equalsci(mode, "half"))
 			{
 				unsigned int domainparts = tag->getUInt("domainparts", 3, 1, 10);
-				newcloaks.push_back(CloakInfo(MODE_HALF_CLOAK, key, prefix, suffix, domainparts));
+				newcloaks.push_back(CloakInfo(MODE_HALF_CLOAK, hmac, key, prefix, suffix, domainparts));
 			}
 			else if (stdalgo::string::equalsci(mode, "full"))
-				newcloaks.push_back(CloakInfo(MODE_OPAQUE, key, prefix, suffix));
+				newcloaks.push_back(CloakInfo(MODE_OPAQUE, hmac, key, prefix, suffix));
 			else
-				throw ModuleException(mode + " is an invalid value for <cloak:mode>; acceptable values are 'half' and 'full', at " + tag->getTagLocation());
+				throw ModuleException(tag->getString("mode") + " is an invalid value for <cloak:mode>; acceptable values are 'half', 'full', 'hmac-half' and 'hmac-full', at " + tag->getTagLocation());
+
+			// When the server is starting the hash modules may be loaded but not initialised yet.
+			const char* const hashmod = (hmac ? "sha256" : "md5");
+			if ((!(hmac ? HMACHash : Hash)) && (!ServerInstance->Modules->Find(std::string("m_") + hashmod + ".so")))
+				throw ModuleException(tag->getString("mode") + " cloaking requires the " + hashmod + " module to be loaded, at " + tag->getTagLocation());
 		}
 
+		// If nothing has changed then the existing cloaks are still valid.
+		if (newcloaks == cloaks)
+			return;
+
 		// The cloak configuration was valid so we can apply it.
+		const bool recloak = !cloaks.empty();
 		cloaks.swap(newcloaks);
+		cache.Clear();
+		if (recloak)
+			recloaker.Start();
+	}
+
+	/** Replaces the cloaks of a user with ones generated from the current config. */
+	void Recloak(LocalUser* user)
+	{
+		// Keep the old cloaks if new ones can't be generated.
+		if ((!cu.ext.get(user)) || (!CanCloak()))
+			return;
+
+		cu.ext.unset(user);
+		if (user->registered != REG_ALL)
+			return;
+
+		OnUserConnect(user);
+		CloakList* cloaklist = cu.ext.get(user);
+		if (user->IsModeSet(cu) && cloaklist && !cloaklist->empty())
+		{
+			// Stop OnChangeHost from removing the mode as the user is still cloaked.
+			cu.active = true;
+			user->ChangeDisplayedHost(cloaklist->front());
+			cu.active = false;
+		}
 	}
 
 	std::string GenCloak(const CloakInfo& info, const irc::sockets::sockaddrs& ip, const std::string& ipstr, const std::string& host)
@@ -477,11 +665,9 @@ class ModuleCloaking : public Module
 		OnUserConnect(user);
 
 		// If a user is using a cloak then update it.
-		if (user->IsModeSet(cu))
-		{
-			CloakList* cloaklist = cu.ext.get(user);
+		CloakList* cloaklist = cu.ext.get(user);
+		if ((user->IsModeSet(cu)) && (cloaklist) && (!cloaklist->empty()))
 			user->ChangeDisplayedHost(cloaklist->front());
-		}
 	}
 
 	void OnUserConnect(LocalUser* dest) CXX11_OVERRIDE
@@ -493,16 +679,46 @@ class ModuleCloaking : public Module
 		if (dest->client_sa.family() != AF_INET && dest->client_sa.family() != AF_INET6)
 			return;
 
+		// The hash module may have been unloaded since the config was read.
+		if (!CanCloak())
+			return;
+
+		const std::string key = CloakCache::MakeKey(dest->GetIPString(), dest->GetRealHost());
+		const CloakList* cached = cache.Get(key);
+		if (cached)
+		{
+			cu.ext.set(dest, *cached);
+			return;
+		}
+
 		CloakList cloaklist;
 		for (std::vector<CloakInfo>::const_iterator iter = cloaks.begin(); iter != cloaks.end(); ++iter)
 			cloaklist.push_back(GenCloak(*iter, dest->client_sa, dest->GetIPString(), dest->GetRealHost()));
 		cu.ext.set(dest, cloaklist);
+		cache.Set(key, cloaklist);
 	}
 };
 
+bool RecloakTimer::Tick(time_t)
+{
+	for (size_t count = 0; count < recloakbatchsize && !pending.empty(); ++count)
+	{
+		LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(pending.front()));
+		pending.pop_front();
+		if (user && !user->quitting)
+			mod->Recloak(user);
+	}
+	return !pending.empty();
+}
+
 CmdResult CommandCloak::Handle(User* user, const Params& parameters)
 {
 	ModuleCloaking* mod = (ModuleCloaking*)(Module*)creator;
+	if (!mod->CanCloak())
+	{
+		user->WriteNotice("*** Cloaking is unavailable as the hash module it needs is not loaded");
+		return CMD_FAILURE;
+	}
 
 	// If we're cloaking an IP address we pass it in the IP field too.
 	irc::sockets::sockaddrs sa;
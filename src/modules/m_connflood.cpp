@@ -20,21 +20,22 @@
 
 
 #include "inspircd.h"
+#include "ratelimit.h"
 
 class ModuleConnFlood : public Module
 {
 	unsigned int seconds;
 	unsigned int timeout;
 	unsigned int boot_wait;
-	unsigned int conns;
 	unsigned int maxconns;
 	bool throttled;
-	time_t first;
+	time_t unthrottle;
+	RateLimit::Bucket bucket;
 	std::string quitmsg;
 
 public:
 	ModuleConnFlood()
-		: conns(0), throttled(false)
+		: throttled(false), unthrottle(0)
 	{
 	}
 
@@ -49,14 +50,12 @@ public:
 		ConfigTag* tag = ServerInstance->Config->ConfValue("connflood");
 		/* throttle configuration */
 		seconds = tag->getDuration("period", tag->getDuration("seconds", 30));
-		maxconns = tag->getUInt("maxconns", 3);
+		maxconns = tag->getUInt("maxconns", 3, 1);
 		timeout = tag->getDuration("timeout", 30);
 		quitmsg = tag->getString("quitmsg");
 
 		/* seconds to wait when the server just booted */
 		boot_wait = tag->getDuration("bootwait", 10);
-
-		first = ServerInstance->Time();
 	}
 
 	ModResult OnUserRegister(LocalUser* user) CXX11_OVERRIDE
@@ -69,18 +68,13 @@ public:
 		if ((ServerInstance->startup_time + boot_wait) > next)
 			return MOD_RES_PASSTHRU;
 
-		/* time difference between first and latest connection */
-		time_t tdiff = next - first;
-
-		/* increase connection count */
-		conns++;
-
 		if (throttled)
 		{
-			if (tdiff > seconds + timeout)
+			if (next > unthrottle)
 			{
 				/* expire throttle */
 				throttled = false;
+				bucket.Reset();
 				ServerInstance->SNO->WriteGlobalSno('a', "Connection throttle deactivated");
 				return MOD_RES_PASSTHRU;
 			}
@@ -89,20 +83,14 @@ public:
 			return MOD_RES_DENY;
 		}
 
-		if (tdiff <= seconds)
+		/* the connection which empties the bucket is the one that activates the throttle */
+		if (!bucket.Take(maxconns - 1, seconds, RateLimit::Now()))
 		{
-			if (conns >= maxconns)
-			{
-				throttled = true;
-				ServerInstance->SNO->WriteGlobalSno('a', "Connection throttle activated");
-				ServerInstance->Users->QuitUser(user, quitmsg);
-				return MOD_RES_DENY;
-			}
-		}
-		else
-		{
-			conns = 1;
-			first = next;
+			throttled = true;
+			unthrottle = next + timeout;
+			ServerInstance->SNO->WriteGlobalSno('a', "Connection throttle activated");
+			ServerInstance->Users->QuitUser(user, quitmsg);
+			return MOD_RES_DENY;
 		}
 		return MOD_RES_PASSTHRU;
 	}
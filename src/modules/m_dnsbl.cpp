@@ -38,50 +38,297 @@ class DNSBLConfEntry : public refcountbase
 		unsigned long duration;
 		unsigned int bitmask;
 		unsigned char records[256];
-		unsigned long stats_hits, stats_misses;
-		DNSBLConfEntry(): type(A_BITMASK),duration(86400),bitmask(0),stats_hits(0), stats_misses(0) {}
+		unsigned long positivecache, negativecache;
+		unsigned long stats_hits, stats_misses, stats_cached, stats_lookups;
+		uint64_t stats_time;
+		DNSBLConfEntry(): type(A_BITMASK),duration(86400),bitmask(0),positivecache(0),negativecache(0),stats_hits(0), stats_misses(0), stats_cached(0), stats_lookups(0), stats_time(0) {}
 };
 
+typedef std::vector<reference<DNSBLConfEntry> > DNSBLConfList;
+
+/** The blacklist checks of a connecting user which have not finished yet
+ */
+class DNSBLChecks
+{
+ public:
+	/* Identifies these checks to the lookups started for them */
+	const unsigned long serial;
+
+	/* The user's IP in the form it is looked up in */
+	const std::string reversedip;
+
+	/* The blacklists to check, as they were configured when the checks started */
+	const DNSBLConfList entries;
+
+	/* The index of the next blacklist to check */
+	size_t next;
+
+	/* The number of lookups in progress */
+	unsigned int active;
+
+	/* Whether more lookups are being started */
+	bool running;
+
+	DNSBLChecks(unsigned long id, const std::string& ip, const DNSBLConfList& lists)
+		: serial(id)
+		, reversedip(ip)
+		, entries(lists)
+		, next(0)
+		, active(0)
+		, running(false)
+	{
+	}
+};
+
+static uint64_t GetTimeMS()
+{
+	return static_cast<uint64_t>(ServerInstance->Time()) * 1000 + ServerInstance->Time_ns() / 1000000;
+}
+
+class ModuleDNSBL;
 
 /** Resolver for CGI:IRC hostnames encoded in ident/real name
  */
 class DNSBLResolver : public DNS::Request
 {
+	ModuleDNSBL* const mod;
 	std::string theiruid;
-	LocalStringExt& nameExt;
-	LocalIntExt& countExt;
+	const unsigned long serial;
+	const uint64_t started;
 	reference<DNSBLConfEntry> ConfEntry;
 
  public:
 
-	DNSBLResolver(DNS::Manager *mgr, Module *me, LocalStringExt& match, LocalIntExt& ctr, const std::string &hostname, LocalUser* u, reference<DNSBLConfEntry> conf)
-		: DNS::Request(mgr, me, hostname, DNS::QUERY_A, true), theiruid(u->uuid), nameExt(match), countExt(ctr), ConfEntry(conf)
+	DNSBLResolver(DNS::Manager *mgr, ModuleDNSBL *me, const std::string &hostname, LocalUser* u, unsigned long checkid, reference<DNSBLConfEntry> conf);
+
+	/* Note: This may be called multiple times for multiple A record results */
+	void OnLookupComplete(const DNS::Query *r) CXX11_OVERRIDE;
+
+	void OnError(const DNS::Query *q) CXX11_OVERRIDE;
+};
+
+
+class ModuleDNSBL : public Module, public Stats::EventListener
+{
+	/** A blacklist result which is remembered for later users from the same IP
+	 */
+	struct CachedResult
+	{
+		/* The A record returned by the blacklist, empty if the IP is not listed */
+		std::string result;
+		time_t expires;
+	};
+	typedef TR1NS::unordered_map<std::string, CachedResult> ResultCache;
+
+	DNSBLConfList DNSBLConfEntries;
+	dynamic_reference<DNS::Manager> DNS;
+	LocalStringExt nameExt;
+	SimpleExtItem<DNSBLChecks> checksExt;
+	ResultCache cache;
+	size_t maxcachesize;
+	unsigned int concurrency;
+	unsigned long nextserial;
+
+	/*
+	 *	Convert a string to EnumBanaction
+	 */
+	DNSBLConfEntry::EnumBanaction str2banaction(const std::string &action)
+	{
+		if(action.compare("KILL")==0)
+			return DNSBLConfEntry::I_KILL;
+		if(action.compare("KLINE")==0)
+			return DNSBLConfEntry::I_KLINE;
+		if(action.compare("ZLINE")==0)
+			return DNSBLConfEntry::I_ZLINE;
+		if(action.compare("GLINE")==0)
+			return DNSBLConfEntry::I_GLINE;
+		if(action.compare("MARK")==0)
+			return DNSBLConfEntry::I_MARK;
+
+		return DNSBLConfEntry::I_UNKNOWN;
+	}
+ public:
+	ModuleDNSBL()
+		: Stats::EventListener(this)
+		, DNS(this, "DNS")
+		, nameExt("dnsbl_match", ExtensionItem::EXT_USER, this)
+		, checksExt("dnsbl_pending", ExtensionItem::EXT_USER, this)
+		, maxcachesize(0)
+		, concurrency(0)
+		, nextserial(0)
 	{
 	}
 
-	/* Note: This may be called multiple times for multiple A record results */
-	void OnLookupComplete(const DNS::Query *r) CXX11_OVERRIDE
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->SNO->EnableSnomask('d', "DNSBL");
+	}
+
+	Version GetVersion() CXX11_OVERRIDE
+	{
+		return Version("Provides handling of DNS blacklists", VF_VENDOR);
+	}
+
+	/** Fill our conf vector with data
+	 */
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		DNSBLConfList newentries;
+
+		ConfigTagList dnsbls = ServerInstance->Config->ConfTags("dnsbl");
+		for(ConfigIter i = dnsbls.first; i != dnsbls.second; ++i)
+		{
+			ConfigTag* tag = i->second;
+			reference<DNSBLConfEntry> e = new DNSBLConfEntry();
+
+			e->name = tag->getString("name");
+			e->ident = tag->getString("ident");
+			e->host = tag->getString("host");
+			e->reason = tag->getString("reason");
+			e->domain = tag->getString("domain");
+
+			if (stdalgo::string::equalsci(tag->getString("type"), "bitmask"))
+			{
+				e->type = DNSBLConfEntry::A_BITMASK;
+				e->bitmask = tag->getUInt("bitmask", 0, 0, UINT_MAX);
+			}
+			else
+			{
+				memset(e->records, 0, sizeof(e->records));
+				e->type = DNSBLConfEntry::A_RECORD;
+				irc::portparser portrange(tag->getString("records"), false);
+				long item = -1;
+				while ((item = portrange.GetToken()))
+					e->records[item] = 1;
+			}
+
+			e->banaction = str2banaction(tag->getString("action"));
+			e->duration = tag->getDuration("duration", 60, 1);
+			e->positivecache = tag->getDuration("positivecache", 3600);
+			e->negativecache = tag->getDuration("negativecache", 300);
+
+			/* Use portparser for record replies */
+
+			/* yeah, logic here is a little messy */
+			if ((e->bitmask <= 0) && (DNSBLConfEntry::A_BITMASK == e->type))
+			{
+				throw ModuleException("Invalid <dnsbl:bitmask> at " + tag->getTagLocation());
+			}
+			else if (e->name.empty())
+			{
+				throw ModuleException("Empty <dnsbl:name> at " + tag->getTagLocation());
+			}
+			else if (e->domain.empty())
+			{
+				throw ModuleException("Empty <dnsbl:domain> at " + tag->getTagLocation());
+			}
+			else if (e->banaction == DNSBLConfEntry::I_UNKNOWN)
+			{
+				throw ModuleException("Unknown <dnsbl:action> at " + tag->getTagLocation());
+			}
+			else
+			{
+				if (e->reason.empty())
+				{
+					std::string location = tag->getTagLocation();
+					ServerInstance->SNO->WriteGlobalSno('d', "DNSBL(%s): empty reason, using defaults", location.c_str());
+					e->reason = "Your IP has been blacklisted.";
+				}
+
+				/* add it, all is ok */
+				newentries.push_back(e);
+			}
+		}
+
+		ConfigTag* tag = ServerInstance->Config->ConfValue("dnsblconfig");
+		concurrency = tag->getUInt("concurrency", 4);
+		maxcachesize = tag->getUInt("cachesize", 10000);
+
+		DNSBLConfEntries.swap(newentries);
+
+		// Cached results are the replies of the blacklist domains so they stay valid
+		// unless the domain they were looked up in is no longer used.
+		for (ResultCache::iterator i = cache.begin(); i != cache.end(); )
+		{
+			if (IsCachedForEntry(i->first))
+				++i;
+			else
+				cache.erase(i++);
+		}
+	}
+
+	/** Check whether a cached lookup was made in the domain of a configured blacklist
+	 * @param hostname The name which was looked up
+	 * @return True if a configured blacklist uses the domain of the name, false otherwise
+	 */
+	bool IsCachedForEntry(const std::string& hostname) const
+	{
+		for (DNSBLConfList::const_iterator i = DNSBLConfEntries.begin(); i != DNSBLConfEntries.end(); ++i)
+		{
+			const std::string& domain = (*i)->domain;
+			if ((hostname.length() > domain.length()) && (hostname[hostname.length() - domain.length() - 1] == '.')
+				&& (!hostname.compare(hostname.length() - domain.length(), std::string::npos, domain)))
+				return true;
+		}
+		return false;
+	}
+
+	/** Find a user whose blacklist checks a lookup was started for
+	 * @return The user or NULL if they are gone or their checks have ended.
+	 */
+	LocalUser* FindChecking(const std::string& uuid, unsigned long serial)
+	{
+		User* u = ServerInstance->FindUUID(uuid);
+		LocalUser* user = u ? IS_LOCAL(u) : NULL;
+		if (!user)
+			return NULL;
+
+		DNSBLChecks* checks = checksExt.get(user);
+		if (!checks || checks->serial != serial)
+			return NULL;
+
+		return user;
+	}
+
+	/** Remember the result of a blacklist lookup
+	 * @param hostname The name which was looked up
+	 * @param ConfEntry The blacklist which was checked
+	 * @param result The A record returned, empty if the IP is not listed
+	 */
+	void CacheResult(const std::string& hostname, const reference<DNSBLConfEntry>& ConfEntry, const std::string& result)
 	{
-		/* Check the user still exists */
-		LocalUser* them = (LocalUser*)ServerInstance->FindUUID(theiruid);
-		if (!them)
+		const unsigned long ttl = result.empty() ? ConfEntry->negativecache : ConfEntry->positivecache;
+		if (!ttl || cache.size() >= maxcachesize)
 			return;
 
-		const DNS::ResourceRecord* const ans_record = r->FindAnswerOfType(DNS::QUERY_A);
-		if (!ans_record)
+		CachedResult& cached = cache[hostname];
+		cached.result = result;
+		cached.expires = ServerInstance->Time() + ttl;
+	}
+
+	/** Act on the result of checking a user against a blacklist
+	 * @param them The user who was checked
+	 * @param ConfEntry The blacklist they were checked against
+	 * @param result The A record returned, empty if they are not listed
+	 */
+	void ApplyResult(LocalUser* them, const reference<DNSBLConfEntry>& ConfEntry, const std::string& result)
+	{
+		if (them->quitting)
 			return;
 
-		// All replies should be in 127.0.0.0/8
-		if (ans_record->rdata.compare(0, 4, "127.") != 0)
+		if (result.empty())
 		{
-			ServerInstance->SNO->WriteGlobalSno('d', "DNSBL: %s returned address outside of acceptable subnet 127.0.0.0/8: %s", ConfEntry->domain.c_str(), ans_record->rdata.c_str());
 			ConfEntry->stats_misses++;
 			return;
 		}
 
-		int i = countExt.get(them);
-		if (i)
-			countExt.set(them, i - 1);
+		// All replies should be in 127.0.0.0/8
+		if (result.compare(0, 4, "127.") != 0)
+		{
+			ServerInstance->SNO->WriteGlobalSno('d', "DNSBL: %s returned address outside of acceptable subnet 127.0.0.0/8: %s", ConfEntry->domain.c_str(), result.c_str());
+			ConfEntry->stats_misses++;
+			return;
+		}
 
 		// Now we calculate the bitmask: 256*(256*(256*a+b)+c)+d
 
@@ -89,7 +336,7 @@ class DNSBLResolver : public DNS::Request
 		bool match = false;
 		in_addr resultip;
 
-		inet_pton(AF_INET, ans_record->rdata.c_str(), &resultip);
+		inet_pton(AF_INET, result.c_str(), &resultip);
 
 		switch (ConfEntry->type)
 		{
@@ -207,143 +454,78 @@ class DNSBLResolver : public DNS::Request
 			ConfEntry->stats_misses++;
 	}
 
-	void OnError(const DNS::Query *q) CXX11_OVERRIDE
+	/** Start checking a user against blacklists until the lookup budget is used up
+	 * and end their checks once there is nothing left to check.
+	 */
+	void RunChecks(LocalUser* user)
 	{
-		LocalUser* them = (LocalUser*)ServerInstance->FindUUID(theiruid);
-		if (!them)
+		DNSBLChecks* checks = checksExt.get(user);
+		if (!checks || checks->running)
 			return;
 
-		int i = countExt.get(them);
-		if (i)
-			countExt.set(them, i - 1);
-
-		if (q->error == DNS::ERROR_NO_RECORDS || q->error == DNS::ERROR_DOMAIN_NOT_FOUND)
+		// Lookups can complete before Process() returns so make sure that they
+		// do not start checks of their own while this is running.
+		checks->running = true;
+		while (!user->quitting && checks->next < checks->entries.size() && (!concurrency || checks->active < concurrency))
 		{
-			ConfEntry->stats_misses++;
-			return;
-		}
+			reference<DNSBLConfEntry> entry = checks->entries[checks->next++];
 
-		ServerInstance->SNO->WriteGlobalSno('d', "An error occurred whilst checking whether %s (%s) is on the '%s' DNS blacklist: %s",
-			them->GetFullRealHost().c_str(), them->GetIPString().c_str(), ConfEntry->name.c_str(), this->manager->GetErrorStr(q->error).c_str());
-	}
-};
+			// Fill hostname with a dnsbl style host (d.c.b.a.domain.tld)
+			std::string hostname = checks->reversedip + "." + entry->domain;
 
-typedef std::vector<reference<DNSBLConfEntry> > DNSBLConfList;
+			ResultCache::const_iterator cached = cache.find(hostname);
+			if (cached != cache.end() && cached->second.expires > ServerInstance->Time())
+			{
+				entry->stats_cached++;
+				ApplyResult(user, entry, cached->second.result);
+				continue;
+			}
 
-class ModuleDNSBL : public Module, public Stats::EventListener
-{
-	DNSBLConfList DNSBLConfEntries;
-	dynamic_reference<DNS::Manager> DNS;
-	LocalStringExt nameExt;
-	LocalIntExt countExt;
+			if (!DNS)
+				continue;
 
-	/*
-	 *	Convert a string to EnumBanaction
-	 */
-	DNSBLConfEntry::EnumBanaction str2banaction(const std::string &action)
-	{
-		if(action.compare("KILL")==0)
-			return DNSBLConfEntry::I_KILL;
-		if(action.compare("KLINE")==0)
-			return DNSBLConfEntry::I_KLINE;
-		if(action.compare("ZLINE")==0)
-			return DNSBLConfEntry::I_ZLINE;
-		if(action.compare("GLINE")==0)
-			return DNSBLConfEntry::I_GLINE;
-		if(action.compare("MARK")==0)
-			return DNSBLConfEntry::I_MARK;
+			/* now we'd need to fire off lookups for `hostname'. */
+			DNSBLResolver *r = new DNSBLResolver(*this->DNS, this, hostname, user, checks->serial, entry);
+			checks->active++;
+			try
+			{
+				this->DNS->Process(r);
+			}
+			catch (DNS::Exception &ex)
+			{
+				delete r;
+				checks->active--;
+				ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, ex.GetReason());
+			}
+		}
+		checks->running = false;
 
-		return DNSBLConfEntry::I_UNKNOWN;
-	}
- public:
-	ModuleDNSBL()
-		: Stats::EventListener(this)
-		, DNS(this, "DNS")
-		, nameExt("dnsbl_match", ExtensionItem::EXT_USER, this)
-		, countExt("dnsbl_pending", ExtensionItem::EXT_USER, this)
-	{
+		// Once a user has been banned the rest of the blacklists do not matter.
+		if (user->quitting || (!checks->active && checks->next == checks->entries.size()))
+			checksExt.unset(user);
 	}
 
-	void init() CXX11_OVERRIDE
+	/** Called when a lookup started by RunChecks() has finished
+	 */
+	void LookupDone(LocalUser* user)
 	{
-		ServerInstance->SNO->EnableSnomask('d', "DNSBL");
-	}
+		DNSBLChecks* checks = checksExt.get(user);
+		if (!checks)
+			return;
 
-	Version GetVersion() CXX11_OVERRIDE
-	{
-		return Version("Provides handling of DNS blacklists", VF_VENDOR);
+		checks->active--;
+		RunChecks(user);
 	}
 
-	/** Fill our conf vector with data
-	 */
-	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	void OnBackgroundTimer(time_t curtime) CXX11_OVERRIDE
 	{
-		DNSBLConfList newentries;
-
-		ConfigTagList dnsbls = ServerInstance->Config->ConfTags("dnsbl");
-		for(ConfigIter i = dnsbls.first; i != dnsbls.second; ++i)
+		for (ResultCache::iterator i = cache.begin(); i != cache.end(); )
 		{
-			ConfigTag* tag = i->second;
-			reference<DNSBLConfEntry> e = new DNSBLConfEntry();
-
-			e->name = tag->getString("name");
-			e->ident = tag->getString("ident");
-			e->host = tag->getString("host");
-			e->reason = tag->getString("reason");
-			e->domain = tag->getString("domain");
-
-			if (stdalgo::string::equalsci(tag->getString("type"), "bitmask"))
-			{
-				e->type = DNSBLConfEntry::A_BITMASK;
-				e->bitmask = tag->getUInt("bitmask", 0, 0, UINT_MAX);
-			}
-			else
-			{
-				memset(e->records, 0, sizeof(e->records));
-				e->type = DNSBLConfEntry::A_RECORD;
-				irc::portparser portrange(tag->getString("records"), false);
-				long item = -1;
-				while ((item = portrange.GetToken()))
-					e->records[item] = 1;
-			}
-
-			e->banaction = str2banaction(tag->getString("action"));
-			e->duration = tag->getDuration("duration", 60, 1);
-
-			/* Use portparser for record replies */
-
-			/* yeah, logic here is a little messy */
-			if ((e->bitmask <= 0) && (DNSBLConfEntry::A_BITMASK == e->type))
-			{
-				throw ModuleException("Invalid <dnsbl:bitmask> at " + tag->getTagLocation());
-			}
-			else if (e->name.empty())
-			{
-				throw ModuleException("Empty <dnsbl:name> at " + tag->getTagLocation());
-			}
-			else if (e->domain.empty())
-			{
-				throw ModuleException("Empty <dnsbl:domain> at " + tag->getTagLocation());
-			}
-			else if (e->banaction == DNSBLConfEntry::I_UNKNOWN)
-			{
-				throw ModuleException("Unknown <dnsbl:action> at " + tag->getTagLocation());
-			}
+			if (i->second.expires <= curtime)
+				cache.erase(i++);
 			else
-			{
-				if (e->reason.empty())
-				{
-					std::string location = tag->getTagLocation();
-					ServerInstance->SNO->WriteGlobalSno('d', "DNSBL(%s): empty reason, using defaults", location.c_str());
-					e->reason = "Your IP has been blacklisted.";
-				}
-
-				/* add it, all is ok */
-				newentries.push_back(e);
-			}
+				++i;
 		}
-
-		DNSBLConfEntries.swap(newentries);
 	}
 
 	void OnSetUserIP(LocalUser* user) CXX11_OVERRIDE
@@ -390,29 +572,8 @@ class ModuleDNSBL : public Module, public Stats::EventListener
 
 		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Reversed IP %s -> %s", user->GetIPString().c_str(), reversedip.c_str());
 
-		countExt.set(user, DNSBLConfEntries.size());
-
-		// For each DNSBL, we will run through this lookup
-		for (unsigned i = 0; i < DNSBLConfEntries.size(); ++i)
-		{
-			// Fill hostname with a dnsbl style host (d.c.b.a.domain.tld)
-			std::string hostname = reversedip + "." + DNSBLConfEntries[i]->domain;
-
-			/* now we'd need to fire off lookups for `hostname'. */
-			DNSBLResolver *r = new DNSBLResolver(*this->DNS, this, nameExt, countExt, hostname, user, DNSBLConfEntries[i]);
-			try
-			{
-				this->DNS->Process(r);
-			}
-			catch (DNS::Exception &ex)
-			{
-				delete r;
-				ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, ex.GetReason());
-			}
-
-			if (user->quitting)
-				break;
-		}
+		checksExt.set(user, new DNSBLChecks(++nextserial, reversedip, DNSBLConfEntries));
+		RunChecks(user);
 	}
 
 	ModResult OnSetConnectClass(LocalUser* user, ConnectClass* myclass) CXX11_OVERRIDE
@@ -433,7 +594,7 @@ class ModuleDNSBL : public Module, public Stats::EventListener
 
 	ModResult OnCheckReady(LocalUser *user) CXX11_OVERRIDE
 	{
-		if (countExt.get(user))
+		if (checksExt.get(user))
 			return MOD_RES_DENY;
 		return MOD_RES_PASSTHRU;
 	}
@@ -443,22 +604,73 @@ class ModuleDNSBL : public Module, public Stats::EventListener
 		if (stats.GetSymbol() != 'd')
 			return MOD_RES_PASSTHRU;
 
-		unsigned long total_hits = 0, total_misses = 0;
+		unsigned long total_hits = 0, total_misses = 0, total_cached = 0;
 
 		for (std::vector<reference<DNSBLConfEntry> >::const_iterator i = DNSBLConfEntries.begin(); i != DNSBLConfEntries.end(); ++i)
 		{
 			total_hits += (*i)->stats_hits;
 			total_misses += (*i)->stats_misses;
+			total_cached += (*i)->stats_cached;
 
+			const uint64_t average = (*i)->stats_lookups ? (*i)->stats_time / (*i)->stats_lookups : 0;
 			stats.AddRow(304, "DNSBLSTATS DNSbl \"" + (*i)->name + "\" had " +
-					ConvToStr((*i)->stats_hits) + " hits and " + ConvToStr((*i)->stats_misses) + " misses");
+					ConvToStr((*i)->stats_hits) + " hits and " + ConvToStr((*i)->stats_misses) + " misses, " +
+					ConvToStr((*i)->stats_cached) + " results were cached and " + ConvToStr((*i)->stats_lookups) +
+					" lookups took " + ConvToStr(average) + "ms on average");
 		}
 
 		stats.AddRow(304, "DNSBLSTATS Total hits: " + ConvToStr(total_hits));
 		stats.AddRow(304, "DNSBLSTATS Total misses: " + ConvToStr(total_misses));
+		stats.AddRow(304, "DNSBLSTATS Total cached results: " + ConvToStr(total_cached) + " (" + ConvToStr(cache.size()) + " in cache)");
 
 		return MOD_RES_PASSTHRU;
 	}
 };
 
+DNSBLResolver::DNSBLResolver(DNS::Manager *mgr, ModuleDNSBL *me, const std::string &hostname, LocalUser* u, unsigned long checkid, reference<DNSBLConfEntry> conf)
+	: DNS::Request(mgr, me, hostname, DNS::QUERY_A, true), mod(me), theiruid(u->uuid), serial(checkid), started(GetTimeMS()), ConfEntry(conf)
+{
+}
+
+void DNSBLResolver::OnLookupComplete(const DNS::Query *r)
+{
+	ConfEntry->stats_lookups++;
+	ConfEntry->stats_time += GetTimeMS() - started;
+
+	const DNS::ResourceRecord* const ans_record = r->FindAnswerOfType(DNS::QUERY_A);
+	const std::string result = ans_record ? ans_record->rdata : "";
+	if (result.empty() || result.compare(0, 4, "127.") == 0)
+		mod->CacheResult(this->question.name, ConfEntry, result);
+
+	/* Check the user still exists and is still waiting for this result */
+	LocalUser* them = mod->FindChecking(theiruid, serial);
+	if (!them)
+		return;
+
+	mod->ApplyResult(them, ConfEntry, result);
+	mod->LookupDone(them);
+}
+
+void DNSBLResolver::OnError(const DNS::Query *q)
+{
+	ConfEntry->stats_lookups++;
+	ConfEntry->stats_time += GetTimeMS() - started;
+
+	const bool notlisted = (q->error == DNS::ERROR_NO_RECORDS || q->error == DNS::ERROR_DOMAIN_NOT_FOUND);
+	if (notlisted)
+		mod->CacheResult(this->question.name, ConfEntry, "");
+
+	LocalUser* them = mod->FindChecking(theiruid, serial);
+	if (!them)
+		return;
+
+	if (notlisted)
+		mod->ApplyResult(them, ConfEntry, "");
+	else
+		ServerInstance->SNO->WriteGlobalSno('d', "An error occurred whilst checking whether %s (%s) is on the '%s' DNS blacklist: %s",
+			them->GetFullRealHost().c_str(), them->GetIPString().c_str(), ConfEntry->name.c_str(), this->manager->GetErrorStr(q->error).c_str());
+
+	mod->LookupDone(them);
+}
+
 MODULE_INIT(ModuleDNSBL)
@@ -26,6 +26,7 @@
 #include "modules/server.h"
 #include "modules/shun.h"
 #include "modules/stats.h"
+#include "modules/wordmatch.h"
 
 enum FilterFlags
 {
@@ -148,6 +149,379 @@ class FilterResult
 	}
 };
 
+/** Selects the filters which could match a message by searching it for a literal string
+ * which every match of a filter must contain. All of the literals are searched for in a
+ * single pass over the message so only the regexes of filters whose literal was found (or
+ * which have no literal) need to be run.
+ */
+class FilterIndex
+{
+ public:
+	enum Syntax
+	{
+		// The pattern syntax is not known so no filters are indexed.
+		SYNTAX_NONE,
+
+		// Patterns are globs which match using * and ?.
+		SYNTAX_GLOB,
+
+		// Patterns are regular expressions using the PCRE or POSIX extended syntax.
+		SYNTAX_REGEX
+	};
+
+ private:
+	enum MarkType
+	{
+		MARK_PLAIN = 1,
+		MARK_STRIPPED = 2,
+		MARK_ALL = MARK_PLAIN | MARK_STRIPPED
+	};
+
+	/** The case map which folds ASCII letters only. It is filled in before the matcher is created. */
+	struct CaseMap
+	{
+		unsigned char map[256];
+
+		CaseMap()
+		{
+			// Characters which can't be in a literal are left alone as they never match.
+			for (size_t i = 0; i < 256; ++i)
+				map[i] = Fold(i) ? Fold(i) : i;
+		}
+	} casemap;
+
+	/** The automaton which searches for the literals of the filters. */
+	WordMatch::Matcher matcher;
+
+	/** Whether each filter has a literal in the matcher. */
+	std::vector<bool> indexed;
+
+	/** Whether each filter matches against the message with formatting removed. */
+	std::vector<bool> stripcolor;
+
+	/** The generation in which each filter's literal was last found. */
+	std::vector<unsigned long> marks;
+
+	/** The generation of the current search. */
+	unsigned long generation;
+
+	/** Whether any filters match against the message with formatting removed. */
+	bool hasstripcolor;
+
+	/** Folds a character for matching or returns 0 if it can not be part of a literal. The
+	 * regex engines disagree on the case of non-letters so only ASCII letters are folded
+	 * and characters which have a case in RFC 1459 are excluded.
+	 */
+	static unsigned char Fold(unsigned char chr)
+	{
+		if (chr >= 'A' && chr <= 'Z')
+			return chr - 'A' + 'a';
+
+		if (chr < 0x20 || chr >= 0x7F)
+			return 0;
+
+		switch (chr)
+		{
+			case '[':
+			case ']':
+			case '\\':
+			case '~':
+			case '{':
+			case '}':
+			case '|':
+			case '^':
+				return 0;
+		}
+		return chr;
+	}
+
+	/** Ends the current literal run, keeping it if it is the longest one seen. */
+	static void Commit(std::string& best, std::string& current)
+	{
+		if (current.length() > best.length())
+			best.swap(current);
+		current.clear();
+	}
+
+	/** Appends a character to the current literal run. */
+	static void Append(std::string& best, std::string& current, unsigned char chr)
+	{
+		const unsigned char folded = Fold(chr);
+		if (folded)
+			current.push_back(folded);
+		else
+			Commit(best, current);
+	}
+
+	/** Skips over a bracket expression in a regex.
+	 * @param pattern The regex which contains the bracket expression.
+	 * @param pos The position after the opening bracket.
+	 * @return The position after the closing bracket or std::string::npos if it is not closed.
+	 */
+	static size_t SkipClass(const std::string& pattern, size_t pos)
+	{
+		if (pos < pattern.length() && pattern[pos] == '^')
+			pos++;
+		if (pos < pattern.length() && pattern[pos] == ']')
+			pos++;
+
+		while (pos < pattern.length())
+		{
+			const char chr = pattern[pos++];
+			if (chr == '\\')
+				pos++;
+			else if (chr == ']')
+				return pos;
+			else if (chr == '[' && pos < pattern.length() && strchr(":=.", pattern[pos]))
+			{
+				// Character classes like [:alpha:] contain a closing bracket.
+				const size_t end = pattern.find(std::string(1, pattern[pos]) + "]", pos + 1);
+				if (end == std::string::npos)
+					return end;
+				pos = end + 2;
+			}
+		}
+		return std::string::npos;
+	}
+
+	/** Skips over a group in a regex.
+	 * @param pattern The regex which contains the group.
+	 * @param pos The position after the opening parenthesis.
+	 * @return The position after the closing parenthesis or std::string::npos if it is not closed.
+	 */
+	static size_t SkipGroup(const std::string& pattern, size_t pos)
+	{
+		for (size_t depth = 1; pos < pattern.length(); )
+		{
+			const char chr = pattern[pos++];
+			if (chr == '\\')
+				pos++;
+			else if (chr == '[')
+				pos = SkipClass(pattern, pos);
+			else if (chr == '(')
+				depth++;
+			else if (chr == ')' && !--depth)
+				return pos;
+		}
+		return std::string::npos;
+	}
+
+	/** Finds the longest literal which every match of a glob pattern must contain. */
+	static std::string ExtractGlob(const std::string& pattern)
+	{
+		std::string best;
+		std::string current;
+		for (std::string::const_iterator i = pattern.begin(); i != pattern.end(); ++i)
+		{
+			if (*i == '*' || *i == '?')
+				Commit(best, current);
+			else
+				Append(best, current, *i);
+		}
+		Commit(best, current);
+		return best;
+	}
+
+	/** Finds the longest literal which every match of a regex must contain. This only
+	 * needs to understand enough of the syntax to never return something which is not
+	 * required; giving up and returning nothing is always safe.
+	 */
+	static std::string ExtractRegex(const std::string& pattern)
+	{
+		// Inline options can change how the rest of the pattern is parsed (e.g. (?x)
+		// ignores whitespace) and \Q...\E quotes metacharacters so don't try these.
+		if (pattern.find("(?") != std::string::npos || pattern.find("\\Q") != std::string::npos)
+			return std::string();
+
+		std::string best;
+		std::string current;
+		for (size_t pos = 0; pos < pattern.length(); )
+		{
+			const unsigned char chr = pattern[pos++];
+			switch (chr)
+			{
+				case '|':
+					// An alternative at the top level means nothing is required.
+					return std::string();
+
+				case '*':
+				case '?':
+				case '{':
+					// The previous atom might not be present.
+					if (!current.empty())
+						current.erase(current.length() - 1);
+					Commit(best, current);
+					if (chr == '{')
+					{
+						const size_t end = pattern.find('}', pos);
+						if (end != std::string::npos)
+							pos = end + 1;
+					}
+					break;
+
+				case '+':
+					// The previous atom is required but may be repeated.
+					Commit(best, current);
+					break;
+
+				case '(':
+					Commit(best, current);
+					pos = SkipGroup(pattern, pos);
+					if (pos == std::string::npos)
+						return std::string();
+					break;
+
+				case '[':
+					Commit(best, current);
+					pos = SkipClass(pattern, pos);
+					if (pos == std::string::npos)
+						return std::string();
+					break;
+
+				case ')':
+					return std::string();
+
+				case '.':
+				case '^':
+				case '$':
+					Commit(best, current);
+					break;
+
+				case '\\':
+				{
+					if (pos >= pattern.length())
+						return std::string();
+
+					const unsigned char escaped = pattern[pos++];
+					if (!isalnum(escaped))
+					{
+						// An escaped metacharacter is a literal.
+						Append(best, current, escaped);
+						break;
+					}
+
+					// Escapes like \x41, \p{L} and \1 have arguments which must not be
+					// mistaken for literals.
+					Commit(best, current);
+					if (!strchr("bBdDsSwWAzZGhHvVRXKnrtfea", escaped))
+					{
+						while (pos < pattern.length() && (isalnum(pattern[pos]) || strchr("{}<>'", pattern[pos])))
+							pos++;
+					}
+					break;
+				}
+
+				default:
+					Append(best, current, chr);
+					break;
+			}
+		}
+		Commit(best, current);
+		return best;
+	}
+
+	/** Marks the filters whose literal is found in a message. */
+	struct Marker
+	{
+		FilterIndex& index;
+		const int type;
+
+		Marker(FilterIndex& Index, int Type) : index(Index), type(Type) { }
+
+		bool operator()(const WordMatch::Occurrence& occurrence)
+		{
+			if (type & (index.stripcolor[occurrence.id] ? MARK_STRIPPED : MARK_PLAIN))
+				index.marks[occurrence.id] = index.generation;
+			return true;
+		}
+	};
+
+	/** Marks the filters of the specified type whose literal is found in a message. */
+	void Scan(const std::string& text, int type)
+	{
+		Marker marker(*this, type);
+		matcher.Search(text, marker);
+	}
+
+ public:
+	FilterIndex()
+		: matcher(casemap.map)
+		, generation(0)
+		, hasstripcolor(false)
+	{
+	}
+
+	/** Rebuilds the index from a list of filters.
+	 * @param filters The filters to index.
+	 * @param syntax The syntax of the filter patterns.
+	 */
+	void Build(const std::vector<FilterResult>& filters, Syntax syntax)
+	{
+		matcher.Clear();
+		indexed.assign(filters.size(), false);
+		stripcolor.assign(filters.size(), false);
+		marks.assign(filters.size(), 0);
+		generation = 0;
+		hasstripcolor = false;
+
+		for (size_t i = 0; i < filters.size(); ++i)
+		{
+			const FilterResult& filter = filters[i];
+			stripcolor[i] = filter.flag_strip_color;
+			hasstripcolor |= filter.flag_strip_color;
+
+			std::string literal;
+			if (syntax == SYNTAX_GLOB)
+				literal = ExtractGlob(filter.freeform);
+			else if (syntax == SYNTAX_REGEX)
+				literal = ExtractRegex(filter.freeform);
+
+			// A single character is in almost every message so isn't worth searching for.
+			if (literal.length() < 2)
+				continue;
+
+			matcher.Add(literal, i);
+			indexed[i] = true;
+		}
+		matcher.Compile();
+	}
+
+	/** Determines whether any filters match against the message with formatting removed. */
+	bool HasStripColor() const
+	{
+		return hasstripcolor;
+	}
+
+	/** Searches a message for the literals of all indexed filters.
+	 * @param text The message text.
+	 * @param stripped The message text with formatting removed.
+	 */
+	void Search(const std::string& text, const std::string& stripped)
+	{
+		if (!++generation)
+		{
+			marks.assign(marks.size(), 0);
+			generation = 1;
+		}
+
+		if (!hasstripcolor || stripped == text)
+		{
+			Scan(text, MARK_ALL);
+		}
+		else
+		{
+			Scan(text, MARK_PLAIN);
+			Scan(stripped, MARK_STRIPPED);
+		}
+	}
+
+	/** Determines whether a filter could match the message from the last search. */
+	bool IsCandidate(size_t filter) const
+	{
+		return !indexed[filter] || marks[filter] == generation;
+	}
+};
+
 class CommandFilter : public Command
 {
  public:
@@ -169,11 +543,54 @@ class ModuleFilter : public Module, public ServerEventListener, public Stats::Ev
 {
 	typedef insp::flat_set<std::string, irc::insensitive_swo> ExemptTargetSet;
 
+	/** The result of matching a message against the filters, cached so that messages
+	 * which are repeated by many users (e.g. spam waves) are only matched once.
+	 */
+	struct Verdict
+	{
+		/** The time at which this verdict expires. */
+		time_t expire;
+
+		/** The index of the first matching filter for each type of message for normal
+		 * users and opers, VERDICT_NONE if none match or VERDICT_UNKNOWN if not checked.
+		 */
+		int results[8];
+	};
+
+	typedef TR1NS::unordered_map<std::string, Verdict> VerdictCache;
+
+	enum
+	{
+		VERDICT_NONE = -1,
+		VERDICT_UNKNOWN = -2,
+
+		// The maximum number of verdicts to cache.
+		MAX_VERDICTS = 4096
+	};
+
 	bool initing;
 	bool notifyuser;
 	RegexFactory* factory;
 	void FreeFilters();
 
+	/** The index used to select which filters could match a message. */
+	FilterIndex index;
+
+	/** Whether the index needs to be rebuilt before it is next used. */
+	bool dirty;
+
+	/** Cached verdicts keyed by message text. */
+	VerdictCache verdicts;
+
+	/** The number of seconds to cache verdicts for or 0 to not cache them. */
+	unsigned long cachetime;
+
+	/** Marks the filter list as changed so the index is rebuilt and cached verdicts are dropped. */
+	void Invalidate();
+
+	/** Finds the first filter which matches a message without checking the verdict cache. */
+	int FindMatch(User* user, const std::string& text, int flags);
+
  public:
 	CommandFilter filtcommand;
 	dynamic_reference<RegexFactory> RegexEngine;
@@ -315,6 +732,8 @@ ModuleFilter::ModuleFilter()
 	: ServerEventListener(this)
 	, Stats::EventListener(this)
 	, initing(true)
+	, dirty(true)
+	, cachetime(0)
 	, filtcommand(this)
 	, RegexEngine(this, "regex")
 {
@@ -337,6 +756,13 @@ void ModuleFilter::FreeFilters()
 		delete i->regex;
 
 	filters.clear();
+	Invalidate();
+}
+
+void ModuleFilter::Invalidate()
+{
+	dirty = true;
+	verdicts.clear();
 }
 
 ModResult ModuleFilter::OnUserPreMessage(User* user, const MessageTarget& msgtarget, MessageDetails& details)
@@ -574,6 +1000,8 @@ void ModuleFilter::ReadConfig(ConfigStatus& status)
 	ConfigTag* tag = ServerInstance->Config->ConfValue("filteropts");
 	std::string newrxengine = tag->getString("engine");
 	notifyuser = tag->getBool("notifyuser", true);
+	cachetime = tag->getDuration("cachetime", 10);
+	Invalidate();
 
 	factory = RegexEngine ? (RegexEngine.operator->()) : NULL;
 
@@ -683,27 +1111,94 @@ void ModuleFilter::OnDecodeMetaData(Extensible* target, const std::string &extna
 
 FilterResult* ModuleFilter::FilterMatch(User* user, const std::string &text, int flgs)
 {
+	if (!cachetime)
+	{
+		const int result = FindMatch(user, text, flgs);
+		return result == VERDICT_NONE ? NULL : &filters[result];
+	}
+
+	// The results depend on the message type, which is a single bit of flgs, and on
+	// whether the user is exempt from filters with the 'o' flag.
+	size_t slot = (flgs & FLAG_PART) ? 0 : (flgs & FLAG_QUIT) ? 1 : (flgs & FLAG_PRIVMSG) ? 2 : 3;
+	if (user->IsOper())
+		slot += 4;
+
+	VerdictCache::iterator it = verdicts.find(text);
+	if (it == verdicts.end() || it->second.expire < ServerInstance->Time())
+	{
+		if (it == verdicts.end())
+		{
+			if (verdicts.size() >= MAX_VERDICTS)
+			{
+				for (VerdictCache::iterator i = verdicts.begin(); i != verdicts.end(); )
+				{
+					if (i->second.expire < ServerInstance->Time())
+						verdicts.erase(i++);
+					else
+						++i;
+				}
+
+				if (verdicts.size() >= MAX_VERDICTS)
+					verdicts.clear();
+			}
+			it = verdicts.insert(std::make_pair(text, Verdict())).first;
+		}
+
+		Verdict& verdict = it->second;
+		verdict.expire = ServerInstance->Time() + cachetime;
+		std::fill(verdict.results, verdict.results + 8, static_cast<int>(VERDICT_UNKNOWN));
+	}
+
+	int& result = it->second.results[slot];
+	if (result == VERDICT_UNKNOWN)
+		result = FindMatch(user, text, flgs);
+
+	return result == VERDICT_NONE ? NULL : &filters[result];
+}
+
+int ModuleFilter::FindMatch(User* user, const std::string& text, int flgs)
+{
+	if (dirty)
+	{
+		FilterIndex::Syntax syntax = FilterIndex::SYNTAX_NONE;
+		if (RegexEngine)
+		{
+			const std::string& engine = RegexEngine->name;
+			if (engine == "regex/glob")
+				syntax = FilterIndex::SYNTAX_GLOB;
+			else if (engine == "regex/pcre" || engine == "regex/re2" || engine == "regex/tre")
+				syntax = FilterIndex::SYNTAX_REGEX;
+		}
+
+		index.Build(filters, syntax);
+		dirty = false;
+	}
+
 	static std::string stripped_text;
 	stripped_text.clear();
+	if (index.HasStripColor())
+	{
+		stripped_text = text;
+		InspIRCd::StripColor(stripped_text);
+	}
 
-	for (std::vector<FilterResult>::iterator i = filters.begin(); i != filters.end(); ++i)
+	index.Search(text, stripped_text);
+	for (size_t i = 0; i < filters.size(); ++i)
 	{
-		FilterResult* filter = &*i;
+		FilterResult* filter = &filters[i];
 
 		/* Skip ones that dont apply to us */
 		if (!AppliesToMe(user, filter, flgs))
 			continue;
 
-		if ((filter->flag_strip_color) && (stripped_text.empty()))
-		{
-			stripped_text = text;
-			InspIRCd::StripColor(stripped_text);
-		}
+		/* Skip ones whose required text isn't in the message */
+		if (!index.IsCandidate(i))
+			continue;
 
 		if (filter->regex->Matches(filter->flag_strip_color ? stripped_text : text))
-			return filter;
+			return i;
 	}
-	return NULL;
+	return VERDICT_NONE;
 }
 
 bool ModuleFilter::DeleteFilter(const std::string &freeform)
@@ -714,6 +1209,7 @@ bool ModuleFilter::DeleteFilter(const std::string &freeform)
 		{
 			delete i->regex;
 			filters.erase(i);
+			Invalidate();
 			return true;
 		}
 	}
@@ -733,6 +1229,7 @@ std::pair<bool, std::string> ModuleFilter::AddFilter(const std::string& freeform
 	try
 	{
 		filters.push_back(FilterResult(RegexEngine, freeform, reason, type, duration, flgs, false));
+		Invalidate();
 	}
 	catch (ModuleException &e)
 	{
@@ -790,6 +1287,7 @@ void ModuleFilter::ReadFilters()
 			ServerInstance->SNO->WriteGlobalSno('f', "FILTER: removing filter '" + filter->freeform + "' due to config rehash.");
 			delete filter->regex;
 			filter = filters.erase(filter);
+			Invalidate();
 			continue;
 		}
 
@@ -815,6 +1313,7 @@ void ModuleFilter::ReadFilters()
 		try
 		{
 			filters.push_back(FilterResult(RegexEngine, pattern, reason, fa, duration, flgs, true));
+			Invalidate();
 			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Regular expression %s loaded.", pattern.c_str());
 		}
 		catch (ModuleException &e)
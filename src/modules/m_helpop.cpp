@@ -22,6 +22,7 @@
 
 
 #include "inspircd.h"
+#include "numericbuilder.h"
 #include "modules/whois.h"
 
 enum
@@ -52,7 +53,7 @@ class Helpop : public SimpleUserModeHandler
 
 /** Handles /HELPOP
  */
-class CommandHelpop : public Command
+class CommandHelpop : public SplitCommand
 {
  private:
 	const std::string startkey;
@@ -61,23 +62,25 @@ class CommandHelpop : public Command
 	std::string nohelp;
 
 	CommandHelpop(Module* Creator)
-		: Command(Creator, "HELPOP", 0)
+		: SplitCommand(Creator, "HELPOP", 0)
 		, startkey("start")
 	{
 		syntax = "<any-text>";
 	}
 
-	CmdResult Handle(User* user, const Params& parameters) CXX11_OVERRIDE
+	CmdResult HandleLocal(LocalUser* user, const Params& parameters) CXX11_OVERRIDE
 	{
 		const std::string& parameter = (!parameters.empty() ? parameters[0] : startkey);
 
 		if (parameter == "index")
 		{
-			/* iterate over all helpop items */
-			user->WriteNumeric(RPL_HELPSTART, parameter, "HELPOP topic index");
+			/* iterate over all helpop items, the index can be long so send it as the sendq drains */
+			Numeric::QueuedReply* const reply = new Numeric::QueuedReply(creator);
+			reply->Add(Numeric::Numeric(RPL_HELPSTART).push(parameter).push("HELPOP topic index"));
 			for (HelpopMap::const_iterator iter = helpop_map.begin(); iter != helpop_map.end(); iter++)
-				user->WriteNumeric(RPL_HELPTXT, parameter, InspIRCd::Format("  %s", iter->first.c_str()));
-			user->WriteNumeric(RPL_ENDOFHELP, parameter, "*** End of HELPOP topic index");
+				reply->Add(Numeric::Numeric(RPL_HELPTXT).push(parameter).push(InspIRCd::Format("  %s", iter->first.c_str())));
+			reply->Add(Numeric::Numeric(RPL_ENDOFHELP).push(parameter).push("*** End of HELPOP topic index"));
+			user->AddGenerator(reply);
 		}
 		else
 		{
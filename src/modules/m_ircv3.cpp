@@ -57,7 +57,7 @@ class JoinHook : public ClientProtocol::EventHook
 	Cap::Capability awaycap;
 
 	JoinHook(Module* mod)
-		: ClientProtocol::EventHook(mod, "JOIN")
+		: ClientProtocol::EventHook(mod, "JOIN", ClientProtocol::EventHook::DefaultPriority, true)
 		, asterisk(1, '*')
 		, awayprotoev(mod, "AWAY")
 		, extendedjoincap(mod, "extended-join")
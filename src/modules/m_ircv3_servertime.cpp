@@ -24,16 +24,26 @@
 class ServerTimeTag : public IRCv3::ServerTime::Manager, public IRCv3::CapTag<ServerTimeTag>
 {
 	time_t lasttime;
+	long lastmillisecs;
 	std::string lasttimestring;
 
 	void RefreshTimeString()
 	{
+		// Cache the string so it's not recreated every time a message is sent. The time only
+		// changes between iterations of the main loop so a whole fan-out shares one string.
 		const time_t currtime = ServerInstance->Time();
+		const long currmillisecs = ServerInstance->Time_ns() / 1000000;
 		if (currtime != lasttime)
 		{
 			lasttime = currtime;
-			// Cache the string so it's not recreated every time a message is sent
-			lasttimestring = IRCv3::ServerTime::FormatTime(currtime);
+			lastmillisecs = currmillisecs;
+			lasttimestring = IRCv3::ServerTime::FormatTime(currtime, currmillisecs);
+		}
+		else if (currmillisecs != lastmillisecs)
+		{
+			// Same second, only the milliseconds need updating
+			lastmillisecs = currmillisecs;
+			IRCv3::ServerTime::SetMilliseconds(lasttimestring, currmillisecs);
 		}
 	}
 
@@ -42,6 +52,7 @@ class ServerTimeTag : public IRCv3::ServerTime::Manager, public IRCv3::CapTag<Se
 		: IRCv3::ServerTime::Manager(mod)
 		, IRCv3::CapTag<ServerTimeTag>(mod, "server-time", "time")
 		, lasttime(0)
+		, lastmillisecs(0)
 	{
 		tagprov = this;
 	}
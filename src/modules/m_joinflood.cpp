@@ -22,6 +22,7 @@
 
 
 #include "inspircd.h"
+#include "ratelimit.h"
 
 enum
 {
@@ -39,35 +40,23 @@ class joinfloodsettings
  public:
 	unsigned int secs;
 	unsigned int joins;
-	time_t reset;
 	time_t unlocktime;
-	unsigned int counter;
+	RateLimit::Bucket bucket;
 
 	joinfloodsettings(unsigned int b, unsigned int c)
-		: secs(b), joins(c), unlocktime(0), counter(0)
+		: secs(b), joins(c), unlocktime(0)
 	{
-		reset = ServerInstance->Time() + secs;
 	}
 
-	void addjoin()
+	bool addjoin()
 	{
-		if (ServerInstance->Time() > reset)
-		{
-			counter = 1;
-			reset = ServerInstance->Time() + secs;
-		}
-		else
-			counter++;
-	}
-
-	bool shouldlock()
-	{
-		return (counter >= this->joins);
+		// The join which empties the bucket is the one that locks the channel.
+		return !bucket.Take(joins - 1, secs, RateLimit::Now());
 	}
 
 	void clear()
 	{
-		counter = 0;
+		bucket.Reset();
 	}
 
 	bool islocked()
@@ -169,8 +158,7 @@ class ModuleJoinFlood : public Module
 		/* But all others are OK */
 		if ((f) && (!f->islocked()))
 		{
-			f->addjoin();
-			if (f->shouldlock())
+			if (f->addjoin())
 			{
 				f->clear();
 				f->lock();
@@ -25,6 +25,7 @@
 
 #include "inspircd.h"
 #include "modules/invite.h"
+#include "ratelimit.h"
 
 enum
 {
@@ -35,21 +36,8 @@ enum
 
 class KickRejoinData
 {
-	struct KickedUser
-	{
-		std::string uuid;
-		time_t expire;
-
-		KickedUser(User* user, unsigned int Delay)
-			: uuid(user->uuid)
-			, expire(ServerInstance->Time() + Delay)
-		{
-		}
-	};
-
-	typedef std::vector<KickedUser> KickedList;
-
-	mutable KickedList kicked;
+	/** Users who have been kicked have an empty bucket which refills after the delay. */
+	RateLimit::Table<std::string> kicked;
 
  public:
 	const unsigned int delay;
@@ -58,32 +46,14 @@ class KickRejoinData
 
 	bool canjoin(LocalUser* user) const
 	{
-		for (KickedList::iterator i = kicked.begin(); i != kicked.end(); )
-		{
-			KickedUser& rec = *i;
-			if (rec.expire > ServerInstance->Time())
-			{
-				if (rec.uuid == user->uuid)
-					return false;
-				++i;
-			}
-			else
-			{
-				// Expired record, remove.
-				stdalgo::vector::swaperase(kicked, i);
-				if (kicked.empty())
-					break;
-			}
-		}
-		return true;
+		return kicked.CanTake(user->uuid, 1, delay, RateLimit::Now());
 	}
 
 	void add(User* user)
 	{
-		// One user can be in the list multiple times if the user gets kicked, force joins
-		// (skipping OnUserPreJoin) and gets kicked again, but that's okay because canjoin()
-		// works correctly in this case as well
-		kicked.push_back(KickedUser(user, delay));
+		// If the user gets kicked, force joins (skipping OnUserPreJoin) and gets kicked
+		// again then the delay starts again from the latest kick.
+		kicked.Drain(user->uuid, delay, RateLimit::Now());
 	}
 };
 
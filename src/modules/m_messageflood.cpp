@@ -25,6 +25,7 @@
 
 #include "inspircd.h"
 #include "modules/exemption.h"
+#include "ratelimit.h"
 
 /** Holds flood settings and state for mode +f
  */
@@ -34,31 +35,24 @@ class floodsettings
 	bool ban;
 	unsigned int secs;
 	unsigned int lines;
-	time_t reset;
-	insp::flat_map<User*, unsigned int> counters;
+	RateLimit::Table<User*> buckets;
 
 	floodsettings(bool a, unsigned int b, unsigned int c)
 		: ban(a)
 		, secs(b)
 		, lines(c)
 	{
-		reset = ServerInstance->Time() + secs;
 	}
 
 	bool addmessage(User* who)
 	{
-		if (ServerInstance->Time() > reset)
-		{
-			counters.clear();
-			reset = ServerInstance->Time() + secs;
-		}
-
-		return (++counters[who] >= this->lines);
+		// The message which empties the bucket is the one that triggers the flood.
+		return !buckets.Take(who, lines - 1, secs, RateLimit::Now());
 	}
 
 	void clear(User* who)
 	{
-		counters.erase(who);
+		buckets.Reset(who);
 	}
 };
 
@@ -20,6 +20,7 @@
 
 #include "inspircd.h"
 #include "modules/exemption.h"
+#include "ratelimit.h"
 
 // The number of seconds nickname changing will be blocked for.
 static unsigned int duration;
@@ -31,39 +32,30 @@ class nickfloodsettings
  public:
 	unsigned int secs;
 	unsigned int nicks;
-	time_t reset;
 	time_t unlocktime;
-	unsigned int counter;
+	RateLimit::Bucket bucket;
 
 	nickfloodsettings(unsigned int b, unsigned int c)
-		: secs(b), nicks(c), unlocktime(0), counter(0)
+		: secs(b), nicks(c), unlocktime(0)
 	{
-		reset = ServerInstance->Time() + secs;
 	}
 
 	void addnick()
 	{
-		if (ServerInstance->Time() > reset)
-		{
-			counter = 1;
-			reset = ServerInstance->Time() + secs;
-		}
-		else
-			counter++;
+		bucket.Take(nicks, secs, RateLimit::Now());
 	}
 
 	bool shouldlock()
 	{
-		/* XXX HACK: using counter + 1 here now to allow the counter to only be incremented
-		 * on successful nick changes; this will be checked before the counter is
-		 * incremented.
+		/* XXX HACK: the bucket is only drained on successful nick changes so this is
+		 * checked before a token is taken for the nick change being attempted.
 		 */
-		return ((ServerInstance->Time() <= reset) && (counter == this->nicks));
+		return !bucket.CanTake(nicks, secs, RateLimit::Now());
 	}
 
 	void clear()
 	{
-		counter = 0;
+		bucket.Reset();
 	}
 
 	bool islocked()
@@ -57,8 +57,8 @@ class ModuleNoCTCP : public Module
 		if (!IS_LOCAL(user))
 			return MOD_RES_PASSTHRU;
 
-		std::string ctcpname;
-		if (!details.IsCTCP(ctcpname) || irc::equals(ctcpname, "ACTION"))
+		const MessageAnalysis& analysis = details.GetAnalysis();
+		if (!analysis.ctcp || irc::equals(analysis.ctcpname, "ACTION"))
 			return MOD_RES_PASSTHRU;
 
 		if (target.type == MessageTarget::TYPE_CHANNEL)
@@ -64,8 +64,9 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 	struct RepeatItem
 	{
 		time_t ts;
+		uint32_t hash;
 		std::string line;
-		RepeatItem(time_t TS, const std::string& Line) : ts(TS), line(Line) { }
+		RepeatItem(time_t TS, uint32_t Hash, const std::string& Line) : ts(TS), hash(Hash), line(Line) { }
 	};
 
 	typedef std::deque<RepeatItem> RepeatItemList;
@@ -84,38 +85,122 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 		unsigned int MaxBacklog;
 		unsigned int MaxDiff;
 		unsigned int MaxMessageSize;
-		ModuleSettings() : MaxLines(0), MaxSecs(0), MaxBacklog(0), MaxDiff() { }
+		ModuleSettings() : MaxLines(0), MaxSecs(0), MaxBacklog(0), MaxDiff(), MaxMessageSize(0) { }
 	};
 
-	std::vector<unsigned int> mx[2];
+	/** The number of 64 bit words needed to hold one bit for every byte of a message. */
+	size_t blocks;
+
+	/** For every byte value, a bit mask of the positions it appears at in the loaded pattern. */
+	std::vector<uint64_t> peq;
+
+	/** The vertical positive and negative delta vectors for each block of the pattern. */
+	std::vector<uint64_t> pv;
+	std::vector<uint64_t> mv;
+
+	/** The message which is currently loaded into peq. */
+	std::string pattern;
 	ModuleSettings ms;
 
-	bool CompareLines(const std::string& message, const std::string& historyline, unsigned int trigger)
+	/** Folds a message to lower case and returns its hash. */
+	static uint32_t Fold(std::string& message)
 	{
-		if (message == historyline)
+		uint32_t hash = 2166136261U;
+		for (std::string::iterator i = message.begin(); i != message.end(); ++i)
+		{
+			*i = tolower(static_cast<unsigned char>(*i));
+			hash = (hash ^ static_cast<unsigned char>(*i)) * 16777619U;
+		}
+		return hash;
+	}
+
+	/** Loads a message as the pattern which history lines are compared against. */
+	void LoadPattern(const std::string& message)
+	{
+		// Only the bits set by the previous pattern need to be cleared.
+		for (size_t i = 0; i < pattern.size(); ++i)
+			peq[static_cast<unsigned char>(pattern[i]) * blocks + i / 64] = 0;
+
+		pattern.assign(message);
+		for (size_t i = 0; i < pattern.size(); ++i)
+			peq[static_cast<unsigned char>(pattern[i]) * blocks + i / 64] |= static_cast<uint64_t>(1) << (i % 64);
+	}
+
+	bool CompareLines(const std::string& message, uint32_t hash, const RepeatItem& item, unsigned int trigger)
+	{
+		if (item.hash == hash && item.line == message)
 			return true;
 		else if (trigger)
-			return (Levenshtein(message, historyline) <= trigger);
+			return (Distance(item.line, trigger) <= trigger);
 
 		return false;
 	}
 
-	unsigned int Levenshtein(const std::string& s1, const std::string& s2)
+	/** Calculates the edit distance between the loaded pattern and a line using Myers'
+	 * bit-parallel algorithm, which processes 64 bytes of the pattern per operation.
+	 * @param text The line to compare the pattern against.
+	 * @param limit The distance above which the exact distance is not needed.
+	 * @return The edit distance or limit + 1 if it is larger than limit.
+	 */
+	unsigned int Distance(const std::string& text, unsigned int limit)
 	{
-		unsigned int l1 = s1.size();
-		unsigned int l2 = s2.size();
-
-		for (unsigned int i = 0; i < l2; i++)
-			mx[0][i] = i;
-		for (unsigned int i = 0; i < l1; i++)
+		const size_t m = pattern.size();
+		const size_t n = text.size();
+		if ((m > n ? m - n : n - m) > limit)
+			return limit + 1;
+
+		if (!m)
+			return n;
+
+		const size_t used = (m + 63) / 64;
+		const uint64_t highbit = static_cast<uint64_t>(1) << 63;
+		const uint64_t lastbit = static_cast<uint64_t>(1) << ((m - 1) % 64);
+		std::fill(pv.begin(), pv.begin() + used, ~static_cast<uint64_t>(0));
+		std::fill(mv.begin(), mv.begin() + used, 0);
+
+		size_t score = m;
+		for (size_t j = 0; j < n; ++j)
 		{
-			mx[1][0] = i + 1;
-			for (unsigned int j = 0; j < l2; j++)
-				mx[1][j + 1] = std::min(std::min(mx[1][j] + 1, mx[0][j + 1] + 1), mx[0][j] + ((s1[i] == s2[j]) ? 0 : 1));
+			const uint64_t* eqs = &peq[static_cast<unsigned char>(text[j]) * blocks];
 
-			mx[0].swap(mx[1]);
+			// The first row of the matrix goes up by one for each byte of the text.
+			int hin = 1;
+			for (size_t b = 0; b < used; ++b)
+			{
+				const uint64_t high = (b + 1 == used) ? lastbit : highbit;
+				uint64_t eq = eqs[b];
+				const uint64_t xv = eq | mv[b];
+				if (hin < 0)
+					eq |= 1;
+
+				const uint64_t xh = (((eq & pv[b]) + pv[b]) ^ pv[b]) | eq;
+				uint64_t ph = mv[b] | ~(xh | pv[b]);
+				uint64_t mh = pv[b] & xh;
+
+				int hout = 0;
+				if (ph & high)
+					hout = 1;
+				else if (mh & high)
+					hout = -1;
+
+				ph <<= 1;
+				mh <<= 1;
+				if (hin < 0)
+					mh |= 1;
+				else if (hin > 0)
+					ph |= 1;
+
+				pv[b] = mh | ~(xv | ph);
+				mv[b] = ph & xv;
+				hin = hout;
+			}
+
+			// The score can only go down by one for each remaining byte of the text.
+			score += hin;
+			if (score > limit + (n - j - 1))
+				return limit + 1;
 		}
-		return mx[0][l2];
+		return score;
 	}
 
  public:
@@ -123,6 +208,7 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 
 	RepeatMode(Module* Creator)
 		: ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >(Creator, "repeat", 'E')
+		, blocks(0)
 		, MemberInfoExt("repeat_memb", ExtensionItem::EXT_MEMBERSHIP, Creator)
 	{
 	}
@@ -182,8 +268,9 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 		RepeatItemList& items = rp->ItemList;
 		const unsigned int trigger = (message.size() * rs->Diff / 100);
 		const time_t now = ServerInstance->Time();
-
-		std::transform(message.begin(), message.end(), message.begin(), ::tolower);
+		const uint32_t hash = Fold(message);
+		if (trigger && !items.empty())
+			LoadPattern(message);
 
 		for (std::deque<RepeatItem>::iterator it = items.begin(); it != items.end(); ++it)
 		{
@@ -194,7 +281,7 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 				break;
 			}
 
-			if (CompareLines(message, it->line, trigger))
+			if (CompareLines(message, hash, *it, trigger))
 			{
 				if (++matches >= rs->Lines)
 				{
@@ -215,19 +302,21 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 		if (items.size() >= max_items)
 			items.pop_back();
 
-		items.push_front(RepeatItem(now + rs->Seconds, message));
+		items.push_front(RepeatItem(now + rs->Seconds, hash, message));
 		rp->Counter = matches;
 		return false;
 	}
 
 	void Resize(size_t size)
 	{
-		size_t newsize = size+1;
-		if (newsize <= mx[0].size())
+		if (size <= ms.MaxMessageSize && !peq.empty())
 			return;
 		ms.MaxMessageSize = size;
-		mx[0].resize(newsize);
-		mx[1].resize(newsize);
+		blocks = std::max<size_t>((size + 63) / 64, 1);
+		peq.assign(256 * blocks, 0);
+		pv.resize(blocks);
+		mv.resize(blocks);
+		pattern.clear();
 	}
 
 	void ReadConfig()
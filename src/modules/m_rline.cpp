@@ -223,6 +223,92 @@ class ModuleRLine : public Module, public Stats::EventListener
 	bool initing;
 	RegexFactory* factory;
 
+	/** All R-lines compiled together so users can be matched against them at once or NULL if
+	 * the regex engine could not compile them.
+	 */
+	RegexSet* rlineset;
+
+	/** The R-line for each pattern in rlineset. */
+	std::vector<RLine*> setlines;
+
+	/** Whether the R-lines have changed since rlineset was built. */
+	bool dirty;
+
+	/** The patterns in rlineset which matched the last user checked. */
+	RegexSet::MatchList matches;
+
+	void ResetSet()
+	{
+		delete rlineset;
+		rlineset = NULL;
+		setlines.clear();
+		dirty = true;
+	}
+
+	void BuildSet()
+	{
+		ResetSet();
+
+		// This expires any old R-lines so it must happen before the set is built.
+		XLineLookup* lines = ServerInstance->XLines->GetAll(f.GetType());
+		dirty = false;
+		if (!rxfactory || !lines || lines->empty())
+			return;
+
+		rlineset = rxfactory->CreateSet();
+		try
+		{
+			for (XLineLookup::const_iterator i = lines->begin(); i != lines->end(); ++i)
+			{
+				RLine* rline = static_cast<RLine*>(i->second);
+				rlineset->Add(rline->matchtext);
+				setlines.push_back(rline);
+			}
+			rlineset->Compile();
+		}
+		catch (ModuleException& e)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to compile R-lines together, they will be matched individually: %s", e.GetReason().c_str());
+			delete rlineset;
+			rlineset = NULL;
+			setlines.clear();
+		}
+	}
+
+	XLine* MatchLine(User* user)
+	{
+		if (dirty)
+			BuildSet();
+
+		if (!rlineset)
+			return ServerInstance->XLines->MatchesLine(f.GetType(), user);
+
+		LocalUser* lu = IS_LOCAL(user);
+		if (lu && lu->exempt)
+			return NULL;
+
+		const std::string host = user->nick + "!" + user->ident + "@" + user->GetRealHost() + " " + user->GetRealName();
+		const std::string ip = user->nick + "!" + user->ident + "@" + user->GetIPString() + " " + user->GetRealName();
+
+		// If several R-lines match then the one which comes first in the list is used.
+		size_t first = setlines.size();
+		if (rlineset->Matches(host, matches))
+			first = matches.front();
+		if (rlineset->Matches(ip, matches))
+			first = std::min(first, matches.front());
+
+		if (first == setlines.size())
+			return NULL;
+
+		RLine* rline = setlines[first];
+		if (rline->duration && ServerInstance->Time() > rline->expiry)
+		{
+			// Let the xline manager expire the old R-line and find the next match.
+			return ServerInstance->XLines->MatchesLine(f.GetType(), user);
+		}
+		return rline;
+	}
+
  public:
 	ModuleRLine()
 		: Stats::EventListener(this)
@@ -230,6 +316,8 @@ class ModuleRLine : public Module, public Stats::EventListener
 		, f(rxfactory)
 		, r(this, f)
 		, initing(true)
+		, rlineset(NULL)
+		, dirty(true)
 	{
 	}
 
@@ -242,6 +330,7 @@ class ModuleRLine : public Module, public Stats::EventListener
 	{
 		ServerInstance->XLines->DelAll("R");
 		ServerInstance->XLines->UnregisterFactory(&f);
+		delete rlineset;
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
@@ -252,7 +341,7 @@ class ModuleRLine : public Module, public Stats::EventListener
 	ModResult OnUserRegister(LocalUser* user) CXX11_OVERRIDE
 	{
 		// Apply lines on user connect
-		XLine *rl = ServerInstance->XLines->MatchesLine("R", user);
+		XLine *rl = MatchLine(user);
 
 		if (rl)
 		{
@@ -272,6 +361,7 @@ class ModuleRLine : public Module, public Stats::EventListener
 		std::string newrxengine = tag->getString("engine");
 
 		factory = rxfactory ? (rxfactory.operator->()) : NULL;
+		ResetSet();
 
 		if (newrxengine.empty())
 			rxfactory.SetProvider("regex");
@@ -313,7 +403,7 @@ class ModuleRLine : public Module, public Stats::EventListener
 		if (!MatchOnNickChange)
 			return;
 
-		XLine *rl = ServerInstance->XLines->MatchesLine("R", user);
+		XLine *rl = MatchLine(user);
 
 		if (rl)
 		{
@@ -331,8 +421,29 @@ class ModuleRLine : public Module, public Stats::EventListener
 		}
 	}
 
+	void OnAddLine(User* source, XLine* line) CXX11_OVERRIDE
+	{
+		if (line->type == f.GetType())
+			ResetSet();
+	}
+
+	void OnDelLine(User* source, XLine* line) CXX11_OVERRIDE
+	{
+		if (line->type == f.GetType())
+			ResetSet();
+	}
+
+	void OnExpireLine(XLine* line) CXX11_OVERRIDE
+	{
+		if (line->type == f.GetType())
+			ResetSet();
+	}
+
 	void OnUnloadModule(Module* mod) CXX11_OVERRIDE
 	{
+		// The set may have been created by the module being unloaded.
+		ResetSet();
+
 		// If the regex engine became unavailable or has changed, remove all R-lines.
 		if (!rxfactory)
 		{
@@ -155,7 +155,7 @@ void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeSocketSet
 		if (minrank && i->second->getRank() < minrank)
 			continue;
 
-		if (exempt_list.find(i->first) == exempt_list.end())
+		if (!exempt_list.count(i->first))
 		{
 			TreeServer* best = TreeServer::Get(i->first);
 			list.insert(best->GetSocket());
@@ -63,7 +63,8 @@ class ModuleStripColor : public Module
 			active = !t->GetExtBanStatus(user, 'S').check(!t->IsModeSet(csc));
 		}
 
-		if (active)
+		// Most messages don't contain any formatting so there is nothing to strip.
+		if (active && !details.GetAnalysis().formatting.empty())
 		{
 			InspIRCd::StripColor(details.text);
 		}
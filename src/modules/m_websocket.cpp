@@ -110,6 +110,11 @@ class WebSocketHook : public IOHookMiddle
 
 	State state;
 	time_t lastpingpong;
+
+	/** Position in the recvq of the first byte which has not been handled yet. Handled frames are
+	 * removed from the recvq all at once when OnStreamSocketRead() returns.
+	 */
+	std::string::size_type recvqpos;
 	OriginList& allowedorigins;
 	bool& sendastext;
 
@@ -147,15 +152,16 @@ class WebSocketHook : public IOHookMiddle
 		return StreamSocket::SendQueue::Element(reinterpret_cast<const char*>(header), n);
 	}
 
-	int HandleAppData(StreamSocket* sock, std::string& appdataout, bool allowlarge)
+	int HandleAppData(StreamSocket* sock, std::string::size_type& payloadpos, std::string::size_type& payloadlen, bool allowlarge)
 	{
 		std::string& myrecvq = GetRecvQ();
+		const std::string::size_type avail = myrecvq.length() - recvqpos;
 		// Need 1 byte opcode, minimum 1 byte len, 4 bytes masking key
-		if (myrecvq.length() < 6)
+		if (avail < 6)
 			return 0;
 
 		const std::string& cmyrecvq = myrecvq;
-		unsigned char len1 = (unsigned char)cmyrecvq[1];
+		unsigned char len1 = (unsigned char)cmyrecvq[recvqpos + 1];
 		if (!(len1 & WS_MASKBIT))
 		{
 			sock->SetError("WebSocket protocol violation: unmasked client frame");
@@ -167,7 +173,7 @@ class WebSocketHook : public IOHookMiddle
 		// Assume the length is a single byte, if not, update values later
 		unsigned int len = len1;
 		unsigned int payloadstartoffset = 6;
-		const unsigned char* maskkey = reinterpret_cast<const unsigned char*>(&cmyrecvq[2]);
+		std::string::size_type maskkeypos = recvqpos + 2;
 
 		if (len1 == WS_PAYLOAD_LENGTH_MAGIC_LARGE)
 		{
@@ -180,11 +186,11 @@ class WebSocketHook : public IOHookMiddle
 
 			// Large frame, has 2 bytes len after the magic byte indicating the length
 			// Need 1 byte opcode, 3 bytes len, 4 bytes masking key
-			if (myrecvq.length() < 8)
+			if (avail < 8)
 				return 0;
 
-			unsigned char len2 = (unsigned char)cmyrecvq[2];
-			unsigned char len3 = (unsigned char)cmyrecvq[3];
+			unsigned char len2 = (unsigned char)cmyrecvq[recvqpos + 2];
+			unsigned char len3 = (unsigned char)cmyrecvq[recvqpos + 3];
 			len = (len2 << 8) | len3;
 
 			if (len <= WS_MAX_PAYLOAD_LENGTH_SMALL)
@@ -193,7 +199,7 @@ class WebSocketHook : public IOHookMiddle
 				return -1;
 			}
 
-			maskkey += 2;
+			maskkeypos += 2;
 			payloadstartoffset += 2;
 		}
 		else if (len1 == WS_PAYLOAD_LENGTH_MAGIC_HUGE)
@@ -202,19 +208,20 @@ class WebSocketHook : public IOHookMiddle
 			return -1;
 		}
 
-		if (myrecvq.length() < payloadstartoffset + len)
+		if (avail < payloadstartoffset + len)
 			return 0;
 
-		unsigned int maskkeypos = 0;
-		const std::string::iterator endit = myrecvq.begin() + payloadstartoffset + len;
-		for (std::string::const_iterator i = myrecvq.begin() + payloadstartoffset; i != endit; ++i)
-		{
-			const unsigned char c = (unsigned char)*i;
-			appdataout.push_back(c ^ maskkey[maskkeypos++]);
-			maskkeypos %= 4;
-		}
+		// Unmask the payload in place, it is passed on from the recvq without copying it again.
+		unsigned char maskkey[4];
+		std::copy(cmyrecvq.begin() + maskkeypos, cmyrecvq.begin() + maskkeypos + 4, maskkey);
+
+		payloadpos = recvqpos + payloadstartoffset;
+		payloadlen = len;
+		std::string::iterator payload = myrecvq.begin() + payloadpos;
+		for (unsigned int i = 0; i < len; ++i)
+			payload[i] ^= maskkey[i % 4];
 
-		myrecvq.erase(myrecvq.begin(), endit);
+		recvqpos = payloadpos + payloadlen;
 		return 1;
 	}
 
@@ -228,15 +235,16 @@ class WebSocketHook : public IOHookMiddle
 
 		lastpingpong = ServerInstance->Time();
 
-		std::string appdata;
-		const int result = HandleAppData(sock, appdata, false);
+		std::string::size_type payloadpos;
+		std::string::size_type payloadlen;
+		const int result = HandleAppData(sock, payloadpos, payloadlen, false);
 		// If it's a pong stop here regardless of the result so we won't generate a reply
 		if ((result <= 0) || (!isping))
 			return result;
 
-		StreamSocket::SendQueue::Element elem = PrepareSendQElem(appdata.length(), OP_PONG);
-		elem.append(appdata);
-		GetSendQ().push_back(elem);
+		StreamSocket::SendQueue::Element elem = PrepareSendQElem(payloadlen, OP_PONG);
+		elem.append(GetRecvQ(), payloadpos, payloadlen);
+		GetSendQ().push_back_swap(elem);
 
 		SocketEngine::ChangeEventMask(sock, FD_ADD_TRIAL_WRITE);
 		return 1;
@@ -244,26 +252,31 @@ class WebSocketHook : public IOHookMiddle
 
 	int HandleWS(StreamSocket* sock, std::string& destrecvq)
 	{
-		if (GetRecvQ().empty())
+		if (GetRecvQ().length() <= recvqpos)
 			return 0;
 
-		unsigned char opcode = (unsigned char)GetRecvQ().c_str()[0];
+		unsigned char opcode = (unsigned char)GetRecvQ()[recvqpos];
 		switch (opcode & ~WS_FINBIT)
 		{
 			case OP_CONTINUATION:
 			case OP_TEXT:
 			case OP_BINARY:
 			{
-				std::string appdata;
-				const int result = HandleAppData(sock, appdata, true);
+				std::string::size_type payloadpos;
+				std::string::size_type payloadlen;
+				const int result = HandleAppData(sock, payloadpos, payloadlen, true);
 				if (result != 1)
 					return result;
 
-				// Strip out any CR+LF which may have been erroneously sent.
-				for (std::string::const_iterator iter = appdata.begin(); iter != appdata.end(); ++iter)
+				// Strip out any CR+LF which may have been erroneously sent, copying the runs between them in one go.
+				static const char crlf[] = "\r\n";
+				const char* chunk = GetRecvQ().data() + payloadpos;
+				const char* const payloadend = chunk + payloadlen;
+				while (chunk != payloadend)
 				{
-					if (*iter != '\r' && *iter != '\n')
-						destrecvq.push_back(*iter);
+					const char* const chunkend = std::find_first_of(chunk, payloadend, crlf, crlf + 2);
+					destrecvq.append(chunk, chunkend);
+					chunk = (chunkend == payloadend ? payloadend : chunkend + 1);
 				}
 
 				// If we are on the final message of this block append a line terminator.
@@ -299,6 +312,38 @@ class WebSocketHook : public IOHookMiddle
 		}
 	}
 
+	/** Appends part of a message to another without any CRs in it. */
+	static void AppendMessage(std::string& message, const std::string& data, std::string::size_type begin, std::string::size_type end)
+	{
+		for (std::string::size_type cr; (cr = data.find('\r', begin)) < end; begin = cr + 1)
+			message.append(data, begin, cr - begin);
+		message.append(data, begin, end - begin);
+	}
+
+	/** Sends a message in its own frame. The message is moved to the send queue so it is left empty. */
+	void SendMessage(std::string& message)
+	{
+		StreamSocket::SendQueue& mysendq = GetSendQ();
+		if (sendastext)
+		{
+			// If we send messages as text then we need to ensure they are valid UTF-8.
+			if (!utf8::is_valid(message.begin(), message.end()))
+			{
+				std::string encoded;
+				utf8::replace_invalid(message.begin(), message.end(), std::back_inserter(encoded));
+				message.swap(encoded);
+			}
+
+			mysendq.push_back(PrepareSendQElem(message.length(), OP_TEXT));
+		}
+		else
+		{
+			// Otherwise, send the raw message as a binary frame.
+			mysendq.push_back(PrepareSendQElem(message.length(), OP_BINARY));
+		}
+		mysendq.push_back_swap(message);
+	}
+
 	void FailHandshake(StreamSocket* sock, const char* httpreply, const char* sockerror)
 	{
 		GetSendQ().push_back(StreamSocket::SendQueue::Element(httpreply));
@@ -368,6 +413,7 @@ class WebSocketHook : public IOHookMiddle
 		: IOHookMiddle(Prov)
 		, state(STATE_HTTPREQ)
 		, lastpingpong(0)
+		, recvqpos(0)
 		, allowedorigins(AllowedOrigins)
 		, sendastext(SendAsText)
 	{
@@ -383,42 +429,34 @@ class WebSocketHook : public IOHookMiddle
 			return (mysendq.empty() ? 0 : 1);
 
 		std::string message;
-		for (StreamSocket::SendQueue::const_iterator elem = uppersendq.begin(); elem != uppersendq.end(); ++elem)
+		StreamSocket::SendQueue::Element elem;
+		while (!uppersendq.empty())
 		{
-			for (StreamSocket::SendQueue::Element::const_iterator chr = elem->begin(); chr != elem->end(); ++chr)
+			uppersendq.pop_front_swap(elem);
+
+			// Most elements are exactly one message so they can be framed without copying them.
+			if ((message.empty()) && (!elem.empty()) && (elem.find('\n') == elem.length() - 1))
 			{
-				if (*chr == '\n')
-				{
-					// We have found an entire message. Send it in its own frame.
-					if (sendastext)
-					{
-						// If we send messages as text then we need to ensure they are valid UTF-8.
-						std::string encoded;
-						utf8::replace_invalid(message.begin(), message.end(), std::back_inserter(encoded));
-
-						mysendq.push_back(PrepareSendQElem(encoded.length(), OP_TEXT));
-						mysendq.push_back(encoded);
-					}
-					else
-					{
-						// Otherwise, send the raw message as a binary frame.
-						mysendq.push_back(PrepareSendQElem(message.length(), OP_BINARY));
-						mysendq.push_back(message);
-					}
-					message.clear();
-				}
-				else if (*chr != '\r')
-				{
-					message.push_back(*chr);
-				}
+				elem.erase(std::remove(elem.begin(), elem.end() - 1, '\r'), elem.end());
+				SendMessage(elem);
+				continue;
+			}
+
+			std::string::size_type pos = 0;
+			for (std::string::size_type eol; (eol = elem.find('\n', pos)) != std::string::npos; pos = eol + 1)
+			{
+				// We have found an entire message. Send it in its own frame.
+				AppendMessage(message, elem, pos, eol);
+				SendMessage(message);
 			}
+			AppendMessage(message, elem, pos, elem.length());
 		}
 
 		// Empty the upper send queue and push whatever is left back onto it.
 		uppersendq.clear();
 		if (!message.empty())
 		{
-			uppersendq.push_back(message);
+			uppersendq.push_back_swap(message);
 			return 0;
 		}
 
@@ -439,8 +477,10 @@ class WebSocketHook : public IOHookMiddle
 		{
 			wsret = HandleWS(sock, destrecvq);
 		}
-		while ((!GetRecvQ().empty()) && (wsret > 0));
+		while ((GetRecvQ().length() > recvqpos) && (wsret > 0));
 
+		GetRecvQ().erase(0, recvqpos);
+		recvqpos = 0;
 		return wsret;
 	}
 
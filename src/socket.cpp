@@ -354,9 +354,10 @@ irc::sockets::cidr_mask::cidr_mask(const std::string& mask)
 	}
 	else
 	{
-		unsigned char range = ConvToNum<unsigned char>(mask.substr(bits_chars + 1));
+		// Parsed as an int because an unsigned char would be read as a character.
+		unsigned int range = ConvToNum<unsigned int>(mask.substr(bits_chars + 1));
 		irc::sockets::aptosa(mask.substr(0, bits_chars), 0, sa);
-		sa2cidr(*this, sa, range);
+		sa2cidr(*this, sa, std::min<unsigned int>(range, 128));
 	}
 }
 
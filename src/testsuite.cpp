@@ -63,6 +63,7 @@ TestSuite::TestSuite()
 		std::cout << "(6) Comma sepstream tests\n";
 		std::cout << "(7) Space sepstream tests\n";
 		std::cout << "(8) UID generation tests\n";
+		std::cout << "(9) Message serializer benchmark\n";
 
 		std::cout << std::endl << "(X) Exit test suite\n";
 
@@ -110,6 +111,9 @@ TestSuite::TestSuite()
 			case '8':
 				std::cout << (DoGenerateUIDTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
 				break;
+			case '9':
+				std::cout << (DoSerializerBenchmark() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
 			case 'X':
 				return;
 				break;
@@ -394,6 +398,49 @@ bool TestSuite::DoGenerateUIDTests()
 	return true;
 }
 
+static void ReportBenchmark(const char* what, unsigned int count, clock_t start)
+{
+	const double secs = double(clock() - start) / CLOCKS_PER_SEC;
+	std::cout << "SERIALIZER: " << count << " " << what << " in " << secs << "s (" << (secs * 1000000000 / count) << " ns each)" << std::endl;
+}
+
+bool TestSuite::DoSerializerBenchmark()
+{
+	dynamic_reference_nocheck<ClientProtocol::Serializer> serializer(NULL, "serializer/rfc");
+	if (!serializer)
+	{
+		std::cout << "SERIALIZER: serializer/rfc is not loaded" << std::endl;
+		return false;
+	}
+
+	const unsigned int count = 200000;
+	const ClientProtocol::TagSelection tagwl;
+	const std::string source = "nick!ident@host.example.com";
+	const std::string target = "#channel";
+	const std::string text(512, 'x');
+	size_t total = 0;
+
+	clock_t start = clock();
+	for (unsigned int i = 0; i < count; i++)
+	{
+		Numeric::Numeric numeric(311);
+		numeric.push("nick").push("ident").push("host.example.com").push('*').push("Real Name");
+		ClientProtocol::Messages::Numeric msg(numeric, "target");
+		total += serializer->Serialize(msg, tagwl).length();
+	}
+	ReportBenchmark("numerics", count, start);
+
+	start = clock();
+	for (unsigned int i = 0; i < count; i++)
+	{
+		ClientProtocol::Messages::Privmsg msg(source, target, text);
+		total += serializer->Serialize(msg, tagwl).length();
+	}
+	ReportBenchmark("PRIVMSGs", count, start);
+
+	return (total != 0);
+}
+
 TestSuite::~TestSuite()
 {
 	std::cout << "\n\n*** END OF TEST SUITE ***\n";
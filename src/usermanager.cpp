@@ -208,6 +208,7 @@ void UserManager::QuitUser(User* user, const std::string& quitreason, const std:
 	{
 		LocalUser* lu = IS_LOCAL(user);
 		FOREACH_MOD(OnUserDisconnect, (lu));
+		lu->RemoveGenerators(NULL);
 		lu->eh.Close();
 
 		if (lu->registered == REG_ALL)
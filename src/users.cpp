@@ -24,6 +24,7 @@
 
 
 #include "inspircd.h"
+#include "numericbuilder.h"
 #include "xline.h"
 
 ClientProtocol::MessageList LocalUser::sendmsglist;
@@ -66,7 +67,8 @@ std::string User::GetModeLetters(bool includeparams) const
 }
 
 User::User(const std::string& uid, Server* srv, UserType type)
-	: age(ServerInstance->Time())
+	: except_id(0)
+	, age(ServerInstance->Time())
 	, signon(0)
 	, uuid(uid)
 	, server(srv)
@@ -90,6 +92,7 @@ LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::so
 	: User(ServerInstance->UIDGen.GetUID(), ServerInstance->FakeClient->server, USERTYPE_LOCAL)
 	, eh(this)
 	, serializer(NULL)
+	, capfingerprint(0)
 	, bytes_in(0)
 	, bytes_out(0)
 	, cmds_in(0)
@@ -248,7 +251,8 @@ void UserIOHandler::OnDataReady()
 	// The position within the recvq of the current character.
 	std::string::size_type qpos;
 
-	while (user->CommandFloodPenalty < penaltymax && getSendQSize() < sendqmax)
+	// Commands are held back while a reply is being sent in parts, they are continued in OnDataWritten().
+	while (user->CommandFloodPenalty < penaltymax && getSendQSize() < sendqmax && !user->HasGenerators())
 	{
 		// Check the newly received data for an EOL.
 		eolpos = recvq.find('\n', checked_until);
@@ -321,6 +325,19 @@ bool UserIOHandler::OnSetEndPoint(const irc::sockets::sockaddrs& server, const i
 	return !user->quitting;
 }
 
+void UserIOHandler::OnDataWritten()
+{
+	// Refill the sendq from pending replies once it has drained below the low-water mark.
+	if ((user->HasGenerators()) && (getSendQSize() < user->MyClass->GetSendqSoftMax() / 2))
+	{
+		user->RunGenerators();
+
+		// Process the commands which were held back while the replies were pending.
+		if (!user->HasGenerators())
+			OnDataReady();
+	}
+}
+
 void UserIOHandler::OnError(BufferedSocketError)
 {
 	ServerInstance->Users->QuitUser(user, getError());
@@ -337,8 +354,64 @@ CullResult User::cull()
 	return Extensible::cull();
 }
 
+void LocalUser::AddGenerator(Numeric::Generator* gen)
+{
+	if ((quitting) || (quitting_sendq))
+	{
+		delete gen;
+		return;
+	}
+
+	generators.push_back(gen);
+	RunGenerators();
+}
+
+void LocalUser::RunGenerators()
+{
+	// Replies which are held in memory count as if they were in the sendq already.
+	size_t pending = 0;
+	for (std::deque<Numeric::Generator*>::const_iterator i = generators.begin(); i != generators.end(); ++i)
+		pending += (*i)->GetPendingSize();
+
+	if ((!quitting) && (!quitting_sendq) && (eh.getSendQSize() + pending > MyClass->GetSendqHardMax()) && (!HasPrivPermission("users/flood/increased-buffers")))
+	{
+		RemoveGenerators(NULL);
+		quitting_sendq = true;
+		ServerInstance->GlobalCulls.AddSQItem(this);
+		return;
+	}
+
+	const unsigned long sendqlimit = MyClass->GetSendqSoftMax();
+	while ((!generators.empty()) && (!quitting) && (!quitting_sendq) && (eh.getSendQSize() < sendqlimit))
+	{
+		Numeric::Generator* const gen = generators.front();
+		if (!gen->Generate(this))
+		{
+			generators.pop_front();
+			delete gen;
+		}
+	}
+}
+
+void LocalUser::RemoveGenerators(Module* mod)
+{
+	for (std::deque<Numeric::Generator*>::iterator i = generators.begin(); i != generators.end(); )
+	{
+		Numeric::Generator* const gen = *i;
+		if ((mod) && (gen->creator != mod))
+		{
+			++i;
+			continue;
+		}
+
+		i = generators.erase(i);
+		delete gen;
+	}
+}
+
 CullResult LocalUser::cull()
 {
+	RemoveGenerators(NULL);
 	eh.cull();
 	return User::cull();
 }
@@ -806,6 +879,14 @@ void LocalUser::Send(ClientProtocol::Event& protoev)
 		return;
 	}
 
+	// Take the short path if nothing can alter or block the message for this user
+	ClientProtocol::Message* const msg = protoev.GetUnhookedMessage();
+	if ((msg) && (!ServerInstance->Modules->HasEventHandlers(I_OnUserWrite)))
+	{
+		Write(serializer->SerializeForUser(this, *msg));
+		return;
+	}
+
 	// In the most common case a static LocalUser field, sendmsglist, is passed to the event to be
 	// populated. The list is cleared before returning.
 	// To handle re-enters, if sendmsglist is non-empty upon entering the method then a temporary
@@ -941,6 +1022,30 @@ void User::ForEachNeighbor(ForEachNeighborHandler& handler, bool include_self)
 	}
 }
 
+CUList::~CUList()
+{
+	for (std::vector<User*>::const_iterator i = marked.begin(); i != marked.end(); ++i)
+		(*i)->except_id = 0;
+}
+
+void CUList::insert(User* user)
+{
+	if (!id)
+		id = ServerInstance->Users.NextAlreadySentId();
+	else if (user->except_id == id)
+		return;
+
+	if ((user->except_id) || ((!shared.empty()) && (shared.count(user))))
+	{
+		// Another live list has marked this user.
+		shared.insert(user);
+		return;
+	}
+
+	user->except_id = id;
+	marked.push_back(user);
+}
+
 void User::WriteRemoteNumeric(const Numeric::Numeric& numeric)
 {
 	WriteNumeric(numeric);